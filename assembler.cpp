@@ -3,35 +3,72 @@
 #include "cpu_base.h"
 #include "instr.h"
 #include "log.h"
+#include "object.h"
 #include "opcode.h"
+#include "perfect_hash.h"
+#include "preprocessor.h"
 #include "reg.h"
+#include "symbol_table.h"
 
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
+#include <cerrno>
 #include <charconv>
 #include <cstring>
 #include <ctype.h>
 #include <format>
+#include <limits>
+#include <memory>
 #include <optional>
 #include <span>
 #include <system_error>
-#include <unordered_map>
+#include <thread>
+#include <unistd.h>
 #include <utility>
+#include <vector>
 
 static logger logger{__FILE__};
 
-struct instr_assembler
+// how much of the program each thread gets at least, see assemble_object()
+static size_t constexpr k_min_chunk_bytes = 256 * 1024;
+
+// How many words disassemble() decodes at once, and the most text one of them can turn into,
+// counting the newline before it.
+static size_t constexpr k_disassemble_block_words = 4096;
+static size_t constexpr k_max_line_chars = k_max_instr_chars + 1;
+
+// Assembles a module in one go: each line is emitted as soon as it's read, and a jump or call to a
+// label that hasn't been seen yet is emitted pointing at itself and noted down, to be filled in
+// by finish(). So what we keep besides the output is proportional to the number of labels and
+// references to them, and a mnemonic can emit as many instructions as it likes.
+//
+// A module can also be assembled in chunks, see assemble_object(), each starting in section. Then
+// labels in the same chunk aren't any use either, since there's no telling where the chunk will
+// go, so every jump and call to a label gets a relocation and finish() leaves them all alone.
+struct module_assembler
 {
-    instr_assembler(std::span<std::string_view> tokens, word_t instr_offset,
-                    std::unordered_map<std::string_view, word_t> const & labels,
-                    std::vector<uint8_t> * rom)
-        : tokens_{tokens}
-        , instr_offset_{instr_offset}
-        , labels_{labels}
-        , rom_{rom}
+    explicit module_assembler(section_kind section = section_kind::code, bool is_chunk = false)
+        : section_{section}
+        , is_chunk_{is_chunk}
     { }
 
-    void assemble();
+    // assemble one line, which isn't blank, a comment, or a label
+    void assemble(std::span<std::string_view const> tokens);
+
+    // what follows a label is at label
+    void define_label(std::string_view label);
+
+    // put what follows in section
+    void set_section(section_kind section)
+    {
+        section_ = section;
+    }
+
+    // Fill in every jump and call to a label this module defines, and leave the rest to the
+    // linker. Or for a chunk, fill in nothing.
+    object_module finish();
 
 private:
     template <typename word_type>
@@ -44,8 +81,26 @@ private:
         return value;
     }
 
+    // where the next instruction goes in the current section
+    word_t here() const
+    {
+        return static_cast<word_t>(module_.section(section_).size());
+    }
+
     void push_instr(instr ii);
 
+    // The offset from the next instruction to the jump or call target in tokens_[0]: a number, or
+    // a label we've already seen in this section. Otherwise it's 0 for now, and there's a
+    // relocation for finish() or the linker to deal with.
+    signed_word_t target_offset();
+
+    // where label is in module_.symbols, adding it (as undefined) if it's not there yet
+    uint32_t symbol_index(std::string_view label);
+
+    void assemble_word();
+
+    void assemble_mov();
+
     void assemble_set();
 
     void assemble_load_store(word_t width, bool is_load);
@@ -82,67 +137,168 @@ private:
 
     void assemble_call();
 
-    using assemble_fn = void (instr_assembler::*)();
-
-    static inline std::pair<char const *, assemble_fn> dispatch_table[]{
-        {"set", &instr_assembler::assemble_set},
-        {"store.1", &instr_assembler::assemble_load_store<1, false>},
-        {"store.2", &instr_assembler::assemble_load_store<2, false>},
-        {"store.4", &instr_assembler::assemble_load_store<4, false>},
-        {"store", &instr_assembler::assemble_load_store<4, false>},
-        {"load.1", &instr_assembler::assemble_load_store<1, true>},
-        {"load.2", &instr_assembler::assemble_load_store<2, true>},
-        {"load.4", &instr_assembler::assemble_load_store<4, true>},
-        {"load", &instr_assembler::assemble_load_store<4, true>},
-        {"add", &instr_assembler::assemble_add},
-        {"sub", &instr_assembler::assemble_sub},
-        {"halt", &instr_assembler::assemble_halt},
-        {"compare", &instr_assembler::assemble_compare},
-        {"jump.eq", &instr_assembler::assemble_jump<instr::eq>},
-        {"jump.ne", &instr_assembler::assemble_jump<instr::ne>},
-        {"jump.gt", &instr_assembler::assemble_jump<instr::gt>},
-        {"jump.ge", &instr_assembler::assemble_jump<instr::ge>},
-        {"jump.lt", &instr_assembler::assemble_jump<instr::lt>},
-        {"jump.le", &instr_assembler::assemble_jump<instr::le>},
-        {"jump", &instr_assembler::assemble_jump<instr::unc>},
-        {"jump.unc", &instr_assembler::assemble_jump<instr::unc>},
-        {"ijump.eq", &instr_assembler::assemble_ijump<instr::eq>},
-        {"ijump.ne", &instr_assembler::assemble_ijump<instr::ne>},
-        {"ijump.gt", &instr_assembler::assemble_ijump<instr::gt>},
-        {"ijump.ge", &instr_assembler::assemble_ijump<instr::ge>},
-        {"ijump.lt", &instr_assembler::assemble_ijump<instr::lt>},
-        {"ijump.le", &instr_assembler::assemble_ijump<instr::le>},
-        {"ijump", &instr_assembler::assemble_ijump<instr::unc>},
-        {"ijump.unc", &instr_assembler::assemble_ijump<instr::unc>},
-        {"call", &instr_assembler::assemble_call},
+    using assemble_fn = void (module_assembler::*)();
+
+    struct mnemonic
+    {
+        std::string_view name;
+        assemble_fn fn;
+    };
+
+    static constexpr mnemonic k_mnemonics[]{
+        {".word", &module_assembler::assemble_word},
+        {"set", &module_assembler::assemble_set},
+        {"store.1", &module_assembler::assemble_load_store<1, false>},
+        {"store.2", &module_assembler::assemble_load_store<2, false>},
+        {"store.4", &module_assembler::assemble_load_store<4, false>},
+        {"store", &module_assembler::assemble_load_store<4, false>},
+        {"load.1", &module_assembler::assemble_load_store<1, true>},
+        {"load.2", &module_assembler::assemble_load_store<2, true>},
+        {"load.4", &module_assembler::assemble_load_store<4, true>},
+        {"load", &module_assembler::assemble_load_store<4, true>},
+        {"mov", &module_assembler::assemble_mov},
+        {"add", &module_assembler::assemble_add},
+        {"sub", &module_assembler::assemble_sub},
+        {"halt", &module_assembler::assemble_halt},
+        {"compare", &module_assembler::assemble_compare},
+        {"jump.eq", &module_assembler::assemble_jump<instr::eq>},
+        {"jump.ne", &module_assembler::assemble_jump<instr::ne>},
+        {"jump.gt", &module_assembler::assemble_jump<instr::gt>},
+        {"jump.ge", &module_assembler::assemble_jump<instr::ge>},
+        {"jump.lt", &module_assembler::assemble_jump<instr::lt>},
+        {"jump.le", &module_assembler::assemble_jump<instr::le>},
+        {"jump", &module_assembler::assemble_jump<instr::unc>},
+        {"jump.unc", &module_assembler::assemble_jump<instr::unc>},
+        {"ijump.eq", &module_assembler::assemble_ijump<instr::eq>},
+        {"ijump.ne", &module_assembler::assemble_ijump<instr::ne>},
+        {"ijump.gt", &module_assembler::assemble_ijump<instr::gt>},
+        {"ijump.ge", &module_assembler::assemble_ijump<instr::ge>},
+        {"ijump.lt", &module_assembler::assemble_ijump<instr::lt>},
+        {"ijump.le", &module_assembler::assemble_ijump<instr::le>},
+        {"ijump", &module_assembler::assemble_ijump<instr::unc>},
+        {"ijump.unc", &module_assembler::assemble_ijump<instr::unc>},
+        {"call", &module_assembler::assemble_call},
     };
 
-    std::span<std::string_view> tokens_;
-    word_t const instr_offset_;
-    std::unordered_map<std::string_view, word_t> const & labels_;
-    std::vector<uint8_t> * const rom_;
+    static constexpr auto k_mnemonic_hash = make_perfect_hash(k_mnemonics, &mnemonic::name);
+
+    std::span<std::string_view const> tokens_;
+    section_kind section_;
+    bool const is_chunk_;
+
+    // where each label is in module_.symbols
+    symbol_table symbols_;
+    object_module module_;
 };
 
-void instr_assembler::assemble()
+void module_assembler::assemble(std::span<std::string_view const> tokens)
 {
-    for (auto & [str, fn] : dispatch_table) {
-        if (tokens_[0] == str) {
-            tokens_ = tokens_.subspan(1);
-            (this->*fn)();
-            return;
-        }
+    std::optional<size_t> index = k_mnemonic_hash.find(tokens[0]);
+    assert(index.has_value());
+    tokens_ = tokens.subspan(1);
+    (this->*k_mnemonics[*index].fn)();
+}
+
+void module_assembler::define_label(std::string_view label)
+{
+    object_module::symbol & sym = module_.symbols[symbol_index(label)];
+    assert(!sym.section);
+    sym.section = section_;
+    sym.offset = here();
+}
+
+// Fill in the jump or call at reloc if its label is defined, returning whether it was.
+static bool resolve(object_module * module, object_module::relocation const & reloc)
+{
+    object_module::symbol const & sym = module->symbols[reloc.symbol];
+    if (!sym.section) {
+        return false;
     }
-    assert(false);
+    assert(*sym.section == reloc.section);
+    uint8_t * site = module->section(reloc.section).data() + reloc.offset;
+    instr ii{0};
+    memcpy(&ii.storage, site, sizeof(word_t));
+    bool reaches = ii.retarget(static_cast<signed_word_t>(sym.offset - reloc.offset));
+    assert(reaches);
+    memcpy(site, &ii.storage, sizeof(word_t));
+    return true;
 }
 
-void instr_assembler::push_instr(instr ii)
+// point every relocated jump and call to a label module defines at it, and drop its relocation
+static void resolve_relocations(object_module * module)
 {
-    auto it = rom_->insert(rom_->end(), sizeof(word_t), 0);
-    logger.debug("rom->size() = {}, emit instr {}", rom_->size(), ii);
+    std::erase_if(module->relocations, [module](object_module::relocation const & reloc) {
+        return resolve(module, reloc);
+    });
+}
+
+object_module module_assembler::finish()
+{
+    if (!is_chunk_) {
+        resolve_relocations(&module_);
+    }
+    return std::move(module_);
+}
+
+void module_assembler::push_instr(instr ii)
+{
+    std::vector<uint8_t> & bytes = module_.section(section_);
+    auto it = bytes.insert(bytes.end(), sizeof(word_t), 0);
+    logger.debug("section size = {}, emit instr {}", bytes.size(), ii);
     memcpy(&*it, &ii.storage, sizeof(word_t));
 }
 
-void instr_assembler::assemble_set()
+signed_word_t module_assembler::target_offset()
+{
+    std::string_view target = tokens_[0];
+    if (!isalpha(target.front())) {
+        return parse_word<signed_word_t>(target);
+    }
+
+    uint32_t index = symbol_index(target);
+    object_module::symbol const & sym = module_.symbols[index];
+    if (!sym.section || is_chunk_) {
+        module_.relocations.push_back({section_, here(), index});
+        return 0;
+    }
+    assert(*sym.section == section_);
+    return static_cast<signed_word_t>(sym.offset - here());
+}
+
+uint32_t module_assembler::symbol_index(std::string_view label)
+{
+    auto [index, inserted] =
+        symbols_.try_emplace(label, static_cast<uint32_t>(module_.symbols.size()));
+    if (inserted) {
+        module_.symbols.push_back({std::string{label}, std::nullopt, 0});
+    }
+    return index;
+}
+
+void module_assembler::assemble_word()
+{
+    assert(tokens_.size() == 1);
+    push_instr(instr{parse_word<word_t>(tokens_[0])});
+}
+
+void module_assembler::assemble_mov()
+{
+    assert(tokens_.size() == 2);
+
+    std::optional<reg> dst_reg = from_str<reg>(tokens_[0]);
+    assert(dst_reg.has_value());
+
+    std::optional<reg> src_reg = from_str<reg>(tokens_[1]);
+    assert(src_reg.has_value());
+
+    // there's no move instruction, but clearing dst and adding src to it does the same
+    if (*dst_reg != *src_reg) {
+        push_instr(instr::sub(*dst_reg, *dst_reg));
+        push_instr(instr::add(*dst_reg, *src_reg));
+    }
+}
+
+void module_assembler::assemble_set()
 {
     assert(tokens_.size() == 2);
     std::optional<reg> dest_reg = from_str<reg>(tokens_[0]);
@@ -154,7 +310,7 @@ void instr_assembler::assemble_set()
     push_instr(instr::set(*dest_reg, value));
 }
 
-void instr_assembler::assemble_load_store(word_t width, bool is_load)
+void module_assembler::assemble_load_store(word_t width, bool is_load)
 {
     assert(tokens_.size() == 2);
 
@@ -168,7 +324,7 @@ void instr_assembler::assemble_load_store(word_t width, bool is_load)
     push_instr(ctor(*lhs_reg, *rhs_reg, width));
 }
 
-void instr_assembler::assemble_add()
+void module_assembler::assemble_add()
 {
     assert(tokens_.size() == 2);
 
@@ -181,7 +337,7 @@ void instr_assembler::assemble_add()
     push_instr(instr::add(*dst_reg, *op1_reg));
 }
 
-void instr_assembler::assemble_sub()
+void module_assembler::assemble_sub()
 {
     assert(tokens_.size() == 2);
 
@@ -194,14 +350,14 @@ void instr_assembler::assemble_sub()
     push_instr(instr::sub(*dst_reg, *op1_reg));
 }
 
-void instr_assembler::assemble_halt()
+void module_assembler::assemble_halt()
 {
     assert(tokens_.size() == 0);
 
     push_instr(instr::halt());
 }
 
-void instr_assembler::assemble_compare()
+void module_assembler::assemble_compare()
 {
     assert(tokens_.size() == 2);
 
@@ -214,22 +370,16 @@ void instr_assembler::assemble_compare()
     push_instr(instr::compare(*op1_reg, *op2_reg));
 }
 
-void instr_assembler::assemble_jump(cmp_flag flag)
+void module_assembler::assemble_jump(cmp_flag flag)
 {
     assert(tokens_.size() == 1);
 
-    auto it = labels_.find(tokens_[0]);
-    signed_word_t offset;
-    if (it != labels_.end()) {
-        offset = it->second - instr_offset_;
-    } else {
-        offset = parse_word<signed_word_t>(tokens_[0]);
-    }
+    signed_word_t offset = target_offset();
     assert(instr::k_jump_min_offset <= offset && offset <= instr::k_jump_max_offset);
     push_instr(instr::jump(flag, offset));
 }
 
-void instr_assembler::assemble_ijump(cmp_flag flag)
+void module_assembler::assemble_ijump(cmp_flag flag)
 {
     assert(tokens_.size() == 1);
 
@@ -239,138 +389,574 @@ void instr_assembler::assemble_ijump(cmp_flag flag)
     push_instr(instr::ijump(flag, *loc));
 }
 
-void instr_assembler::assemble_call()
+void module_assembler::assemble_call()
 {
     assert(tokens_.size() == 1);
 
-    auto it = labels_.find(tokens_[0]);
-    signed_word_t offset;
-    if (it != labels_.end()) {
-        offset = it->second - instr_offset_;
-    } else {
-        offset = parse_word<signed_word_t>(tokens_[0]);
-    }
+    signed_word_t offset = target_offset();
 
     assert(instr::k_call_min_offset <= offset && offset <= instr::k_call_max_offset);
     push_instr(instr::call(offset));
 }
 
-static std::vector<std::string_view> tokenize_line(std::string_view line)
+// The tokens on one line, up to any comment, in a fixed buffer so that tokenizing doesn't
+// allocate. Nothing takes more than k_max_tokens.
+struct line_tokens
 {
-    size_t start = 0;
-    std::vector<std::string_view> tokens;
+    static size_t constexpr k_max_tokens = 4;
+
+    std::span<std::string_view const> span() const
+    {
+        return {tokens, size};
+    }
+
+    std::string_view tokens[k_max_tokens];
+    size_t size = 0;
+};
+
+static void tokenize_line(std::string_view line, line_tokens * out)
+{
+    out->size = 0;
+    char const * p = line.data();
+    char const * const end = p + line.size();
     while (true) {
-        start = line.find_first_not_of(' ', start);
-        if (start == std::string_view::npos) {
-            break;
+        while (p != end && *p == ' ') {
+            ++p;
+        }
+        // a token starting with # starts a comment
+        if (p == end || *p == '#') {
+            return;
+        }
+        char const * start = p;
+        while (p != end && *p != ' ') {
+            ++p;
         }
-        size_t end = line.find(' ', start);
+        assert(out->size < line_tokens::k_max_tokens);
+        out->tokens[out->size++] = std::string_view{start, p};
+    }
+}
+
+static bool is_label(std::span<std::string_view const> tokens, std::string_view * label)
+{
+    if (tokens.size() == 1 && tokens[0].back() == ':') {
+        *label = tokens[0].substr(0, tokens[0].size() - 1);
+        assert(!from_str<reg>(*label) && !from_str<opcode>(*label) && label->size() > 0
+               && isalpha(label->front()));
+        return true;
+    }
+    return false;
+}
+
+// call fn with each line of text
+template <typename fn_t>
+static void for_each_line(std::string_view text, fn_t && fn)
+{
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
         if (end == std::string_view::npos) {
-            end = line.size();
+            end = text.size();
         }
-        std::string_view token = line.substr(start, end - start);
-        if (token.size() == 0) {
-            break;
+        fn(text.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+static void assemble_lines(std::string_view text, module_assembler * assembler)
+{
+    line_tokens buffer;
+    for_each_line(text, [&](std::string_view line) {
+        tokenize_line(line, &buffer);
+        std::span<std::string_view const> tokens = buffer.span();
+        if (tokens.size() == 0) {
+            return;
         }
-        start = end;
 
-        logger.debug("parse token {}, size {}", token, token.size());
+        std::string_view label;
+        if (tokens[0] == ".section") {
+            assert(tokens.size() == 2);
+            std::optional<section_kind> kind = from_str<section_kind>(tokens[1]);
+            assert(kind.has_value());
+            assembler->set_section(*kind);
+        } else if (is_label(tokens, &label)) {
+            assembler->define_label(label);
+        } else {
+            assembler->assemble(tokens);
+        }
+    });
+}
 
-        tokens.push_back(token);
+// the section the last .section in text switches to, if there is one
+static std::optional<section_kind> last_section(std::string_view text)
+{
+    std::string_view constexpr k_directive = ".section";
+    std::optional<section_kind> section;
+    line_tokens buffer;
+    for_each_line(text, [&](std::string_view line) {
+        // only tokenize lines that might be one
+        size_t start = line.find_first_not_of(' ');
+        if (start == std::string_view::npos || !line.substr(start).starts_with(k_directive)) {
+            return;
+        }
+        tokenize_line(line, &buffer);
+        if (buffer.size == 2 && buffer.tokens[0] == k_directive) {
+            section = from_str<section_kind>(buffer.tokens[1]);
+        }
+    });
+    return section;
+}
+
+// Add chunk onto the end of merged, where indices says which of merged->symbols each of the
+// chunk's symbols is.
+static void append_chunk(object_module const & chunk, std::span<uint32_t const> indices,
+                         object_module * merged)
+{
+    std::array<word_t, k_num_section_kinds> bases;
+    for (section_kind kind : k_all_section_kinds) {
+        bases[std::to_underlying(kind)] = static_cast<word_t>(merged->section(kind).size());
+    }
+
+    for (size_t i = 0; i < chunk.symbols.size(); ++i) {
+        object_module::symbol const & sym = chunk.symbols[i];
+        if (sym.section) {
+            object_module::symbol & defined = merged->symbols[indices[i]];
+            assert(!defined.section);
+            defined.section = sym.section;
+            defined.offset = bases[std::to_underlying(*sym.section)] + sym.offset;
+        }
+    }
+    for (object_module::relocation const & reloc : chunk.relocations) {
+        merged->relocations.push_back({reloc.section,
+                                       bases[std::to_underlying(reloc.section)] + reloc.offset,
+                                       indices[reloc.symbol]});
+    }
+    for (section_kind kind : k_all_section_kinds) {
+        std::vector<uint8_t> const & bytes = chunk.section(kind);
+        merged->section(kind).insert(merged->section(kind).end(), bytes.begin(), bytes.end());
     }
-    return tokens;
 }
 
-static bool is_comment(std::string_view token)
+// Put modules assembled from consecutive chunks of a program back together into what assembling
+// the whole thing at once would have made.
+static object_module merge_chunks(std::span<object_module const> chunks)
 {
-    return token[0] == '#';
+    object_module merged;
+    symbol_table symbols;
+    std::vector<uint32_t> indices;
+    for (object_module const & chunk : chunks) {
+        // where each of the chunk's symbols is in merged.symbols
+        indices.clear();
+        for (object_module::symbol const & sym : chunk.symbols) {
+            auto [index, inserted] =
+                symbols.try_emplace(sym.name, static_cast<uint32_t>(merged.symbols.size()));
+            if (inserted) {
+                merged.symbols.push_back({sym.name, std::nullopt, 0});
+            }
+            indices.push_back(index);
+        }
+        append_chunk(chunk, indices, &merged);
+    }
+    resolve_relocations(&merged);
+    return merged;
 }
 
-static void strip_comments(std::vector<std::string_view> * tokens)
+// run fn(0) to fn(n - 1), each on its own thread
+template <typename fn_t>
+static void run_parallel(size_t n, fn_t const & fn)
 {
-    tokens->erase(std::find_if(tokens->begin(), tokens->end(), is_comment), tokens->end());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n; ++i) {
+        threads.emplace_back(fn, i);
+    }
+    fn(0);
+    for (std::thread & thread : threads) {
+        thread.join();
+    }
 }
 
-static bool is_label(std::span<std::string_view const> tokens, std::string_view * label)
+object_module assemble_object(std::string_view program, size_t num_threads)
 {
-    if (tokens.size() == 1 && tokens[0].back() == ':') {
-        *label = tokens[0].substr(0, tokens[0].size() - 1);
-        assert(!from_str<reg>(*label) && !from_str<opcode>(*label) && label->size() > 0
-               && isalpha(label->front()));
-        return true;
+    if (num_threads == 0) {
+        num_threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u),
+                                       program.size() / k_min_chunk_bytes);
     }
-    return false;
+    if (num_threads <= 1) {
+        module_assembler assembler;
+        assemble_lines(program, &assembler);
+        return assembler.finish();
+    }
+
+    // about the same size each, and ending with a whole line
+    std::vector<std::string_view> chunks;
+    size_t start = 0;
+    for (size_t i = 1; i <= num_threads; ++i) {
+        size_t end = program.size() * i / num_threads;
+        end = std::max(end, start);
+        if (end < program.size()) {
+            end = std::min(program.find('\n', end), program.size());
+        }
+        chunks.push_back(program.substr(start, end - start));
+        start = std::min(end + 1, program.size());
+    }
+
+    // Each chunk starts in whatever section the last one before it with a .section left us in.
+    // Looking for those is much quicker than assembling, so it's not worth doing anything cleverer.
+    std::vector<std::optional<section_kind>> last_sections(chunks.size());
+    run_parallel(chunks.size(), [&](size_t i) { last_sections[i] = last_section(chunks[i]); });
+
+    std::vector<section_kind> first_sections(chunks.size(), section_kind::code);
+    for (size_t i = 1; i < chunks.size(); ++i) {
+        first_sections[i] = last_sections[i - 1].value_or(first_sections[i - 1]);
+    }
+
+    std::vector<object_module> modules(chunks.size());
+    run_parallel(chunks.size(), [&](size_t i) {
+        module_assembler assembler{first_sections[i], true};
+        assemble_lines(chunks[i], &assembler);
+        modules[i] = assembler.finish();
+    });
+    return merge_chunks(modules);
 }
 
-std::vector<uint8_t> assemble(std::string_view program)
+// Split program into units, each starting at a label (or the start of the program), and call
+// fn(text, section, hash) for each one with its text, the section it starts in, and a hash of its
+// tokens. Splits lines into tokens the same way tokenize_line() does, but without keeping them.
+template <typename fn_t>
+static void for_each_unit(std::string_view program, fn_t && fn)
 {
-    std::vector<uint8_t> rom;
+    auto mix = [](uint64_t hash, uint64_t value) {
+        hash = (hash ^ value) * 0x9e3779b97f4a7c15;
+        return hash ^ (hash >> 32);
+    };
 
-    // TODO: eventually some mnemonics may emit multiple instructions, so this way of doing things
-    // is fairly brittle. Instead of computing label offsets up front, then emitting instructions,
-    // I think we want to emit instructions first, then fill in ijump offsets at the very end
-    // once we've decided where everything is going to live.
-    std::unordered_map<std::string_view, word_t> labels;
-    std::vector<std::vector<std::string_view>> lines;
     size_t start = 0;
-    word_t word_offset = 0;
-    while (start < program.size()) {
-        size_t end = program.find('\n', start);
-        if (end == std::string_view::npos) {
-            end = program.size();
-            if (end == start) {
+    section_kind start_section = section_kind::code;
+    section_kind section = section_kind::code;
+    uint64_t hash = 0;
+    auto next_unit = [&](size_t end) {
+        if (end != start) {
+            fn(program.substr(start, end - start), start_section, hash);
+        }
+        start = end;
+        start_section = section;
+        hash = mix(0, std::to_underlying(section));
+    };
+    next_unit(0);
+
+    char const * const begin = program.data();
+    char const * const end = begin + program.size();
+    char const * p = begin;
+    while (p != end) {
+        char const * const line = p;
+
+        // Hash the line's tokens, so that only changes to them count. Their bytes are gathered
+        // into words first, so it's one mix per token (or per 8 bytes) rather than per byte.
+        uint64_t line_hash = 0;
+        size_t num_tokens = 0;
+        std::string_view first;
+        std::string_view second;
+        char last = 0;
+        while (true) {
+            while (p != end && *p == ' ') {
+                ++p;
+            }
+            if (p == end || *p == '\n' || *p == '#') {
                 break;
             }
+            char const * token = p;
+            uint64_t word = 0;
+            while (p != end && *p != ' ' && *p != '\n') {
+                word = (word << 8) | static_cast<uint8_t>(*p);
+                ++p;
+                if ((p - token) % 8 == 0) {
+                    line_hash = mix(line_hash, word);
+                    word = 0;
+                }
+            }
+            line_hash = mix(line_hash, word | uint64_t{1} << 63);
+            (num_tokens == 0 ? first : second) = std::string_view{token, p};
+            last = p[-1];
+            ++num_tokens;
+        }
+        // skip any comment, and the newline
+        if (p != end && *p != '\n') {
+            auto const * newline = static_cast<char const *>(memchr(p, '\n', end - p));
+            p = newline ? newline : end;
+        }
+        if (p != end) {
+            ++p;
         }
-        logger.debug("start={}, end={}", start, end);
 
-        std::string_view line = program.substr(start, end - start);
-        start = end + 1;
+        if (num_tokens == 1 && last == ':') {
+            next_unit(static_cast<size_t>(line - begin));
+        } else if (num_tokens == 2 && first == ".section") {
+            std::optional<section_kind> kind = from_str<section_kind>(second);
+            assert(kind.has_value());
+            section = *kind;
+        }
+        if (num_tokens != 0) {
+            hash = mix(hash, line_hash);
+        }
+    }
+    next_unit(program.size());
+}
 
-        logger.debug("parse line {}", line);
+struct incremental_assembler::unit
+{
+    // whether it's the same as other apart from the bytes of its instructions, so it can go where
+    // other was without moving anything else
+    bool same_layout(unit const & other) const
+    {
+        for (section_kind kind : k_all_section_kinds) {
+            if (module.section(kind).size() != other.module.section(kind).size()) {
+                return false;
+            }
+        }
+        return ids == other.ids && module.symbols == other.module.symbols
+               && module.relocations == other.module.relocations;
+    }
 
-        std::vector<std::string_view> tokens = tokenize_line(line);
-        strip_comments(&tokens);
-        if (tokens.size() == 0) {
-            continue;
+    // what it assembled to as a chunk, see assemble_object()
+    object_module module;
+
+    // where each of module.symbols is in names_
+    std::vector<uint32_t> ids;
+
+    // where each of its sections starts in result_
+    std::array<word_t, k_num_section_kinds> bases{};
+};
+
+incremental_assembler::incremental_assembler() = default;
+incremental_assembler::~incremental_assembler() = default;
+
+object_module const & incremental_assembler::assemble(std::string_view program)
+{
+    std::vector<std::unique_ptr<unit>> old = std::move(units_);
+    std::vector<uint64_t> old_hashes = std::move(hashes_);
+    units_.clear();
+    hashes_.clear();
+    num_assembled_ = 0;
+
+    // Where the old units are by hash, as their index plus one, with open addressing. Only made
+    // the first time a unit isn't right after the last one we found, which for most edits is once.
+    std::vector<uint32_t> by_hash;
+    auto find_old = [&](uint64_t hash) {
+        if (by_hash.empty()) {
+            by_hash.assign(std::bit_ceil(old.size() * 2 + 1), 0);
+            for (size_t i = 0; i < old.size(); ++i) {
+                if (old[i] != nullptr) {
+                    size_t slot = old_hashes[i] & (by_hash.size() - 1);
+                    while (by_hash[slot] != 0) {
+                        slot = (slot + 1) & (by_hash.size() - 1);
+                    }
+                    by_hash[slot] = static_cast<uint32_t>(i + 1);
+                }
+            }
+        }
+        for (size_t slot = hash & (by_hash.size() - 1); by_hash[slot] != 0;
+             slot = (slot + 1) & (by_hash.size() - 1)) {
+            size_t i = by_hash[slot] - 1;
+            if (old[i] != nullptr && old_hashes[i] == hash) {
+                return i;
+            }
         }
+        return old.size();
+    };
 
-        std::string_view label;
-        if (is_label(tokens, &label)) {
-            labels.emplace(label, word_offset);
-            continue;
+    // which of the old units each unit is, or old.size() for a new one
+    std::vector<size_t> from;
+    size_t next = 0;
+    for_each_unit(program, [&](std::string_view text, section_kind section, uint64_t hash) {
+        size_t i = next < old.size() && old_hashes[next] == hash && old[next] != nullptr
+                       ? next
+                       : find_old(hash);
+        if (i < old.size()) {
+            units_.push_back(std::move(old[i]));
+            next = i + 1;
+        } else {
+            auto fresh = std::make_unique<unit>();
+            module_assembler assembler{section, true};
+            assemble_lines(text, &assembler);
+            fresh->module = assembler.finish();
+            for (object_module::symbol const & sym : fresh->module.symbols) {
+                fresh->ids.push_back(
+                    names_.try_emplace(sym.name, static_cast<uint32_t>(names_.size())).first);
+            }
+            units_.push_back(std::move(fresh));
+            ++num_assembled_;
+        }
+        hashes_.push_back(hash);
+        from.push_back(i);
+    });
+
+    // The units at either end that are where they were last time. If the ones in between have the
+    // same layout as the ones they replaced, nothing else has moved.
+    size_t const num_units = units_.size();
+    size_t prefix = 0;
+    while (prefix < num_units && from[prefix] == prefix) {
+        ++prefix;
+    }
+    size_t suffix = 0;
+    while (suffix < num_units - prefix && suffix < old.size() - prefix
+           && from[num_units - 1 - suffix] == old.size() - 1 - suffix) {
+        ++suffix;
+    }
+    bool same_layout = num_units == old.size();
+    for (size_t i = prefix; same_layout && i < num_units - suffix; ++i) {
+        same_layout = old[i] != nullptr && units_[i]->same_layout(*old[i]);
+    }
+    if (!same_layout) {
+        merge();
+        return result_;
+    }
+
+    for (size_t i = prefix; i < num_units - suffix; ++i) {
+        unit & changed = *units_[i];
+        changed.bases = old[i]->bases;
+        for (section_kind kind : k_all_section_kinds) {
+            std::vector<uint8_t> const & bytes = changed.module.section(kind);
+            memcpy(result_.section(kind).data() + changed.bases[std::to_underlying(kind)],
+                   bytes.data(),
+                   bytes.size());
         }
 
-        lines.push_back(tokens);
+        // the ones to labels that aren't defined are still in result_.relocations
+        for (object_module::relocation const & reloc : changed.module.relocations) {
+            resolve(&result_,
+                    {reloc.section,
+                     changed.bases[std::to_underlying(reloc.section)] + reloc.offset,
+                     indices_[changed.ids[reloc.symbol]]});
+        }
+    }
+    return result_;
+}
 
-        word_offset += k_word_size;
+void incremental_assembler::merge()
+{
+    for (section_kind kind : k_all_section_kinds) {
+        result_.section(kind).clear();
+    }
+    result_.symbols.clear();
+    result_.relocations.clear();
+    indices_.assign(names_.size(), std::numeric_limits<uint32_t>::max());
+
+    std::vector<uint32_t> indices;
+    for (std::unique_ptr<unit> const & u : units_) {
+        indices.clear();
+        for (size_t i = 0; i < u->module.symbols.size(); ++i) {
+            uint32_t & index = indices_[u->ids[i]];
+            if (index == std::numeric_limits<uint32_t>::max()) {
+                index = static_cast<uint32_t>(result_.symbols.size());
+                result_.symbols.push_back({u->module.symbols[i].name, std::nullopt, 0});
+            }
+            indices.push_back(index);
+        }
+        for (section_kind kind : k_all_section_kinds) {
+            u->bases[std::to_underlying(kind)] = static_cast<word_t>(result_.section(kind).size());
+        }
+        append_chunk(u->module, indices, &result_);
     }
+    resolve_relocations(&result_);
+}
+
+std::vector<uint8_t> assemble(std::string_view program)
+{
+    object_module module = assemble_object(program);
 
-    word_offset = 0;
-    for (auto & line : lines) {
-        instr_assembler assembler{line, word_offset, labels, &rom};
-        assembler.assemble();
-        word_offset += k_word_size;
+    // a bare ROM has nowhere to put data, and nothing to resolve labels from other modules
+    assert(module.relocations.empty() && module.data.empty());
+    return std::move(module.code);
+}
+
+// The first step of disassembling a block of words: copy them out of rom, pick out their opcodes,
+// and note which are the same as the one before, all in simple loops for the compiler to vectorize.
+SIMD_CLONES static void decode_block(uint8_t const * rom, size_t num_words, word_t * words,
+                                     uint8_t * opcodes, uint8_t * repeats)
+{
+    memcpy(words, rom, num_words * k_word_size);
+    for (size_t i = 0; i < num_words; ++i) {
+        opcodes[i] = static_cast<uint8_t>(words[i] & k_opcode_mask);
     }
+    repeats[0] = 0;
+    for (size_t i = 1; i < num_words; ++i) {
+        repeats[i] = words[i] == words[i - 1];
+    }
+}
 
-    return rom;
+// Disassemble up to k_disassemble_block_words words from rom into out, which has room for
+// k_max_line_chars for each, and return where the text ends. Every line but the ROM's first gets
+// a newline before it.
+static char * disassemble_block(uint8_t const * rom, size_t num_words, bool first, char * out)
+{
+    word_t words[k_disassemble_block_words];
+    uint8_t opcodes[k_disassemble_block_words];
+    uint8_t repeats[k_disassemble_block_words];
+    decode_block(rom, num_words, words, opcodes, repeats);
+
+    // a run of the same word (like the zeros a ROM is padded with) gets its text copied
+    char const * line = out;
+    size_t line_size = 0;
+    for (size_t i = 0; i < num_words; ++i) {
+        if (i != 0 || !first) {
+            *out++ = '\n';
+        }
+        if (repeats[i]) {
+            memcpy(out, line, line_size);
+            out += line_size;
+            continue;
+        }
+        line = out;
+        out = opcodes[i] < k_num_opcodes ? format_instr(out, instr{words[i]})
+                                         : std::format_to(out, "unknown");
+        line_size = static_cast<size_t>(out - line);
+    }
+    return out;
 }
 
 std::string disassemble(std::span<uint8_t const> rom)
 {
     assert(rom.size() % k_word_size == 0);
+    size_t const num_words = rom.size() / k_word_size;
 
+    // room for the longest line every time, then cut down to what we actually wrote
     std::string ret;
-    for (size_t offset = 0; offset < rom.size(); offset += k_word_size) {
-        if (offset != 0) {
-            ret += "\n";
+    ret.resize_and_overwrite(num_words * k_max_line_chars, [&](char * buffer, size_t) {
+        char * out = buffer;
+        for (size_t start = 0; start < num_words; start += k_disassemble_block_words) {
+            out = disassemble_block(rom.data() + start * k_word_size,
+                                    std::min(k_disassemble_block_words, num_words - start),
+                                    start == 0,
+                                    out);
         }
+        return static_cast<size_t>(out - buffer);
+    });
+    return ret;
+}
 
-        word_t raw_instr;
-        memcpy(&raw_instr, rom.data() + offset, sizeof(raw_instr));
-
-        instr ii{raw_instr};
-        ret += std::format("{}", ii);
+bool disassemble(std::span<uint8_t const> rom, int fd)
+{
+    assert(rom.size() % k_word_size == 0);
+    size_t const num_words = rom.size() / k_word_size;
+
+    std::unique_ptr<char[]> buffer{new char[k_disassemble_block_words * k_max_line_chars]};
+    for (size_t start = 0; start < num_words; start += k_disassemble_block_words) {
+        char const * const end =
+            disassemble_block(rom.data() + start * k_word_size,
+                              std::min(k_disassemble_block_words, num_words - start),
+                              start == 0,
+                              buffer.get());
+        for (char const * p = buffer.get(); p != end;) {
+            ssize_t written = write(fd, p, static_cast<size_t>(end - p));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                logger.err("couldn't write disassembly to fd {}: errno {}", fd, errno);
+                return false;
+            }
+            // a short write just means going around again for the rest
+            p += written;
+        }
     }
-    return ret;
+    return true;
 }
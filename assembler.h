@@ -1,11 +1,87 @@
 #pragma once
 
+#include "object.h"
+#include "symbol_table.h"
+
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <span>
 #include <string>
 #include <string_view>
 #include <vector>
 
+// Assemble a whole program into a ROM, which has to be all code and can't use labels it doesn't
+// define.
 std::vector<uint8_t> assemble(std::string_view prog);
 
+// Assemble one module of a program, see object_module. `.section code` or `.section data` puts
+// what follows in that section (code is the default), and `.word <n>` is a word with value n.
+// `mov <dst> <src>` copies a register with two instructions. Jumps and calls to labels the module
+// doesn't define are left for the linker.
+//
+// Big programs are cut into pieces at line boundaries and assembled on up to num_threads threads
+// at once, 0 meaning as many as the machine has cores (but only one per 256 KiB or so of
+// source). The result is the same however many there are.
+object_module assemble_object(std::string_view prog, size_t num_threads = 0);
+
+// Assembles one program over and over as it's edited, only redoing the parts that changed. The
+// program is split into units at each label, and a unit with the same tokens as one last time (so
+// changes to comments and spacing don't count) reuses what it was assembled to then.
+//
+// When the units that changed still take up the same space and define and use the same labels at
+// the same places, which covers most edits that don't add or remove instructions, nothing else
+// moves: the new units are copied over the old ones in the last result and only their own jumps and
+// calls are filled in again. Otherwise everything is put back together from the units, which goes
+// over the whole program but is mostly copying. Either way, finding the units still means reading
+// all of the program.
+//
+// Gives the same result as assemble_object(). It stays ours, and changes on the next assemble().
+struct incremental_assembler
+{
+    incremental_assembler();
+    ~incremental_assembler();
+
+    incremental_assembler(incremental_assembler const &) = delete;
+    incremental_assembler & operator=(incremental_assembler const &) = delete;
+
+    object_module const & assemble(std::string_view program);
+
+    // how many units the last program had, and how many of them had to be assembled
+    size_t num_units() const
+    {
+        return units_.size();
+    }
+
+    size_t num_assembled() const
+    {
+        return num_assembled_;
+    }
+
+private:
+    struct unit;
+
+    // put result_ back together from units_, which have changed from last time
+    void merge();
+
+    // last time's units, in program order, and the hashes of their tokens
+    std::vector<std::unique_ptr<unit>> units_;
+    std::vector<uint64_t> hashes_;
+
+    // every symbol name any unit has had, which is where unit::ids point
+    symbol_table names_;
+
+    // where each of names_ is in result_.symbols, as of the last merge()
+    std::vector<uint32_t> indices_;
+
+    object_module result_;
+    size_t num_assembled_ = 0;
+};
+
+// One instruction per line, with no newline after the last. The text is formatted straight into
+// one buffer sized for the longest line each word could make, a block of words at a time.
 std::string disassemble(std::span<uint8_t const> rom);
+
+// Write the same text to fd, a block at a time, so a big ROM never needs more than a block's worth
+// of it in memory. False (and an error logged) if writing fails. fd is left open.
+bool disassemble(std::span<uint8_t const> rom, int fd);
@@ -0,0 +1,127 @@
+#include "assembler.h"
+#include "bench.h"
+#include "cpu_base.h"
+#include "instr.h"
+#include "log.h"
+#include "object.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static logger logger{__FILE__};
+
+// A big generated program: lots of small functions, each with a loop and a forward branch, and
+// calls back to earlier functions.
+static std::string make_large_source(size_t num_functions)
+{
+    std::string source;
+    for (size_t i = 0; i < num_functions; ++i) {
+        source += std::format(R"(
+# function {0}
+function_{0}:
+    set r1 {1}
+    set r2 1
+loop_{0}:
+    sub r1 r2
+    compare r1 r2    # until it's 1
+    jump.gt loop_{0}
+    jump.eq done_{0}
+    call function_{2}
+done_{0}:
+    load.4 r3 r14
+    store.2 r14 r3
+    mov r4 r5
+    ijump r15
+)",
+                              i,
+                              i % 1000,
+                              i / 2);
+    }
+    return source;
+}
+
+BENCH("assembler.large")
+{
+    for (size_t num_functions : {1000, 100000}) {
+        std::string const source = make_large_source(num_functions);
+        // one thread, and as many as it likes
+        for (size_t num_threads : {1, 0}) {
+            std::chrono::nanoseconds per_run =
+                time_per_call([&] { assemble_object(source, num_threads); });
+            logger.info("  {:>10} bytes, {} threads: {:>12} ns, {:.1f} MB/s",
+                        source.size(),
+                        num_threads == 0 ? "all" : "1",
+                        per_run.count(),
+                        static_cast<double>(source.size()) * 1e3 / per_run.count());
+        }
+    }
+}
+
+BENCH("assembler.incremental")
+{
+    std::string const source = make_large_source(100000);
+    std::chrono::nanoseconds full = time_per_call([&] { assemble_object(source, 1); });
+    logger.info("  {:>10} bytes: full {:>12} ns", source.size(), full.count());
+
+    // versions of it with one function changed, in a way that doesn't move anything and one that
+    // moves everything after it
+    size_t const at = source.find("set r1 500");
+    std::string same_size = source;
+    same_size.replace(at, 10, "set r1 501");
+    std::string bigger = source;
+    bigger.insert(at, "mov r6 r7\n    ");
+
+    for (std::string const * edited : {&same_size, &bigger}) {
+        // only time what happens after the first time
+        incremental_assembler assembler;
+        assembler.assemble(source);
+        bool which = true;
+        std::chrono::nanoseconds incremental = time_per_call([&] {
+            assembler.assemble(which ? *edited : source);
+            which = !which;
+        });
+        logger.info("  {:>10} bytes: after {} edit {:>12} ns",
+                    source.size(),
+                    edited == &same_size ? "a same-size" : "a growing  ",
+                    incremental.count());
+    }
+}
+
+BENCH("assembler.disassemble")
+{
+    std::vector<uint8_t> const rom = assemble_object(make_large_source(100000)).code;
+    std::string const text = disassemble(rom);
+
+    auto report = [&](char const * name, std::chrono::nanoseconds per_run) {
+        logger.info("  {:>10} bytes of ROM {:>8}: {:>12} ns, {:.1f} MB/s of text",
+                    rom.size(),
+                    name,
+                    per_run.count(),
+                    static_cast<double>(text.size()) * 1000 / static_cast<double>(per_run.count()));
+    };
+
+    // what it used to do: a std::format per line, appended one at a time
+    report("format", time_per_call([&] {
+        std::string out;
+        for (size_t offset = 0; offset < rom.size(); offset += k_word_size) {
+            word_t raw;
+            memcpy(&raw, rom.data() + offset, sizeof(raw));
+            out += std::format("{}{}", offset == 0 ? "" : "\n", instr{raw});
+        }
+    }));
+    report("string", time_per_call([&] { disassemble(rom); }));
+
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        logger.abort("couldn't open /dev/null");
+    }
+    report("fd", time_per_call([&] { disassemble(rom, fd); }));
+    close(fd);
+}
@@ -1,14 +1,17 @@
 #include "assembler.h"
 #include "cpu_base.h"
 #include "instr.h"
+#include "object.h"
 #include "reg.h"
 #include "test.h"
 
 #include <assert.h>
+#include <cstdio>
 #include <cstring>
 #include <format>
 #include <initializer_list>
 #include <span>
+#include <string>
 #include <sstream>
 #include <utility>
 #include <vector>
@@ -249,3 +252,162 @@ call label
 )",
             {instr::set(r1, 293), instr::compare(r0, r1), instr::call(-4)});
 }
+
+TEST("assembler.mov")
+{
+    // labels after a mnemonic that's more than one instruction still end up in the right place
+    do_test(R"(
+mov r3 r7
+jump.unc skip
+mov r3 r3
+mov r0 r1
+skip:
+call skip
+)",
+            {instr::sub(r3, r3),
+             instr::add(r3, r7),
+             instr::jump(instr::unc, 12),
+             instr::sub(r0, r0),
+             instr::add(r0, r1),
+             instr::call(0)});
+}
+
+TEST("assembler.parallel")
+{
+    // labels used on both sides of wherever the chunks split, section changes that carry over
+    // into the next chunk, and labels nobody defines
+    std::string source;
+    for (int i = 0; i < 40; ++i) {
+        if (i % 9 == 4) {
+            source += ".section data\n";
+        } else if (i % 9 == 6) {
+            source += ".section code\n";
+        }
+        if (i % 9 == 4 || i % 9 == 5) {
+            source += std::format("d{0}:\n.word {0}\n", i);
+            continue;
+        }
+        source += std::format(R"(
+f{0}:
+    jump.eq f{1}
+    call external
+    mov r1 r2   # two instructions
+    jump.unc f{0}
+)",
+                              i,
+                              (i * 7 + 3) % 40);
+    }
+
+    object_module const serial = assemble_object(source, 1);
+    assert(!serial.data.empty() && !serial.relocations.empty());
+    for (size_t num_threads = 2; num_threads < 64; num_threads += 3) {
+        assert(assemble_object(source, num_threads) == serial);
+    }
+}
+
+TEST("assembler.incremental")
+{
+    auto make_source = [](int constant, char const * comment, bool extra) {
+        return std::format(R"(
+    call first
+    halt
+first:
+    set r1 {}   # {}
+    call second
+    ijump r15
+second:
+{}    jump.eq first
+    call external
+    ijump r15
+third:
+    jump.unc second
+)",
+                           constant,
+                           comment,
+                           extra ? "    mov r2 r3\n" : "");
+    };
+
+    incremental_assembler assembler;
+    auto check = [&](std::string const & source, size_t num_assembled) {
+        assert(assembler.assemble(source) == assemble_object(source));
+        assert(assembler.num_units() == 4);
+        assert(assembler.num_assembled() == num_assembled);
+    };
+
+    check(make_source(1, "one", false), 4);
+    check(make_source(1, "one", false), 0);
+
+    // comments don't count
+    check(make_source(1, "uno", false), 0);
+
+    // only the function that changed is assembled again, even when everything after it moves
+    check(make_source(2, "uno", false), 1);
+    check(make_source(2, "uno", true), 1);
+    check(make_source(2, "uno", false), 1);
+
+    // and moving a function somewhere else doesn't need anything assembled
+    check(R"(
+    call first
+    halt
+first:
+    set r1 2
+    call second
+    ijump r15
+third:
+    jump.unc second
+second:
+    jump.eq first
+    call external
+    ijump r15
+)",
+          0);
+}
+
+TEST("assembler.disassemble")
+{
+    // a few blocks' worth of every kind of instruction, with runs of the same word and words that
+    // aren't instructions at all
+    std::vector<instr> const kinds = {instr::set(r3, instr::k_max_set_value),
+                                      instr::store(r14, r15, 2),
+                                      instr::load(r1, r2, 4),
+                                      instr::add(r4, r5),
+                                      instr::sub(r6, r7),
+                                      instr::halt(),
+                                      instr::compare(r8, r9),
+                                      instr::jump(cmp_flag::unc, instr::k_jump_min_offset),
+                                      instr::jump(cmp_flag::le, instr::k_jump_max_offset),
+                                      instr::ijump(cmp_flag::ne, r10),
+                                      instr::call(instr::k_call_min_offset),
+                                      instr{0xffffffff},
+                                      instr{0x30001}};
+    std::vector<uint8_t> rom;
+    for (size_t i = 0; i < 3000; ++i) {
+        instr ii = kinds[i * 7 % kinds.size()];
+        for (size_t j = 0; j < i % 5; ++j) {
+            rom.insert(rom.end(),
+                       reinterpret_cast<uint8_t const *>(&ii.storage),
+                       reinterpret_cast<uint8_t const *>(&ii.storage + 1));
+        }
+    }
+
+    std::string expected;
+    for (size_t offset = 0; offset < rom.size(); offset += k_word_size) {
+        word_t raw;
+        memcpy(&raw, rom.data() + offset, sizeof(raw));
+        expected += std::format("{}{}", offset == 0 ? "" : "\n", instr{raw});
+    }
+    assert(disassemble(rom) == expected);
+    assert(disassemble(std::span<uint8_t const>{}).empty());
+
+    FILE * file = tmpfile();
+    assert(file != nullptr);
+    assert(disassemble(rom, fileno(file)));
+    std::string written(expected.size() + 1, '\0');
+    rewind(file);
+    assert(fread(written.data(), 1, written.size(), file) == expected.size());
+    written.resize(expected.size());
+    assert(written == expected);
+    fclose(file);
+
+    assert(!disassemble(rom, -1));
+}
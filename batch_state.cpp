@@ -0,0 +1,289 @@
+#include "batch_state.h"
+
+#include "instr.h"
+#include "opcode.h"
+#include "preprocessor.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+// Everything in run_lanes() works on whole arrays of lanes with the current step's mask_, which
+// is all ones for lanes taking part and all zeros for the rest, so updates are bitwise selects
+// the compiler can turn straight into vector code.
+
+static word_t constexpr k_lane_on = ~word_t{0};
+
+static word_t select(word_t mask, word_t if_set, word_t if_clear)
+{
+    return (if_set & mask) | (if_clear & ~mask);
+}
+
+static word_t to_mask(bool b)
+{
+    return -static_cast<word_t>(b);
+}
+
+static word_t flag_bit(cpu_cmp_flags flag)
+{
+    return word_t{1} << std::to_underlying(flag);
+}
+
+// A jump on flag is taken when (flags & bits) != 0, or the opposite if negate.
+struct flag_test
+{
+    word_t bits;
+    bool negate;
+};
+
+static flag_test make_flag_test(cmp_flag flag)
+{
+    switch (flag) {
+    case cmp_flag::eq:
+        return {flag_bit(cpu_cmp_flags::eq), false};
+    case cmp_flag::ne:
+        return {flag_bit(cpu_cmp_flags::eq), true};
+    case cmp_flag::gt:
+        return {flag_bit(cpu_cmp_flags::gt), false};
+    case cmp_flag::ge:
+        return {flag_bit(cpu_cmp_flags::gt) | flag_bit(cpu_cmp_flags::eq), false};
+    case cmp_flag::lt:
+        return {flag_bit(cpu_cmp_flags::lt), false};
+    case cmp_flag::le:
+        return {flag_bit(cpu_cmp_flags::lt) | flag_bit(cpu_cmp_flags::eq), false};
+    case cmp_flag::unc:
+        return {0, true};
+    default:
+        assert(false && "unknown flag");
+        return {0, false};
+    }
+}
+
+batch_state::batch_state(size_t num_lanes, std::span<uint8_t const> program,
+                         memory_layout layout)
+    : layout_{layout}
+    , num_lanes_{num_lanes}
+    , stride_{(num_lanes + k_lane_multiple - 1) / k_lane_multiple * k_lane_multiple}
+    , rom_{std::make_unique<uint8_t[]>(layout.rom_size)}
+    , decoded_rom_{std::make_unique<decoded_instr[]>(rom_words() + 1)}
+    , regs_{std::make_unique<word_t[]>(k_num_registers * stride_)}
+    , instr_ptr_{std::make_unique<word_t[]>(stride_)}
+    , flags_{std::make_unique<word_t[]>(stride_)}
+    , running_{std::make_unique<word_t[]>(stride_)}
+    , mask_{std::make_unique<word_t[]>(stride_)}
+    , ram_{std::make_unique<uint8_t[]>(num_lanes * layout.ram_size)}
+    , console_(num_lanes)
+    , status_(num_lanes, run_status::halted)
+    , fault_addr_(num_lanes)
+{
+    assert(layout.valid());
+    cpu const reset{};
+    for (size_t lane = 0; lane < stride_; ++lane) {
+        instr_ptr_[lane] = reset.instr_ptr;
+        flags_[lane] = reset.cpu_cmp_flags;
+        running_[lane] = lane < num_lanes ? k_lane_on : 0;
+    }
+
+    // not a valid opcode, so falling off the end of ROM hits an assert
+    decoded_rom_[rom_words()] = decode(instr{~word_t{0}});
+    set_rom(program);
+}
+
+void batch_state::set_rom(std::span<uint8_t const> program)
+{
+    assert(program.size() < layout_.rom_size);
+    memcpy(rom_.get(), program.data(), program.size());
+    for (size_t i = 0; i < rom_words(); ++i) {
+        word_t raw;
+        memcpy(&raw, rom_.get() + i * k_word_size, sizeof(raw));
+        decoded_rom_[i] = decode(instr{raw});
+    }
+}
+
+cpu batch_state::lane_cpu(size_t lane) const
+{
+    assert(lane < num_lanes_);
+    cpu ret;
+    ret.instr_ptr = instr_ptr_[lane];
+    ret.cpu_cmp_flags = static_cast<uint8_t>(flags_[lane]);
+    for (size_t i = 0; i < k_num_registers; ++i) {
+        ret.registers[i] = regs_[i * stride_ + lane];
+    }
+    return ret;
+}
+
+double batch_state::lane_utilization() const
+{
+    if (num_steps_ == 0) {
+        return 1;
+    }
+    return static_cast<double>(num_lane_steps_) / static_cast<double>(num_steps_ * num_lanes_);
+}
+
+decoded_instr const & batch_state::decoded_at(word_t addr) const
+{
+    word_t rom_offset = addr - iomap::k_rom_base;
+    assert(rom_offset < layout_.rom_size && rom_offset % k_word_size == 0);
+    return decoded_rom_[rom_offset / k_word_size];
+}
+
+// A load or store by one lane, to its own RAM and console. What faults is the same as for a
+// system_state with our layout and no other devices: anything unmapped, and stores to ROM.
+bool batch_state::load_store(size_t lane, bool is_load, word_t addr, word_t * value, word_t width)
+{
+    assert(addr % width == 0);
+
+    if (addr >= iomap::k_console_base
+        && addr <= iomap::k_console_base + iomap::k_console_size - width) {
+        assert(width == 1 && is_load == false && addr == iomap::k_console_write);
+        console_[lane].push_back(static_cast<uint8_t>(*value));
+        return true;
+    }
+
+    uint8_t * mem_addr = nullptr;
+    word_t const ram_base = layout_.ram_base();
+    if (addr >= ram_base && addr <= ram_base + layout_.ram_size - width) {
+        mem_addr = lane_ram(lane).data() + (addr - ram_base);
+    } else if (is_load && addr >= iomap::k_rom_base
+               && addr <= iomap::k_rom_base + layout_.rom_size - width) {
+        mem_addr = rom_.get() + (addr - iomap::k_rom_base);
+    } else {
+        status_[lane] = run_status::faulted;
+        fault_addr_[lane] = addr;
+        return false;
+    }
+
+    if (is_load) {
+        memcpy(value, mem_addr, width);
+    } else {
+        memcpy(mem_addr, value, width);
+    }
+    return true;
+}
+
+void batch_state::run()
+{
+    run_lanes(*this);
+}
+
+SIMD_CLONES void batch_state::run_lanes(batch_state & state)
+{
+    size_t const num = state.stride_;
+    word_t * const ip = state.instr_ptr_.get();
+    word_t * const flags = state.flags_.get();
+    word_t * const running = state.running_.get();
+    word_t * const mask = state.mask_.get();
+
+    while (true) {
+        // the lowest instruction pointer of any running lane, halted lanes count as the maximum
+        word_t pc = std::numeric_limits<word_t>::max();
+        for (size_t l = 0; l < num; ++l) {
+            pc = std::min(pc, ip[l] | ~running[l]);
+        }
+        if (pc == std::numeric_limits<word_t>::max()) {
+            break;
+        }
+
+        uint64_t active = 0;
+        for (size_t l = 0; l < num; ++l) {
+            mask[l] = running[l] & to_mask(ip[l] == pc);
+            active += mask[l] & 1;
+        }
+        ++state.num_steps_;
+        state.num_lane_steps_ += active;
+
+        decoded_instr const & di = state.decoded_at(pc);
+        word_t const next = pc + k_word_size;
+        bool advance = true;
+        switch (di.op) {
+        case opcode::set: {
+            word_t * dest = state.reg_lanes(di.lhs);
+            for (size_t l = 0; l < num; ++l) {
+                dest[l] = select(mask[l], di.imm, dest[l]);
+            }
+            break;
+        }
+        case opcode::store:
+        case opcode::load: {
+            bool is_load = di.op == opcode::load;
+            word_t const * addr = state.reg_lanes(is_load ? di.rhs : di.lhs);
+            word_t * value = state.reg_lanes(is_load ? di.lhs : di.rhs);
+            for (size_t l = 0; l < state.num_lanes_; ++l) {
+                // a lane that faults stops right here, without moving on to the next instruction
+                if (mask[l] && !state.load_store(l, is_load, addr[l], &value[l], di.imm)) {
+                    running[l] = 0;
+                    mask[l] = 0;
+                }
+            }
+            break;
+        }
+        case opcode::add: {
+            word_t * dest = state.reg_lanes(di.lhs);
+            word_t const * op1 = state.reg_lanes(di.rhs);
+            for (size_t l = 0; l < num; ++l) {
+                dest[l] = select(mask[l], dest[l] + op1[l], dest[l]);
+            }
+            break;
+        }
+        case opcode::sub: {
+            word_t * dest = state.reg_lanes(di.lhs);
+            word_t const * op1 = state.reg_lanes(di.rhs);
+            for (size_t l = 0; l < num; ++l) {
+                dest[l] = select(mask[l], dest[l] - op1[l], dest[l]);
+            }
+            break;
+        }
+        case opcode::halt:
+            for (size_t l = 0; l < num; ++l) {
+                running[l] &= ~mask[l];
+            }
+            advance = false;
+            break;
+        case opcode::compare: {
+            word_t const * lhs = state.reg_lanes(di.lhs);
+            word_t const * rhs = state.reg_lanes(di.rhs);
+            word_t const eq = flag_bit(cpu_cmp_flags::eq);
+            word_t const lt = flag_bit(cpu_cmp_flags::lt);
+            word_t const gt = flag_bit(cpu_cmp_flags::gt);
+            for (size_t l = 0; l < num; ++l) {
+                word_t result = select(to_mask(lhs[l] < rhs[l]), lt, gt);
+                result = select(to_mask(lhs[l] == rhs[l]), eq, result);
+                flags[l] = select(mask[l], result, flags[l]);
+            }
+            break;
+        }
+        case opcode::jump:
+        case opcode::ijump: {
+            flag_test const test = make_flag_test(di.flag);
+            word_t const jump_target = pc + di.offset();
+            word_t const * ijump_target = state.reg_lanes(di.lhs);
+            bool const is_ijump = di.op == opcode::ijump;
+            for (size_t l = 0; l < num; ++l) {
+                word_t taken = to_mask(((flags[l] & test.bits) != 0) != test.negate);
+                word_t target = is_ijump ? ijump_target[l] : jump_target;
+                ip[l] = select(mask[l], select(taken, target, next), ip[l]);
+            }
+            advance = false;
+            break;
+        }
+        case opcode::call: {
+            word_t * link = state.reg_lanes(r15);
+            word_t const target = pc + di.offset();
+            for (size_t l = 0; l < num; ++l) {
+                link[l] = select(mask[l], next, link[l]);
+                ip[l] = select(mask[l], target, ip[l]);
+            }
+            advance = false;
+            break;
+        }
+        default:
+            assert(false && "unknown opcode");
+        }
+
+        if (advance) {
+            for (size_t l = 0; l < num; ++l) {
+                ip[l] = select(mask[l], next, ip[l]);
+            }
+        }
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "cpu_base.h"
+#include "decoded_instr.h"
+#include "iomap.h"
+#include "reg.h"
+#include "system_state.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Runs one ROM over many inputs at once. Each lane is a complete guest machine (registers, flags,
+// instruction pointer, RAM, console) but they're stored structure-of-arrays, so that when lanes
+// execute the same instruction it's a handful of vector operations across all of them.
+//
+// Lanes run in lockstep: every step picks the lowest instruction pointer of any lane that hasn't
+// halted, and executes that instruction in every lane that's there. Lanes that branched elsewhere
+// sit out until the others catch up, which also makes diverged lanes reconverge at the first
+// address they have in common.
+//
+// Memory is laid out as for a system_state with the same memory_layout and no devices but the
+// console, and a load or store that would fault there faults the lane: it stops where it is, and
+// lane_status() and lane_fault_addr() say what happened. Unlike system_state, every lane's RAM is
+// allocated up front.
+struct batch_state
+{
+    explicit batch_state(size_t num_lanes, std::span<uint8_t const> program = {},
+                         memory_layout layout = {});
+
+    void set_rom(std::span<uint8_t const> program);
+
+    // Run every lane until it halts or faults.
+    void run();
+
+    size_t num_lanes() const
+    {
+        return num_lanes_;
+    }
+
+    word_t & get(size_t lane, reg rr)
+    {
+        assert(lane < num_lanes_);
+        return regs_[std::to_underlying(rr) * stride_ + lane];
+    }
+
+    // a copy of one lane's registers, flags and instruction pointer
+    cpu lane_cpu(size_t lane) const;
+
+    std::span<uint8_t> lane_ram(size_t lane)
+    {
+        assert(lane < num_lanes_);
+        return {ram_.get() + lane * layout_.ram_size, layout_.ram_size};
+    }
+
+    // halted, or faulted if a load or store faulted, for a lane that's stopped
+    run_status lane_status(size_t lane) const
+    {
+        assert(lane < num_lanes_);
+        return status_[lane];
+    }
+
+    // the guest address of the access a lane faulted on
+    word_t lane_fault_addr(size_t lane) const
+    {
+        assert(lane < num_lanes_);
+        return fault_addr_[lane];
+    }
+
+    std::vector<uint8_t> & lane_console(size_t lane)
+    {
+        assert(lane < num_lanes_);
+        return console_[lane];
+    }
+
+    // how many steps run() took, and the total number of lanes that did something in them
+    uint64_t num_steps() const
+    {
+        return num_steps_;
+    }
+
+    uint64_t num_lane_steps() const
+    {
+        return num_lane_steps_;
+    }
+
+    // the fraction of lanes that did something in an average step. 1 means no divergence at all.
+    double lane_utilization() const;
+
+    // lanes are padded out to a multiple of this, enough for a 512-bit vector of words
+    static size_t constexpr k_lane_multiple = 64 / sizeof(word_t);
+
+private:
+    // the whole of run(), compiled for each vector ISA
+    static void run_lanes(batch_state & state);
+
+    decoded_instr const & decoded_at(word_t addr) const;
+    word_t * reg_lanes(reg rr)
+    {
+        return regs_.get() + std::to_underlying(rr) * stride_;
+    }
+
+    // false if it faults
+    bool load_store(size_t lane, bool is_load, word_t addr, word_t * value, word_t width);
+
+    size_t rom_words() const
+    {
+        return layout_.rom_size / k_word_size;
+    }
+
+    memory_layout const layout_;
+    size_t num_lanes_;
+    size_t stride_;
+
+    std::unique_ptr<uint8_t[]> rom_;
+    std::unique_ptr<decoded_instr[]> decoded_rom_;
+
+    // all structure-of-arrays, stride_ entries per register
+    std::unique_ptr<word_t[]> regs_;
+    std::unique_ptr<word_t[]> instr_ptr_;
+    std::unique_ptr<word_t[]> flags_;
+
+    // ~0 for lanes that are still running, 0 for ones that have halted and for padding
+    std::unique_ptr<word_t[]> running_;
+
+    // scratch for the current step, same meaning as running_
+    std::unique_ptr<word_t[]> mask_;
+
+    std::unique_ptr<uint8_t[]> ram_;
+    std::vector<std::vector<uint8_t>> console_;
+    std::vector<run_status> status_;
+    std::vector<word_t> fault_addr_;
+
+    uint64_t num_steps_ = 0;
+    uint64_t num_lane_steps_ = 0;
+};
@@ -0,0 +1,58 @@
+#include "batch_state.h"
+#include "bench.h"
+#include "log.h"
+#include "reg.h"
+#include "system_state.h"
+#include "test_programs.h"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+static logger logger{__FILE__};
+
+// fib of input(lane) for every lane, batched vs one system_state per lane
+static void bench_batch(size_t num_lanes, word_t (*input)(size_t lane))
+{
+    std::vector<uint8_t> rom = make_fib_rom();
+
+    std::chrono::nanoseconds one_at_a_time = time_per_call([&] {
+        for (size_t lane = 0; lane < num_lanes; ++lane) {
+            system_state state{};
+            state.engine = engine::threaded;
+            state.set_rom(rom);
+            state.cpu.get(r0) = input(lane);
+            state.run();
+        }
+    });
+
+    double utilization = 0;
+    std::chrono::nanoseconds batched = time_per_call([&] {
+        batch_state batch{num_lanes, rom};
+        for (size_t lane = 0; lane < num_lanes; ++lane) {
+            batch.get(lane, r0) = input(lane);
+        }
+        batch.run();
+        if (batch.get(num_lanes - 1, r13) != host_fib(input(num_lanes - 1))) {
+            logger.abort("batch computed the wrong result");
+        }
+        utilization = batch.lane_utilization();
+    });
+
+    logger.info("  {} lanes: threaded {} ns, batched {} ns, {:.2f}x, lane utilization {:.2f}",
+                num_lanes,
+                one_at_a_time.count(),
+                batched.count(),
+                static_cast<double>(one_at_a_time.count()) / batched.count(),
+                utilization);
+}
+
+BENCH("batch_state.fib.same_input")
+{
+    bench_batch(64, [](size_t) -> word_t { return 15; });
+}
+
+BENCH("batch_state.fib.mixed_inputs")
+{
+    bench_batch(64, [](size_t lane) -> word_t { return 12 + lane % 4; });
+}
@@ -0,0 +1,148 @@
+#include "batch_state.h"
+
+#include "assembler.h"
+#include "iomap.h"
+#include "reg.h"
+#include "system_state.h"
+#include "test.h"
+#include "test_programs.h"
+
+#include <algorithm>
+#include <cassert>
+#include <span>
+#include <vector>
+
+// run each lane on its own with the reference interpreter and compare
+static void check_lanes(batch_state & batch, std::span<uint8_t const> rom, auto && init,
+                        memory_layout layout = {})
+{
+    for (size_t lane = 0; lane < batch.num_lanes(); ++lane) {
+        system_state reference{{}, layout};
+        reference.engine = engine::interp;
+        reference.set_rom(rom);
+        init(lane, reference.cpu);
+        run_status const status = reference.run();
+        assert(batch.lane_status(lane) == status);
+        if (status == run_status::faulted) {
+            assert(batch.lane_fault_addr(lane) == reference.fault_addr);
+        }
+
+        cpu const lane_cpu = batch.lane_cpu(lane);
+        assert(lane_cpu.instr_ptr == reference.cpu.instr_ptr);
+        assert(lane_cpu.cpu_cmp_flags == reference.cpu.cpu_cmp_flags);
+        for (reg rr : k_all_registers) {
+            assert(lane_cpu.get(rr) == reference.cpu.get(rr));
+        }
+        std::vector<uint8_t> reference_ram(layout.ram_size);
+        reference.ram.read(0, reference_ram.data(), reference_ram.size());
+        assert(std::ranges::equal(batch.lane_ram(lane), reference_ram));
+        assert(batch.lane_console(lane) == reference.console);
+    }
+}
+
+TEST("batch_state.fib")
+{
+    // not a multiple of the vector width, and recursion depth differs between lanes
+    size_t const num_lanes = 37;
+    std::vector<uint8_t> rom = make_fib_rom();
+    auto init = [](size_t lane, cpu & cpu) { cpu.get(r0) = lane % 12; };
+
+    batch_state batch{num_lanes, rom};
+    for (size_t lane = 0; lane < num_lanes; ++lane) {
+        cpu lane_cpu;
+        init(lane, lane_cpu);
+        batch.get(lane, r0) = lane_cpu.get(r0);
+    }
+    batch.run();
+    check_lanes(batch, rom, init);
+    assert(batch.lane_utilization() > 0 && batch.lane_utilization() < 1);
+}
+
+TEST("batch_state.console")
+{
+    std::vector<uint8_t> rom = assemble(R"(
+set r1 65536
+set r2 1
+set r3 0
+loop:
+compare r3 r0
+jump.ge done
+set r4 65
+add r4 r3
+store.1 r1 r4
+add r3 r2
+jump.unc loop
+done:
+halt
+)");
+    auto init = [](size_t lane, cpu & cpu) { cpu.get(r0) = lane % 7; };
+
+    batch_state batch{20, rom};
+    for (size_t lane = 0; lane < batch.num_lanes(); ++lane) {
+        batch.get(lane, r0) = lane % 7;
+    }
+    batch.run();
+    check_lanes(batch, rom, init);
+    assert(batch.lane_console(3) == (std::vector<uint8_t>{'A', 'B', 'C'}));
+}
+
+TEST("batch_state.converged")
+{
+    // every lane takes the same path, so every lane does something in every step
+    std::vector<uint8_t> rom = make_branchy_rom(100);
+    batch_state batch{16, rom};
+    batch.run();
+    check_lanes(batch, rom, [](size_t, cpu &) { });
+    assert(batch.lane_utilization() == 1);
+    assert(batch.num_lane_steps() == 16 * batch.num_steps());
+}
+
+TEST("batch_state.fault")
+{
+    // below everything, ROM (which faults on the store), RAM, and just past RAM
+    word_t const addrs[] = {0, iomap::k_rom_base + 8, iomap::k_ram_base + 8,
+                            iomap::k_ram_base + iomap::k_ram_size};
+    std::vector<uint8_t> rom = assemble(R"(
+set r1 5
+load.4 r2 r0
+store.4 r0 r1
+halt
+)");
+    auto init = [&](size_t lane, cpu & cpu) { cpu.get(r0) = addrs[lane % std::size(addrs)]; };
+
+    batch_state batch{10, rom};
+    for (size_t lane = 0; lane < batch.num_lanes(); ++lane) {
+        batch.get(lane, r0) = addrs[lane % std::size(addrs)];
+    }
+    batch.run();
+    check_lanes(batch, rom, init);
+    assert(batch.lane_status(1) == run_status::faulted);
+    assert(batch.lane_fault_addr(1) == iomap::k_rom_base + 8);
+    assert(batch.lane_cpu(1).instr_ptr == iomap::k_rom_base + 2 * k_word_size);
+    assert(batch.lane_status(2) == run_status::halted);
+}
+
+TEST("batch_state.memory_layout")
+{
+    memory_layout layout;
+    layout.rom_size = 2 * k_page_size;
+    layout.ram_size = 4 * k_page_size;
+    word_t const last_word = layout.ram_base() + layout.ram_size - k_word_size;
+    std::vector<uint8_t> rom = assemble(R"(
+set r1 5
+store.4 r0 r1
+load.4 r2 r0
+halt
+)");
+    word_t const addrs[] = {last_word, last_word + k_word_size};
+    auto init = [&](size_t lane, cpu & cpu) { cpu.get(r0) = addrs[lane % std::size(addrs)]; };
+
+    batch_state batch{6, rom, layout};
+    for (size_t lane = 0; lane < batch.num_lanes(); ++lane) {
+        batch.get(lane, r0) = addrs[lane % std::size(addrs)];
+    }
+    batch.run();
+    check_lanes(batch, rom, init, layout);
+    assert(batch.lane_cpu(0).get(r2) == 5);
+    assert(batch.lane_status(1) == run_status::faulted);
+}
@@ -0,0 +1,52 @@
+#include "bench.h"
+
+#include "log.h"
+
+#include <vector>
+
+static logger logger{__FILE__};
+
+static auto constexpr k_bench_min_time = std::chrono::milliseconds{200};
+
+struct bench
+{
+    char const * name;
+    bench_func_t func;
+};
+
+static std::vector<bench> & bench_registry()
+{
+    static std::vector<bench> the_registry;
+    return the_registry;
+}
+
+void register_bench(char const * name, bench_func_t func)
+{
+    bench_registry().push_back({name, func});
+}
+
+void run_benchmarks(std::string_view filter)
+{
+    for (auto const & [name, func] : bench_registry()) {
+        if (std::string_view{name}.find(filter) == std::string_view::npos) {
+            continue;
+        }
+        logger.info("running benchmark '{}'", name);
+        func();
+    }
+}
+
+std::chrono::nanoseconds time_per_call(void (*fn)(void *), void * arg)
+{
+    using clock = std::chrono::steady_clock;
+
+    size_t calls = 0;
+    clock::time_point start = clock::now();
+    clock::duration elapsed;
+    do {
+        fn(arg);
+        ++calls;
+        elapsed = clock::now() - start;
+    } while (elapsed < k_bench_min_time);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed) / calls;
+}
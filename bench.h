@@ -0,0 +1,34 @@
+#pragma once
+
+#include "preprocessor.h"
+
+#include <chrono>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+
+using bench_func_t = void (*)();
+
+void register_bench(char const *, bench_func_t);
+
+// Run every benchmark whose name contains filter.
+void run_benchmarks(std::string_view filter);
+
+// Call fn repeatedly for at least k_bench_min_time (and at least once) and return the mean
+// wall-clock time per call.
+std::chrono::nanoseconds time_per_call(void (*fn)(void *), void * arg);
+
+template <typename fn_t>
+std::chrono::nanoseconds time_per_call(fn_t && fn)
+{
+    using callable_t = std::remove_reference_t<fn_t>;
+    return time_per_call([](void * arg) { (*static_cast<callable_t *>(arg))(); }, &fn);
+}
+
+#define BENCH(name)                                                                                \
+    static void PASTE(bench_, __LINE__)();                                                         \
+    __attribute__((constructor)) static void PASTE(insert_bench_, __LINE__)()                      \
+    {                                                                                              \
+        register_bench(name, &PASTE(bench_, __LINE__));                                            \
+    }                                                                                              \
+    static void PASTE(bench_, __LINE__)()
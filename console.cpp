@@ -0,0 +1,130 @@
+#include "console.h"
+
+#include "iomap.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static logger logger{__FILE__};
+
+fd_sink::fd_sink(int fd, bool background)
+    : fd_{fd}
+    , background_{background}
+    , buffer_{std::make_unique<uint8_t[]>(k_capacity)}
+{
+    if (background_) {
+        flusher_ = std::thread{[this] { run_flusher(); }};
+    }
+}
+
+fd_sink::~fd_sink()
+{
+    if (background_) {
+        {
+            std::lock_guard lock{mutex_};
+            stopping_ = true;
+        }
+        wake_cv_.notify_one();
+        // drains on the way out
+        flusher_.join();
+    } else {
+        drain();
+    }
+}
+
+void fd_sink::flush()
+{
+    if (!background_) {
+        drain();
+        return;
+    }
+    size_t const target = head_.load(std::memory_order_relaxed);
+    wake_flusher();
+    std::unique_lock lock{mutex_};
+    drained_cv_.wait(lock, [&] { return tail_.load(std::memory_order_acquire) >= target; });
+}
+
+void fd_sink::make_room()
+{
+    size_t const head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    if (head - tail == k_capacity) {
+        if (background_) {
+            wake_flusher();
+            std::unique_lock lock{mutex_};
+            drained_cv_.wait(lock, [&] {
+                tail = tail_.load(std::memory_order_acquire);
+                return head - tail < k_capacity;
+            });
+        } else {
+            drain();
+            tail = head;
+        }
+    }
+    room_until_ = tail + k_capacity;
+}
+
+void fd_sink::drain()
+{
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t const head = head_.load(std::memory_order_acquire);
+    while (tail != head) {
+        // the used part of the buffer, which is in two pieces if it wraps around the end
+        size_t const start = tail % k_capacity;
+        size_t const first = std::min(head - tail, k_capacity - start);
+        iovec iov[2] = {
+            {buffer_.get() + start, first},
+            {buffer_.get(), head - tail - first},
+        };
+        ssize_t written = writev(fd_, iov, iov[1].iov_len > 0 ? 2 : 1);
+        num_writes_.fetch_add(1, std::memory_order_relaxed);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger.abort("couldn't write console output to fd {}: errno {}", fd_, errno);
+        }
+        // a short write just means going around again for the rest
+        tail += static_cast<size_t>(written);
+        tail_.store(tail, std::memory_order_release);
+    }
+}
+
+void fd_sink::wake_flusher()
+{
+    {
+        std::lock_guard lock{mutex_};
+        wake_ = true;
+    }
+    wake_cv_.notify_one();
+}
+
+void fd_sink::run_flusher()
+{
+    std::unique_lock lock{mutex_};
+    while (true) {
+        wake_cv_.wait_for(lock, k_flush_interval, [&] { return wake_ || stopping_; });
+        wake_ = false;
+        bool const stop = stopping_;
+
+        lock.unlock();
+        drain();
+        lock.lock();
+        drained_cv_.notify_all();
+
+        if (stop) {
+            return;
+        }
+    }
+}
+
+void console_device::access(bool is_load, word_t offset, word_t * value, word_t width)
+{
+    assert(width == 1 && is_load == false
+           && offset == iomap::k_console_write - iomap::k_console_base);
+    sink_->put(static_cast<uint8_t>(*value));
+}
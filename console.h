@@ -0,0 +1,145 @@
+#pragma once
+
+#include "cpu_base.h"
+#include "device.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Where the bytes the guest writes to the console go.
+struct console_sink
+{
+    virtual ~console_sink() = default;
+
+    virtual void put(uint8_t byte) = 0;
+
+    // get anything we're holding on to out of the door
+    virtual void flush() { }
+};
+
+// Keeps everything in memory, for tests and for anyone who wants to look at the output afterwards.
+// Grows without bound.
+struct vector_sink : console_sink
+{
+    explicit vector_sink(std::vector<uint8_t> & out)
+        : out_{out}
+    { }
+
+    void put(uint8_t byte) override
+    {
+        out_.push_back(byte);
+    }
+
+private:
+    std::vector<uint8_t> & out_;
+};
+
+// Streams to a host file descriptor through a fixed-size ring buffer, so it never uses more than
+// k_capacity bytes however much the guest writes, and the host sees one write (or a writev, when
+// the buffer has wrapped) per batch rather than one per byte.
+//
+// Without a background thread the buffer is written out whenever it fills up, on flush(), and
+// when we're destroyed. With one, that thread writes it out every time another half of it fills up
+// and at least every k_flush_interval, and put() only has to wait for it if it falls behind.
+//
+// put() and flush() must only be called from one thread at a time, e.g. the one running the VM.
+// fd is left open.
+struct fd_sink : console_sink
+{
+    static size_t constexpr k_capacity = 64 * 1024;
+    static std::chrono::milliseconds constexpr k_flush_interval{10};
+
+    fd_sink(int fd, bool background);
+    ~fd_sink() override;
+
+    fd_sink(fd_sink const &) = delete;
+    fd_sink & operator=(fd_sink const &) = delete;
+
+    void put(uint8_t byte) override
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == room_until_) [[unlikely]] {
+            make_room();
+        }
+        buffer_[head % k_capacity] = byte;
+        head_.store(head + 1, std::memory_order_release);
+        if (background_ && (head + 1) % (k_capacity / 2) == 0) [[unlikely]] {
+            wake_flusher();
+        }
+    }
+
+    void flush() override;
+
+    // how many write/writev calls it's taken so far
+    size_t num_writes() const
+    {
+        return num_writes_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // wait for (or make) some space in the buffer, and move room_until_ along
+    void make_room();
+
+    // Write out everything put() so far. Only ever called by one thread: the flusher if there is
+    // one, the caller of put() otherwise.
+    void drain();
+
+    void wake_flusher();
+    void run_flusher();
+
+    int const fd_;
+    bool const background_;
+    std::unique_ptr<uint8_t[]> buffer_;
+
+    // put() can go without looking at tail_ until head_ gets here
+    size_t room_until_ = k_capacity;
+
+    // Bytes ever put and ever written. Both only go up, so head_ - tail_ is how full we are and
+    // the bytes are at buffer_[tail_ % k_capacity] onwards.
+    std::atomic<size_t> head_ = 0;
+    std::atomic<size_t> tail_ = 0;
+    std::atomic<size_t> num_writes_ = 0;
+
+    // the flusher waits on wake_cv_, and everybody waiting for it to write waits on drained_cv_
+    std::mutex mutex_;
+    std::condition_variable wake_cv_;
+    std::condition_variable drained_cv_;
+    bool wake_ = false;
+    bool stopping_ = false;
+    std::thread flusher_;
+};
+
+// The console at iomap::k_console_base, the one device every system_state has. Guest code writes a
+// byte to iomap::k_console_write and it goes to our sink, which is a vector_sink on out unless
+// someone's given us another one.
+struct console_device : device
+{
+    explicit console_device(std::vector<uint8_t> & out)
+        : default_sink_{out}
+        , sink_{&default_sink_}
+    { }
+
+    void access(bool is_load, word_t offset, word_t * value, word_t width) override;
+
+    // Send everything from now on to sink, which has to outlive us, or back to out if null.
+    void set_sink(console_sink * sink)
+    {
+        sink_ = sink ? sink : &default_sink_;
+    }
+
+    console_sink * sink() const
+    {
+        return sink_;
+    }
+
+private:
+    vector_sink default_sink_;
+    console_sink * sink_;
+};
@@ -0,0 +1,51 @@
+#include "bench.h"
+#include "console.h"
+#include "log.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+static logger logger{__FILE__};
+
+static size_t constexpr k_bench_bytes = 1 << 20;
+
+static void put_bytes(console_sink * sink)
+{
+    for (size_t i = 0; i < k_bench_bytes; ++i) {
+        sink->put(static_cast<uint8_t>(i));
+    }
+    sink->flush();
+}
+
+static void report(char const * name, std::chrono::nanoseconds per_run)
+{
+    logger.info("  {:>10}: {:.2f} ns/byte",
+                name,
+                static_cast<double>(per_run.count()) / k_bench_bytes);
+}
+
+BENCH("console.sinks")
+{
+    // starts from empty every time, like a fresh VM would
+    report("vector", time_per_call([] {
+        std::vector<uint8_t> out;
+        vector_sink sink{out};
+        put_bytes(&sink);
+    }));
+
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        logger.abort("couldn't open /dev/null");
+    }
+    {
+        fd_sink sync{fd, false};
+        report("fd", time_per_call([&] { put_bytes(&sync); }));
+        fd_sink background{fd, true};
+        report("fd thread", time_per_call([&] { put_bytes(&background); }));
+    }
+    close(fd);
+}
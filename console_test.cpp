@@ -0,0 +1,90 @@
+#include "console.h"
+
+#include "instr.h"
+#include "iomap.h"
+#include "system_state.h"
+#include "test.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <unistd.h>
+#include <vector>
+
+// everything that's been written to f
+static std::vector<uint8_t> contents(FILE * f)
+{
+    std::vector<uint8_t> bytes(static_cast<size_t>(lseek(fileno(f), 0, SEEK_END)));
+    ssize_t n = pread(fileno(f), bytes.data(), bytes.size(), 0);
+    assert(n == static_cast<ssize_t>(bytes.size()));
+    return bytes;
+}
+
+TEST("console.fd_sink")
+{
+    // enough to wrap around the ring a few times, and not on a boundary
+    size_t const num_bytes = 3 * fd_sink::k_capacity + 123;
+    for (bool background : {false, true}) {
+        FILE * f = tmpfile();
+        assert(f != nullptr);
+        std::vector<uint8_t> expected;
+        {
+            fd_sink sink{fileno(f), background};
+            for (size_t i = 0; i < num_bytes; ++i) {
+                auto byte = static_cast<uint8_t>(i * 7 + i / 251);
+                sink.put(byte);
+                expected.push_back(byte);
+            }
+
+            sink.flush();
+            assert(contents(f) == expected);
+            if (!background) {
+                // one write per time the buffer filled up, and one for the rest
+                assert(sink.num_writes() == 4);
+            }
+
+            // the rest goes out when the sink does
+            sink.put('x');
+            expected.push_back('x');
+        }
+        assert(contents(f) == expected);
+        fclose(f);
+    }
+}
+
+TEST("console.system_state")
+{
+    std::vector<instr> const prog{
+        instr::set(r0, 'h'),
+        instr::set(r1, iomap::k_console_write),
+        instr::store1(r1, r0),
+        instr::set(r0, 'i'),
+        instr::store1(r1, r0),
+        instr::halt(),
+    };
+
+    FILE * f = tmpfile();
+    assert(f != nullptr);
+    fd_sink sink{fileno(f), false};
+
+    system_state state{};
+    state.console_io.set_sink(&sink);
+    state.set_rom(prog);
+    state.run();
+    sink.flush();
+    assert((contents(f) == std::vector<uint8_t>{'h', 'i'}));
+    assert(state.console.empty());
+
+    // forks go back to keeping it in memory
+    system_state child = state.fork();
+    child.cpu.instr_ptr = iomap::k_rom_base;
+    child.run();
+    assert((child.console == std::vector<uint8_t>{'h', 'i'}));
+
+    state.console_io.set_sink(nullptr);
+    state.cpu.instr_ptr = iomap::k_rom_base;
+    state.run();
+    assert((state.console == std::vector<uint8_t>{'h', 'i'}));
+    fclose(f);
+}
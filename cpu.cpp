@@ -1,5 +1,8 @@
+#include "bench.h"
 #include "test.h"
 
+#include <string_view>
+
 // TODOs:
 // * push/pop support
 // * de-duplicate string table boilerplate
@@ -8,8 +11,12 @@
 // * mov instruction with immediate encoding
 // * C++ modules?
 
-int main()
+int main(int argc, char ** argv)
 {
+    if (argc > 1 && std::string_view{argv[1]} == "bench") {
+        run_benchmarks(argc > 2 ? argv[2] : "");
+        return 0;
+    }
     run_tests();
     return 0;
 }
@@ -0,0 +1,81 @@
+#include "decoded_instr.h"
+
+decoded_instr decode(instr ii)
+{
+    decoded_instr di{};
+    di.op = ii.get_opcode();
+    switch (di.op) {
+    case opcode::set:
+        ii.decode_set(&di.lhs, &di.imm);
+        break;
+    case opcode::store:
+    case opcode::load:
+        // ROM data can look like anything, and it's only an error if we try to execute it
+        if (!ii.has_valid_width()) {
+            di.op = k_invalid_opcode;
+        } else if (di.op == opcode::store) {
+            ii.decode_store(&di.lhs, &di.rhs, &di.imm);
+        } else {
+            ii.decode_load(&di.lhs, &di.rhs, &di.imm);
+        }
+        break;
+    case opcode::add:
+        ii.decode_add(&di.lhs, &di.rhs);
+        break;
+    case opcode::sub:
+        ii.decode_sub(&di.lhs, &di.rhs);
+        break;
+    case opcode::halt:
+        break;
+    case opcode::compare:
+        ii.decode_compare(&di.lhs, &di.rhs);
+        break;
+    case opcode::jump: {
+        signed_word_t offset;
+        ii.decode_jump(&di.flag, &offset);
+        di.imm = static_cast<word_t>(offset);
+        break;
+    }
+    case opcode::ijump:
+        ii.decode_ijump(&di.flag, &di.lhs);
+        break;
+    case opcode::call: {
+        signed_word_t offset;
+        ii.decode_call(&offset);
+        di.imm = static_cast<word_t>(offset);
+        break;
+    }
+    default:
+        // not an instruction (e.g. data living in ROM), only an error if we try to execute it
+        break;
+    }
+    return di;
+}
+
+instr decoded_instr::encode() const
+{
+    switch (op) {
+    case opcode::set:
+        return instr::set(lhs, imm);
+    case opcode::store:
+        return instr::store(lhs, rhs, imm);
+    case opcode::load:
+        return instr::load(lhs, rhs, imm);
+    case opcode::add:
+        return instr::add(lhs, rhs);
+    case opcode::sub:
+        return instr::sub(lhs, rhs);
+    case opcode::halt:
+        return instr::halt();
+    case opcode::compare:
+        return instr::compare(lhs, rhs);
+    case opcode::jump:
+        return instr::jump(flag, offset());
+    case opcode::ijump:
+        return instr::ijump(flag, lhs);
+    case opcode::call:
+        return instr::call(offset());
+    default:
+        return instr{op, 0};
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "cpu_base.h"
+#include "instr.h"
+#include "opcode.h"
+#include "reg.h"
+
+#include <format>
+#include <utility>
+
+struct system_state;
+struct decoded_instr;
+
+// Implementation of a single decoded instruction for the direct-threaded engine. Each handler
+// finishes by tail calling the handler of whichever instruction runs next.
+using instr_handler = void (*)(system_state * state, decoded_instr const * di);
+
+// An instruction with all of its operands already pulled out of the bitfields, so the interpreter
+// can execute it without touching instr::decode_*. Which fields are meaningful depends on op:
+//
+//   set      lhs = dest, imm = value
+//   store    lhs = addr, rhs = src, imm = width
+//   load     lhs = dest, rhs = addr, imm = width
+//   add/sub  lhs = dest, rhs = op1
+//   compare  lhs = op1, rhs = op2
+//   jump     flag, imm = relative offset
+//   ijump    flag, lhs = loc
+//   call     imm = relative offset
+//
+// handler is only used by the threaded engine and is filled in by system_state, since it depends
+// on the engine rather than on the encoding. Kept to 16 bytes so a whole ROM worth of them stays
+// cache friendly.
+struct decoded_instr
+{
+    instr_handler handler;
+    opcode op;
+    reg lhs;
+    reg rhs;
+    cmp_flag flag;
+    word_t imm;
+
+    signed_word_t offset() const
+    {
+        return static_cast<signed_word_t>(imm);
+    }
+
+    // re-encode, mostly useful for logging and tests
+    instr encode() const;
+};
+
+static_assert(sizeof(decoded_instr) == 16);
+
+// What decode() gives a word that has an opcode but isn't a valid instruction anyway, like a
+// load or store with a width that doesn't exist. Past k_num_opcodes, so every engine treats it
+// like any other unknown opcode.
+static opcode constexpr k_invalid_opcode = static_cast<opcode>(0xff);
+static_assert(std::to_underlying(k_invalid_opcode) >= k_num_opcodes);
+
+decoded_instr decode(instr ii);
+
+template <>
+struct std::formatter<decoded_instr>
+{
+    template <class ParseContext>
+    constexpr std::format_parse_context::iterator parse(ParseContext & ctx)
+    {
+        return ctx.begin();
+    }
+
+    template <class FormatContext>
+    auto format(decoded_instr const & di, FormatContext & ctx) const
+    {
+        return std::format_to(ctx.out(), "{}", di.encode());
+    }
+};
@@ -0,0 +1,58 @@
+#include "decoded_instr.h"
+#include "instr.h"
+#include "reg.h"
+#include "test.h"
+
+#include <cassert>
+#include <initializer_list>
+#include <random>
+
+static void check_round_trip(instr ii)
+{
+    decoded_instr di = decode(ii);
+    assert(di.op == ii.get_opcode());
+    assert(di.encode().storage == ii.storage);
+}
+
+TEST("decoded_instr.round_trip")
+{
+    for (reg lhs : k_all_registers) {
+        check_round_trip(
+            instr::set(lhs, std::uniform_int_distribution{0U, instr::k_max_set_value}(test_rng())));
+        check_round_trip(instr::ijump(instr::unc, lhs));
+        for (reg rhs : k_all_registers) {
+            for (word_t width : {1, 2, 4}) {
+                check_round_trip(instr::load(lhs, rhs, width));
+                check_round_trip(instr::store(lhs, rhs, width));
+            }
+            check_round_trip(instr::add(lhs, rhs));
+            check_round_trip(instr::sub(lhs, rhs));
+            check_round_trip(instr::compare(lhs, rhs));
+        }
+    }
+
+    for (signed_word_t offset : {instr::k_jump_min_offset, -4, 0, 4, instr::k_jump_max_offset}) {
+        for (cmp_flag flag : instr::k_all_cmp_flags) {
+            check_round_trip(instr::jump(flag, offset));
+        }
+    }
+
+    for (signed_word_t offset : {instr::k_call_min_offset, -4, 0, 4, instr::k_call_max_offset}) {
+        check_round_trip(instr::call(offset));
+    }
+
+    check_round_trip(instr::halt());
+}
+
+TEST("decoded_instr.operands")
+{
+    decoded_instr di = decode(instr::load4(r3, r9));
+    assert(di.op == opcode::load && di.lhs == r3 && di.rhs == r9 && di.imm == 4);
+
+    di = decode(instr::jump(instr::le, -12));
+    assert(di.op == opcode::jump && di.flag == instr::le && di.offset() == -12);
+
+    // a store and a load with the width selector no width has
+    assert(decode(instr{0x30001}).op == k_invalid_opcode);
+    assert(decode(instr{0x30002}).op == k_invalid_opcode);
+}
@@ -0,0 +1,16 @@
+#include "device.h"
+
+#include "iomap.h"
+
+#include <cassert>
+#include <utility>
+
+void device_bus::attach(word_t base, word_t size, std::shared_ptr<device> dev)
+{
+    assert(base % k_page_size == 0 && size % k_page_size == 0 && size > 0);
+    assert(base >= iomap::k_io_base && base <= iomap::k_console_base - size);
+    for (attached const & other : devices_) {
+        assert((base + size <= other.base || other.base + other.size <= base) && "overlap");
+    }
+    devices_.push_back({base, size, std::move(dev)});
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "cpu_base.h"
+
+#include <memory>
+#include <vector>
+
+// Something other than memory that lives at a range of guest addresses, e.g. the console. The mmu
+// sends every access to a device's pages here, and nothing else: loads and stores to RAM and ROM
+// never get anywhere near device code, so adding devices costs them nothing.
+struct device
+{
+    virtual ~device() = default;
+
+    // An aligned load or store of width bytes at offset from where the device is mapped. Loads put
+    // what they read in *value, stores take what to write from it.
+    virtual void access(bool is_load, word_t offset, word_t * value, word_t width) = 0;
+};
+
+// The devices a system_state has been given besides its console, and where they go. Devices can
+// only go in [iomap::k_io_base, iomap::k_console_base), a page at a time.
+//
+// Forks share their parent's devices, so a device used by VMs on more than one thread has to
+// cope with that itself.
+struct device_bus
+{
+    struct attached
+    {
+        word_t base;
+        word_t size;
+        std::shared_ptr<device> dev;
+    };
+
+    // base and size must be page aligned, and not overlap anything attached already
+    void attach(word_t base, word_t size, std::shared_ptr<device> dev);
+
+    std::vector<attached> const & devices() const
+    {
+        return devices_;
+    }
+
+private:
+    std::vector<attached> devices_;
+};
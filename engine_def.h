@@ -0,0 +1,5 @@
+#define ENUM_TYPE_NAME engine
+#define ENUM_UNDERLYING_TYPE uint8_t
+X(interp)
+X(threaded)
+X(jit)
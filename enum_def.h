@@ -2,8 +2,10 @@
 #error "must define ENUM_DEF_FILE_NAME"
 #endif
 
+#include "perfect_hash.h"
 #include "preprocessor.h"
 
+#include <array>
 #include <iterator>
 #include <optional>
 #include <string_view>
@@ -14,8 +16,9 @@
 #undef X
 
 #define ENUM_TABLE_NAME PASTE(ENUM_TYPE_NAME, _enum_table)
+#define ENUM_HASH_NAME PASTE(ENUM_TYPE_NAME, _enum_hash)
 
-static std::string_view const ENUM_TABLE_NAME[] = {
+static std::string_view constexpr ENUM_TABLE_NAME[] = {
 #define X(op)                                                           \
     [std::to_underlying(ENUM_TYPE_NAME::op)] = std::string_view                                \
     {                                                                   \
@@ -25,13 +28,13 @@ static std::string_view const ENUM_TABLE_NAME[] = {
 #undef X
 };
 
+static auto constexpr ENUM_HASH_NAME = make_perfect_hash(std::to_array(ENUM_TABLE_NAME));
+
 template <>
 std::optional<ENUM_TYPE_NAME> from_str<ENUM_TYPE_NAME>(std::string_view str)
 {
-    for (size_t i = 0; i < std::size(ENUM_TABLE_NAME); ++i) {
-        if (ENUM_TABLE_NAME[i] == str) {
-            return static_cast<ENUM_TYPE_NAME>(i);
-        }
+    if (std::optional<size_t> index = ENUM_HASH_NAME.find(str)) {
+        return static_cast<ENUM_TYPE_NAME>(*index);
     }
     return std::nullopt;
 }
@@ -45,6 +48,7 @@ std::string_view to_str(ENUM_TYPE_NAME op)
     return ENUM_TABLE_NAME[index];
 }
 
+#undef ENUM_HASH_NAME
 #undef ENUM_TABLE_NAME
 #undef ENUM_TYPE_NAME
 #undef ENUM_UNDERLYING_TYPE
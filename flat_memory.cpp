@@ -0,0 +1,75 @@
+#include "flat_memory.h"
+
+#include "guest_fault.h"
+#include "iomap.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cassert>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static logger logger{__FILE__};
+
+bool flat_memory::supported()
+{
+#if defined(__linux__) && UINTPTR_MAX > UINT32_MAX
+    return true;
+#else
+    return false;
+#endif
+}
+
+flat_memory::flat_memory()
+{
+    if (!supported()) {
+        logger.abort("flat memory isn't supported on this host");
+    }
+
+    // just address space, nothing is committed until map()
+    void * base = mmap(nullptr, k_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1, 0);
+    if (base == MAP_FAILED) {
+        logger.abort("couldn't reserve {} bytes for flat memory", k_size);
+    }
+    base_ = static_cast<uint8_t *>(base);
+    install_guest_fault_handler();
+}
+
+flat_memory::~flat_memory()
+{
+    for (host_view const & view : host_views_) {
+        munmap(view.addr, view.size);
+    }
+    munmap(base_, k_size);
+}
+
+uint8_t * flat_memory::map(word_t guest_base, size_t size, bool writable)
+{
+#if defined(__linux__)
+    assert(guest_base % k_page_size == 0 && size % k_page_size == 0);
+    assert(guest_base + uint64_t{size} <= k_size);
+
+    int fd = memfd_create("guest memory", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        logger.abort("couldn't create {} bytes of guest memory", size);
+    }
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    void * guest = mmap(base_ + guest_base, size, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+    void * host = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (guest == MAP_FAILED || host == MAP_FAILED) {
+        logger.abort("couldn't map {} bytes of guest memory", size);
+    }
+    // the mappings keep it alive
+    close(fd);
+
+    host_views_.push_back({static_cast<uint8_t *>(host), size});
+    direct_from_ = std::min(direct_from_, guest_base);
+    return static_cast<uint8_t *>(host);
+#else
+    (void)guest_base;
+    (void)size;
+    (void)writable;
+    return nullptr;
+#endif
+}
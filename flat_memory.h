@@ -0,0 +1,57 @@
+#pragma once
+
+#include "cpu_base.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// The whole 32-bit guest address space as one host mapping, so that a guest address is just an
+// offset from base(). Memory is mapped in at its guest address and everything else is PROT_NONE,
+// so out of range accesses (and writes to read-only memory) fault in hardware and come back as
+// guest faults, see guest_fault.h. Devices aren't in here at all: the guest addresses below
+// direct_from() are left to the page table.
+//
+// Each piece of memory is a memfd mapped twice: once into the guest address space with the
+// guest's permissions, and once more somewhere else read-write for the host, e.g. for set_rom.
+//
+// Linux only.
+struct flat_memory
+{
+    static uint64_t constexpr k_size = uint64_t{std::numeric_limits<word_t>::max()} + 1;
+
+    static bool supported();
+
+    flat_memory();
+    ~flat_memory();
+
+    flat_memory(flat_memory const &) = delete;
+    flat_memory & operator=(flat_memory const &) = delete;
+
+    // Put size bytes of zeroed memory at guest_base, writable by the guest or not. Returns the host
+    // view of it.
+    uint8_t * map(word_t guest_base, size_t size, bool writable);
+
+    uint8_t * base() const
+    {
+        return base_;
+    }
+
+    // the lowest guest address anything has been mapped at
+    word_t direct_from() const
+    {
+        return direct_from_;
+    }
+
+private:
+    struct host_view
+    {
+        uint8_t * addr;
+        size_t size;
+    };
+
+    uint8_t * base_ = nullptr;
+    word_t direct_from_ = std::numeric_limits<word_t>::max();
+    std::vector<host_view> host_views_;
+};
@@ -0,0 +1,30 @@
+#include "flat_memory.h"
+
+#include "iomap.h"
+#include "test.h"
+
+#include <cassert>
+#include <cstdint>
+
+TEST("flat_memory.map")
+{
+    if (!flat_memory::supported()) {
+        return;
+    }
+
+    flat_memory flat;
+    uint8_t * ram = flat.map(iomap::k_ram_base, iomap::k_ram_size, true);
+    uint8_t * rom = flat.map(iomap::k_rom_base, iomap::k_rom_size, false);
+    assert(flat.direct_from() == iomap::k_rom_base);
+
+    // the host view and the guest's are the same memory, which starts out zeroed
+    assert(flat.base()[iomap::k_ram_base + 5] == 0);
+    ram[5] = 42;
+    assert(flat.base()[iomap::k_ram_base + 5] == 42);
+    flat.base()[iomap::k_ram_base + 6] = 43;
+    assert(ram[6] == 43);
+
+    // the guest can't write ROM, but the host can
+    rom[iomap::k_rom_size - 1] = 44;
+    assert(flat.base()[iomap::k_rom_base + iomap::k_rom_size - 1] == 44);
+}
@@ -6,6 +6,7 @@
 #include "reg.h"
 #include "system_state.h"
 #include "test.h"
+#include "test_programs.h"
 
 #include <cassert>
 #include <cstring>
@@ -85,88 +86,19 @@ TEST("full_program.add_numbers")
     assert(system.raw_load(iomap::k_ram_base) == 42 + 43);
 }
 
-static std::vector<uint8_t> make_fib_rom()
-{
-    std::string prog = std::format(R"(
-
-    # initialize stack pointer to k_ram_base
-    set r14 {}
-
-    # test sets the function argument in r0
-
-    # call fib (sets r15 to return address)
-    call fib
-    halt
-
-# argument is in r0, return value is in r13, stack pointer r14, return address r15
-# callee r15
-fib:
-    set r1 1
-    compare r0 r1     # compare x with 1
-    jump.gt recurse   # x > 1, recursive case
-    set r13 1         # set return value to 1
-    ijump r15         # return
-
-recurse:
-    set r2 4
-
-    store r14 r15     # store r15 (return address) onto the stack
-    add r14 r2        # increment stack pointer
-
-    store r14 r0      # store r0 (function argument) onto the stack
-    add r14 r2        # increment stack pointer
-
-    set r2 1
-    sub r0 r2         # compute x = x - 1
-
-    call fib          # recurse, calling fib(x-1)
-
-    set r2 4
-    sub r14 r2        # decrement stack pointer
-    load r0 r14       # pop r0 (function argument) off the stack
-
-    store r14 r13     # store return value from fib(x-1) on the stack
-    add r14 r2        # increment stack pointer
-
-    set r2 2
-    sub r0 r2         # compute x = x - 2
-
-    call fib          # recurse, calling fib(x-2)
-
-    set r2 4
-    sub r14 r2        # decrement stack pointer
-    load r1 r14       # pop fib(x-1) into r1
-
-    add r13 r1        # set ret = fib(x-2) + fib(x-1)
-
-    sub r14 r2        # decrement stack pointer
-    load r15 r14      # pop return address off the stack
-    ijump r15         # return
-
-)",
-                                   iomap::k_ram_base);
-
-    return assemble(prog);
-}
-
-static word_t fib(word_t x)
-{
-    if (x <= 1) {
-        return 1;
-    }
-    return fib(x - 1) + fib(x - 2);
-}
-
 TEST("full_program.fib")
 {
     std::vector<uint8_t> fib_rom = make_fib_rom();
-    for (word_t i : {1, 2, 3, 4, 5}) {
-        word_t expected = fib(i);
-        logger.debug("computing fib({}), expecting {}", i, expected);
-        system_state system;
-        system.set_rom(fib_rom);
-        system.cpu.get(r0) = i;
-        system.run();
-        assert(system.cpu.get(r13) == expected);
+    for (engine eng : k_all_engines) {
+        for (word_t i : {1, 2, 3, 4, 5}) {
+            word_t expected = host_fib(i);
+            logger.debug("computing fib({}) with {}, expecting {}", i, to_str(eng), expected);
+            system_state system;
+            system.engine = eng;
+            system.set_rom(fib_rom);
+            system.cpu.get(r0) = i;
+            system.run();
+            assert(system.cpu.get(r13) == expected);
+        }
     }
 }
@@ -0,0 +1,36 @@
+#include "fusion.h"
+
+#include "opcode.h"
+
+#define ENUM_DEF_FILE_NAME "fusion_def.h"
+#include "enum_def.h"
+
+std::optional<fusion> find_fusion(decoded_instr const & first, decoded_instr const & second)
+{
+    if (first.op == opcode::compare && second.op == opcode::jump) {
+        return fusion::compare_jump;
+    }
+    if (first.op == opcode::set) {
+        // only when the add/sub actually consumes the constant, that's what "add an immediate"
+        // looks like in guest code
+        if (second.op == opcode::add && second.rhs == first.lhs) {
+            return fusion::set_add;
+        }
+        if (second.op == opcode::sub && second.rhs == first.lhs) {
+            return fusion::set_sub;
+        }
+        if (second.op == opcode::store) {
+            return fusion::set_store;
+        }
+    }
+    return std::nullopt;
+}
+
+uint64_t fusion_stats::dispatches_saved() const
+{
+    uint64_t total = 0;
+    for (uint64_t n : executed) {
+        total += n;
+    }
+    return total;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "decoded_instr.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <optional>
+
+// Superinstructions for the threaded engine. When two instructions that commonly show up
+// back to back are found next to each other in ROM, the first one gets a handler that executes
+// both and then dispatches straight to the instruction after the second. The decoded_instr of the
+// second one is left alone, so jumping directly to it still works, and since the fused handler
+// just does both instructions in order, every register (including ones the second instruction
+// would have overwritten) ends up exactly as if they had run separately.
+
+#define ENUM_DEF_FILE_NAME "fusion_def.h"
+#include "enum_decl.h" // IWYU pragma: export
+
+static size_t constexpr k_num_fusions = 0
+#define X(x) +1
+#include "fusion_def.h"
+#undef X
+    ;
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+
+// which fusion, if any, applies to first immediately followed by second
+std::optional<fusion> find_fusion(decoded_instr const & first, decoded_instr const & second);
+
+struct fusion_stats
+{
+    // how many places in ROM each fusion was applied
+    size_t sites[k_num_fusions]{};
+
+    // how many times each fused handler ran, every one of which saved a dispatch
+    uint64_t executed[k_num_fusions]{};
+
+    uint64_t dispatches_saved() const;
+};
+
+template <>
+struct std::formatter<fusion_stats>
+{
+    template <class ParseContext>
+    constexpr std::format_parse_context::iterator parse(ParseContext & ctx)
+    {
+        return ctx.begin();
+    }
+
+    template <class FormatContext>
+    auto format(fusion_stats const & stats, FormatContext & ctx) const
+    {
+        auto out = ctx.out();
+        for (size_t i = 0; i < k_num_fusions; ++i) {
+            out = std::format_to(out,
+                                 "{}: {} sites, {} executed; ",
+                                 to_str(static_cast<fusion>(i)),
+                                 stats.sites[i],
+                                 stats.executed[i]);
+        }
+        return std::format_to(out, "{} dispatches saved", stats.dispatches_saved());
+    }
+};
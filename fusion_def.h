@@ -0,0 +1,6 @@
+#define ENUM_TYPE_NAME fusion
+#define ENUM_UNDERLYING_TYPE uint8_t
+X(compare_jump)
+X(set_add)
+X(set_sub)
+X(set_store)
@@ -0,0 +1,81 @@
+#include "guest_fault.h"
+
+#include "flat_memory.h"
+#include "log.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <mutex>
+#include <signal.h>
+
+static logger logger{__FILE__};
+
+static thread_local guest_fault_target * t_target = nullptr;
+
+void push_guest_fault_target(guest_fault_target * target)
+{
+    target->previous = t_target;
+    t_target = target;
+}
+
+void pop_guest_fault_target(guest_fault_target * target)
+{
+    assert(t_target == target);
+    t_target = target->previous;
+}
+
+void raise_guest_fault(word_t addr)
+{
+    guest_fault_target * target = t_target;
+    if (target == nullptr) {
+        // logger.abort doesn't return either, but isn't marked as such
+        logger.abort("guest fault at {:#x} outside of system_state::run", addr);
+        std::abort();
+    }
+    target->addr = addr;
+    siglongjmp(target->jmp, 1);
+}
+
+#if defined(__linux__)
+static struct sigaction g_previous_action;
+
+static void handle_segv(int signo, siginfo_t * info, void * context)
+{
+    guest_fault_target * target = t_target;
+    auto const * addr = static_cast<uint8_t const *>(info->si_addr);
+    if (target != nullptr && target->flat_base != nullptr && addr >= target->flat_base
+        && static_cast<uint64_t>(addr - target->flat_base) < flat_memory::k_size) {
+        target->addr = static_cast<word_t>(addr - target->flat_base);
+        siglongjmp(target->jmp, 1);
+    }
+
+    // Not ours. If whoever had it before has a handler give it this one, otherwise put them back
+    // and let the access fault again.
+    if (g_previous_action.sa_flags & SA_SIGINFO) {
+        g_previous_action.sa_sigaction(signo, info, context);
+    } else if (g_previous_action.sa_handler != SIG_DFL && g_previous_action.sa_handler != SIG_IGN) {
+        g_previous_action.sa_handler(signo);
+    } else {
+        sigaction(SIGSEGV, &g_previous_action, nullptr);
+    }
+}
+#endif
+
+void install_guest_fault_handler()
+{
+#if defined(__linux__)
+    static std::once_flag g_installed;
+    std::call_once(g_installed, [] {
+        struct sigaction action{};
+        action.sa_sigaction = &handle_segv;
+        // We leave the handler with siglongjmp rather than returning, and don't save the signal
+        // mask when setting targets up since that's a syscall, so SIGSEGV mustn't be blocked while
+        // we're in here.
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGSEGV, &action, &g_previous_action) != 0) {
+            logger.abort("couldn't install the SIGSEGV handler");
+        }
+    });
+#endif
+}
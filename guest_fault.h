@@ -0,0 +1,37 @@
+#pragma once
+
+#include "cpu_base.h"
+
+#include <cstdint>
+#include <setjmp.h>
+
+// Guest faults: loads and stores to unmapped memory, and stores to ROM.
+//
+// A fault unwinds straight out of whatever engine is running, back to a guest_fault_target that
+// system_state::run_bounded keeps on its stack while it runs. Faults are raised either by the slow
+// path of a load or store, or by the SIGSEGV handler when flat memory (see flat_memory.h) catches
+// one in hardware. Either way it's a siglongjmp, so nothing between the target and the fault may
+// have anything on its stack that needs destroying.
+struct guest_fault_target
+{
+    sigjmp_buf jmp;
+
+    // the guest address that faulted
+    word_t addr = 0;
+
+    // The running state's flat memory, if it has any. Only a SIGSEGV inside it is a guest fault.
+    uint8_t const * flat_base = nullptr;
+
+    guest_fault_target * previous = nullptr;
+};
+
+// Send faults on this thread to target until the matching pop. target->jmp must already be set.
+void push_guest_fault_target(guest_fault_target * target);
+void pop_guest_fault_target(guest_fault_target * target);
+
+// Unwind to the current target. With no target there's nobody to tell, so we abort.
+[[noreturn]] void raise_guest_fault(word_t addr);
+
+// Turn SIGSEGVs inside flat memory into guest faults. Other SIGSEGVs are left to whatever handled
+// them before. Safe to call more than once.
+void install_guest_fault_handler();
@@ -11,62 +11,104 @@ std::initializer_list<cmp_flag> const instr::k_all_cmp_flags{
 #undef X
 };
 
-std::string to_str(instr const & ii)
+bool instr::retarget(signed_word_t relative_offset)
 {
-    switch (ii.get_opcode()) {
+    switch (get_opcode()) {
+    case opcode::jump: {
+        if (relative_offset < k_jump_min_offset || relative_offset > k_jump_max_offset) {
+            return false;
+        }
+        cmp_flag flag;
+        signed_word_t old_offset;
+        decode_jump(&flag, &old_offset);
+        *this = jump(flag, relative_offset);
+        return true;
+    }
+    case opcode::call:
+        if (relative_offset < k_call_min_offset || relative_offset > k_call_max_offset) {
+            return false;
+        }
+        *this = call(relative_offset);
+        return true;
+    case opcode::set:
+    case opcode::store:
+    case opcode::load:
+    case opcode::add:
+    case opcode::sub:
+    case opcode::halt:
+    case opcode::compare:
+    case opcode::ijump:
+    default:
+        return false;
+    }
+}
+
+char * format_instr(char * out, instr const & ii)
+{
+    opcode const op = ii.get_opcode();
+    if ((op == opcode::store || op == opcode::load) && !ii.has_valid_width()) {
+        return std::format_to(out, "unknown");
+    }
+    switch (op) {
     case opcode::set: {
         reg dest;
         word_t value;
         ii.decode_set(&dest, &value);
-        return std::format("set {} {}", dest, value);
+        return std::format_to(out, "set {} {}", dest, value);
     }
     case opcode::store: {
         reg addr, src;
         word_t width;
         ii.decode_store(&addr, &src, &width);
-        return std::format("store.{} {} {}", width, addr, src);
+        return std::format_to(out, "store.{} {} {}", width, addr, src);
     }
     case opcode::load: {
         reg dest, addr;
         word_t width;
         ii.decode_load(&dest, &addr, &width);
-        return std::format("load.{} {} {}", width, dest, addr);
+        return std::format_to(out, "load.{} {} {}", width, dest, addr);
     }
     case opcode::add: {
         reg dest, op1;
         ii.decode_add(&dest, &op1);
-        return std::format("add {} {}", dest, op1);
+        return std::format_to(out, "add {} {}", dest, op1);
     }
     case opcode::sub: {
         reg dest, op1;
         ii.decode_sub(&dest, &op1);
-        return std::format("sub {} {}", dest, op1);
+        return std::format_to(out, "sub {} {}", dest, op1);
     }
     case opcode::halt:
-        return "halt";
+        return std::format_to(out, "halt");
     case opcode::compare: {
         reg op1, op2;
         ii.decode_compare(&op1, &op2);
-        return std::format("compare {} {}", op1, op2);
+        return std::format_to(out, "compare {} {}", op1, op2);
     }
     case opcode::jump: {
         cmp_flag flag;
         signed_word_t relative_offset;
         ii.decode_jump(&flag, &relative_offset);
-        return std::format("jump.{} {}", to_str(flag), relative_offset);
+        return std::format_to(out, "jump.{} {}", to_str(flag), relative_offset);
     }
     case opcode::ijump: {
         cmp_flag flag;
         reg loc;
         ii.decode_ijump(&flag, &loc);
-        return std::format("ijump.{} {}", flag, loc);
+        return std::format_to(out, "ijump.{} {}", flag, loc);
     }
     case opcode::call: {
         signed_word_t relative_offset;
         ii.decode_call(&relative_offset);
-        return std::format("call {}", relative_offset);
+        return std::format_to(out, "call {}", relative_offset);
     }
     default:
-        return "unknown";
+        return std::format_to(out, "unknown");
     }
 }
+
+std::string to_str(instr const & ii)
+{
+    char buffer[k_max_instr_chars];
+    return std::string{buffer, format_instr(buffer, ii)};
+}
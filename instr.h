@@ -5,10 +5,12 @@
 #include "opcode.h"
 #include "reg.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <format>
 #include <initializer_list>
+#include <iterator>
 #include <optional>
 #include <stdint.h>
 #include <string>
@@ -89,9 +91,10 @@ private:
 
     static word_t sel_to_width(width_sel width_sel)
     {
-        uint8_t raw = static_cast<uint8_t>(width_sel);
-        assert(raw < 3);
-        return raw == 0 ? 1 : raw == 1 ? 2 : 4;
+        // the selector no width has still gives the widest, see has_valid_width()
+        size_t raw = static_cast<uint8_t>(width_sel);
+        assert(raw < std::size(k_load_store_widths));
+        return k_load_store_widths[std::min(raw, std::size(k_load_store_widths) - 1)];
     }
 
     static width_sel width_to_sel(word_t width)
@@ -100,6 +103,26 @@ private:
         return static_cast<width_sel>(width == 1 ? 0 : width == 2 ? 1 : 2);
     }
 
+public:
+    // Every width a load or store can have, indexed by its encoded width_sel. The engines
+    // instantiate a path for each of these, see threaded.cpp.
+    static constexpr word_t k_load_store_widths[] = {1, 2, 4};
+
+    // where width is in k_load_store_widths
+    static size_t width_index(word_t width)
+    {
+        return static_cast<size_t>(width_to_sel(width));
+    }
+
+    // Whether a load or store has one of k_load_store_widths. There's room in the encoding for
+    // one more, which makes the word not an instruction at all.
+    bool has_valid_width() const
+    {
+        auto sel = load_store_builder.extract<width_sell_f>(storage);
+        return static_cast<uint8_t>(sel) < std::size(k_load_store_widths);
+    }
+
+private:
     static instr load_store(opcode op, reg addr, reg src, word_t width)
     {
         assert(op == opcode::load || op == opcode::store);
@@ -306,6 +329,10 @@ public:
         *relative_offset = (static_cast<signed_word_t>(storage) >> (k_opcode_bits)) * k_word_size;
     }
 
+    // Point a jump (keeping its flag) or a call at relative_offset instead. False if this is
+    // neither, or it can't reach that far.
+    bool retarget(signed_word_t relative_offset);
+
     word_t storage;
 };
 
@@ -316,6 +343,13 @@ std::optional<T> from_str(std::string_view str);
 
 std::string to_str(instr const & ii);
 
+// the most characters to_str() gives for any word
+static size_t constexpr k_max_instr_chars = 32;
+
+// Write to_str(ii) to out, which has room for k_max_instr_chars, without allocating anything, and
+// return where it ends.
+char * format_instr(char * out, instr const & ii);
+
 template <>
 struct std::formatter<instr>
 {
@@ -328,10 +362,11 @@ struct std::formatter<instr>
     template <class FormatContext>
     auto format(instr const & ii, FormatContext & ctx) const
     {
-        std::string instr = to_str(ii);
+        char buffer[k_max_instr_chars];
+        char const * const end = format_instr(buffer, ii);
         auto it = ctx.out();
-        for (char c : instr) {
-            *it++ = c;
+        for (char const * c = buffer; c != end; ++c) {
+            *it++ = *c;
         }
         return it;
     }
@@ -349,6 +384,7 @@ struct std::formatter<cmp_flag>
     template <class FormatContext>
     auto format(cmp_flag const & flag, FormatContext & ctx) const
     {
-        return std::format_to(ctx.out(), "{}", to_str(flag));
+        // just the name, without going through another format string
+        return std::ranges::copy(to_str(flag), ctx.out()).out;
     }
 };
@@ -2,11 +2,14 @@
 
 #include "cpu_base.h"
 
+#include <cstdint>
+
 static word_t constexpr k_page_size = 16384;
 
 namespace iomap
 {
-    // IO
+    // IO, see device.h. The first page is left unmapped so that null pointers fault.
+    static word_t constexpr k_io_base = k_page_size;
     static word_t constexpr k_console_base = k_page_size * 4;
     static word_t constexpr k_console_write = k_console_base;
     static word_t constexpr k_console_size = k_page_size;
@@ -19,3 +22,25 @@ namespace iomap
     static word_t constexpr k_ram_base = k_page_size * 6;
     static word_t constexpr k_ram_size = k_page_size;
 }; // namespace iomap
+
+// How much ROM and RAM a system_state has. ROM is always at iomap::k_rom_base with RAM right after
+// it, so the defaults are the map above. Neither costs anything up front (see paged_memory.h), so
+// these can be as big as fits in the guest address space.
+struct memory_layout
+{
+    // both multiples of k_page_size
+    word_t rom_size = iomap::k_rom_size;
+    word_t ram_size = iomap::k_ram_size;
+
+    word_t ram_base() const
+    {
+        return iomap::k_rom_base + rom_size;
+    }
+
+    bool valid() const
+    {
+        uint64_t end = uint64_t{iomap::k_rom_base} + rom_size + ram_size;
+        return rom_size > 0 && ram_size > 0 && rom_size % k_page_size == 0
+            && ram_size % k_page_size == 0 && end <= uint64_t{1} << 32;
+    }
+};
@@ -0,0 +1,730 @@
+#include "jit.h"
+
+#include "decoded_instr.h"
+#include "flat_memory.h"
+#include "iomap.h"
+#include "log.h"
+#include "opcode.h"
+#include "paged_memory.h"
+#include "reg.h"
+#include "system_state.h"
+#include "x64_emitter.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <sys/mman.h>
+#include <utility>
+
+// Block-at-a-time translation to x86-64.
+//
+// A block starts at any ROM address the dispatcher in jit::run() is asked to execute, and runs up
+// to and including the first jump/ijump/call, or up to but not including a halt or anything that
+// isn't a valid instruction. Guest registers used by a block are loaded into host registers on
+// entry and written back on every exit, as are the compare flags, so inside a block guest code
+// touches no memory other than what it loads and stores itself.
+//
+// Register conventions inside generated code:
+//
+//   rbx      the guest cpu
+//   r12      guest RAM: paged_memory::host_pages(), or flat_memory::base() with flat memory
+//   r13      guest compare flags (cpu.cpu_cmp_flags)
+//   rbp      instruction budget
+//   [rsp]    the system_state, for calls back into C++
+//   rax, rcx, rdx  scratch
+//   k_guest_pool   guest registers, assigned per block
+//
+// Blocks are entered through enter_ and leave through exit_ with the guest address to continue
+// at in eax. Loads and stores that hit plain RAM are done inline, everything else (the console,
+// ROM, anything unmapped, anything misaligned, a store to a page still shared with a fork) calls
+// back into system_state so the slow path is exactly the one the interpreters use. With flat
+// memory everything from ROM up is inline, and the host catches faults.
+//
+// Every block starts by checking that what's left of the instruction budget (system_state::budget,
+// kept in rbp while in generated code) covers all of it and paying for it up front. If it doesn't,
+// the block leaves straight away with k_out_of_budget as its exit id and the dispatcher returns.
+//
+// Translations are cached by guest address in blocks_ and chained together: every exit to a
+// constant address (jump, call, falling through) is a jmp to exit_ that also reports its exit id
+// in the upper half of rax. The first time the dispatcher sees a given exit it patches that jmp to
+// go straight to the successor's code, so after warming up, loops and calls never come back to
+// the dispatcher. Exits to a register (ijump) can't be patched, but they look the target up in
+// blocks_ inline and only fall back to the dispatcher when it hasn't been translated yet.
+
+static logger logger{__FILE__};
+
+static size_t constexpr k_code_size = size_t{4} << 20;
+static size_t constexpr k_max_block_instrs = 256;
+
+// exit id for blocks that didn't have the budget to run, never a real exit
+static uint64_t constexpr k_out_of_budget = 0xffffffff;
+
+static x64_reg constexpr k_cpu_reg = x64_reg::rbx;
+static x64_reg constexpr k_mem_reg = x64_reg::r12;
+static x64_reg constexpr k_flags_reg = x64_reg::r13;
+static x64_reg constexpr k_budget_reg = x64_reg::rbp;
+
+static x64_reg constexpr k_guest_pool[] = {
+    x64_reg::rsi,
+    x64_reg::rdi,
+    x64_reg::r8,
+    x64_reg::r9,
+    x64_reg::r10,
+    x64_reg::r11,
+    x64_reg::r14,
+    x64_reg::r15,
+};
+
+static uint32_t constexpr flag_bit(cpu_cmp_flags flag)
+{
+    return uint32_t{1} << std::to_underlying(flag);
+}
+
+static x64_mem guest_reg_mem(reg rr)
+{
+    return {k_cpu_reg,
+            std::nullopt,
+            static_cast<int32_t>(offsetof(cpu, registers) + std::to_underlying(rr) * k_word_size)};
+}
+
+static x64_mem guest_flags_mem()
+{
+    return {k_cpu_reg, std::nullopt, static_cast<int32_t>(offsetof(cpu, cpu_cmp_flags))};
+}
+
+static void jit_store(system_state * state, reg addr, reg src, word_t width)
+{
+    state->execute_store(addr, src, width);
+}
+
+static void jit_load(system_state * state, reg addr, reg dest, word_t width)
+{
+    state->execute_load(addr, dest, width);
+}
+
+namespace
+{
+    // Everything needed while emitting one block.
+    struct block_translator
+    {
+        block_translator(x64_emitter * emitter, uint8_t const * exit, uint8_t * const * blocks,
+                         std::vector<uint8_t *> * exits, memory_layout const & layout,
+                         flat_memory const * flat)
+            : e{*emitter}
+            , exit_{exit}
+            , blocks_{blocks}
+            , exits_{*exits}
+            , layout_{layout}
+            , flat_{flat}
+        { }
+
+        void allocate(std::span<decoded_instr const> instrs);
+        void emit_budget_check(size_t num_instrs, word_t addr);
+        void emit_entry();
+        void emit(decoded_instr const & di, word_t addr);
+        void emit_exit(word_t next_addr);
+        void emit_slow_paths();
+
+    private:
+        // guest registers the block has written so far, by bit
+        using reg_set = uint32_t;
+
+        struct slow_path
+        {
+            decoded_instr di;
+            std::array<uint8_t *, 3> branches;
+            uint8_t const * resume;
+            reg_set dirty;
+            bool flags_dirty;
+        };
+
+        x64_rm loc(reg rr) const
+        {
+            if (auto host = host_regs_[std::to_underlying(rr)]) {
+                return *host;
+            }
+            return guest_reg_mem(rr);
+        }
+
+        void write(reg rr)
+        {
+            dirty_ |= reg_set{1} << std::to_underlying(rr);
+        }
+
+        void flush(reg_set dirty, bool flags_dirty);
+        void reload();
+        void emit_alu(x64_alu op, reg lhs, reg rhs);
+        void emit_compare(reg lhs, reg rhs);
+        void emit_load_store(decoded_instr const & di);
+
+        // test the guest flags for flag, returning the host condition that means the branch is
+        // taken, or nothing for unconditional branches
+        std::optional<x64_cond> emit_flag_test(cmp_flag flag);
+
+        // leave the block for next_addr through a chainable exit
+        void emit_goto(word_t next_addr);
+
+        // leave the block for the address in target, going straight to its translation if there
+        // is one
+        void emit_goto(reg target);
+
+        x64_emitter & e;
+        uint8_t const * const exit_;
+        uint8_t * const * const blocks_;
+        std::vector<uint8_t *> & exits_;
+        memory_layout const layout_;
+        flat_memory const * const flat_;
+        std::optional<x64_reg> host_regs_[k_num_registers];
+        reg_set dirty_ = 0;
+        bool flags_dirty_ = false;
+        std::vector<slow_path> slow_paths_;
+        uint8_t * out_of_budget_ = nullptr;
+        int32_t block_instrs_ = 0;
+        word_t block_addr_ = 0;
+    };
+} // namespace
+
+// Operands each instruction reads or writes, for register allocation.
+static void for_each_reg(decoded_instr const & di, auto && fn)
+{
+    switch (di.op) {
+    case opcode::set:
+        fn(di.lhs);
+        break;
+    case opcode::store:
+    case opcode::load:
+    case opcode::add:
+    case opcode::sub:
+    case opcode::compare:
+        fn(di.lhs);
+        fn(di.rhs);
+        break;
+    case opcode::ijump:
+        fn(di.lhs);
+        break;
+    case opcode::call:
+        fn(r15);
+        break;
+    case opcode::halt:
+    case opcode::jump:
+        break;
+    }
+}
+
+void block_translator::allocate(std::span<decoded_instr const> instrs)
+{
+    // the most used registers get host registers, the rest stay in memory
+    std::array<size_t, k_num_registers> uses{};
+    for (decoded_instr const & di : instrs) {
+        for_each_reg(di, [&](reg rr) { ++uses[std::to_underlying(rr)]; });
+    }
+
+    std::array<uint8_t, k_num_registers> by_use;
+    for (size_t i = 0; i < k_num_registers; ++i) {
+        by_use[i] = static_cast<uint8_t>(i);
+    }
+    std::stable_sort(by_use.begin(), by_use.end(), [&](uint8_t lhs, uint8_t rhs) {
+        return uses[lhs] > uses[rhs];
+    });
+
+    size_t next = 0;
+    for (uint8_t index : by_use) {
+        if (uses[index] == 0 || next == std::size(k_guest_pool)) {
+            break;
+        }
+        host_regs_[index] = k_guest_pool[next++];
+    }
+}
+
+void block_translator::emit_budget_check(size_t num_instrs, word_t addr)
+{
+    block_instrs_ = static_cast<int32_t>(num_instrs);
+    block_addr_ = addr;
+    e.alu_imm(x64_alu::sub, k_budget_reg, block_instrs_, 8);
+    out_of_budget_ = e.jcc(x64_cond::b, nullptr);
+}
+
+void block_translator::emit_entry()
+{
+    reload();
+    e.movzx8(k_flags_reg, guest_flags_mem());
+}
+
+void block_translator::reload()
+{
+    for (size_t i = 0; i < k_num_registers; ++i) {
+        if (host_regs_[i]) {
+            e.mov(*host_regs_[i], guest_reg_mem(static_cast<reg>(i)), 4);
+        }
+    }
+}
+
+void block_translator::flush(reg_set dirty, bool flags_dirty)
+{
+    for (size_t i = 0; i < k_num_registers; ++i) {
+        if (host_regs_[i] && (dirty & (reg_set{1} << i))) {
+            e.mov(guest_reg_mem(static_cast<reg>(i)), *host_regs_[i], 4);
+        }
+    }
+    if (flags_dirty) {
+        e.mov(guest_flags_mem(), k_flags_reg, 1);
+    }
+}
+
+void block_translator::emit_exit(word_t next_addr)
+{
+    flush(dirty_, flags_dirty_);
+    emit_goto(next_addr);
+}
+
+void block_translator::emit_alu(x64_alu op, reg lhs, reg rhs)
+{
+    x64_rm dst = loc(lhs);
+    x64_rm src = loc(rhs);
+    if (src.is_reg) {
+        e.alu(op, dst, src.reg, 4);
+    } else if (dst.is_reg) {
+        e.alu(op, dst.reg, src, 4);
+    } else {
+        e.mov(x64_reg::rax, src, 4);
+        e.alu(op, dst, x64_reg::rax, 4);
+    }
+}
+
+void block_translator::emit_compare(reg lhs, reg rhs)
+{
+    emit_alu(x64_alu::cmp, lhs, rhs);
+
+    // same encoding as system_state::execute_compare. mov doesn't touch the host flags.
+    e.mov_imm(k_flags_reg, flag_bit(cpu_cmp_flags::lt));
+    e.mov_imm(x64_reg::rax, flag_bit(cpu_cmp_flags::eq));
+    e.cmov(x64_cond::e, k_flags_reg, x64_reg::rax);
+    e.mov_imm(x64_reg::rax, flag_bit(cpu_cmp_flags::gt));
+    e.cmov(x64_cond::a, k_flags_reg, x64_reg::rax);
+    flags_dirty_ = true;
+}
+
+void block_translator::emit_load_store(decoded_instr const & di)
+{
+    bool is_load = di.op == opcode::load;
+    reg addr_reg = is_load ? di.rhs : di.lhs;
+    reg value_reg = is_load ? di.lhs : di.rhs;
+    int width = static_cast<int>(di.imm);
+
+    slow_path slow{di, {}, nullptr, dirty_, flags_dirty_};
+    e.mov(x64_reg::rax, loc(addr_reg), 4);
+    x64_mem mem{k_mem_reg, x64_reg::rax, 0};
+    if (flat_ != nullptr) {
+        // Everything from ROM up is just an offset from the base, and the host faults on anything
+        // that isn't there. Below that it's devices, and misaligned accesses get caught by the
+        // slow path too.
+        e.alu_imm(x64_alu::cmp, x64_reg::rax, static_cast<int32_t>(flat_->direct_from()), 4);
+        slow.branches[0] = e.jcc(x64_cond::b, nullptr);
+        if (width > 1) {
+            e.test_imm(x64_reg::rax, width - 1);
+            slow.branches[1] = e.jcc(x64_cond::ne, nullptr);
+        }
+    } else {
+        // eax = offset into RAM, anything outside RAM or misaligned takes the slow path
+        e.alu_imm(x64_alu::sub, x64_reg::rax, static_cast<int32_t>(layout_.ram_base()), 4);
+        e.alu_imm(x64_alu::cmp, x64_reg::rax, static_cast<int32_t>(layout_.ram_size - width), 4);
+        slow.branches[0] = e.jcc(x64_cond::a, nullptr);
+        if (width > 1) {
+            e.test_imm(x64_reg::rax, width - 1);
+            slow.branches[1] = e.jcc(x64_cond::ne, nullptr);
+        }
+
+        // rdx = the page's read or write pointer out of its paged_memory::host_page. A store to a
+        // page we don't have to ourselves takes the slow path, which copies it, and so does
+        // anything on a page nobody has looked at yet.
+        using host_page = paged_memory::host_page;
+        static_assert(std::has_single_bit(sizeof(host_page)));
+        int constexpr k_entry_bits = std::countr_zero(sizeof(host_page));
+        e.mov(x64_reg::rdx, x64_reg::rax, 4);
+        e.shift_imm(x64_shift::shr, x64_reg::rdx, paged_memory::k_page_bits - k_entry_bits, 4);
+        e.alu_imm(x64_alu::and_, x64_reg::rdx, -static_cast<int32_t>(sizeof(host_page)), 4);
+        int32_t entry_offset = is_load ? offsetof(host_page, read) : offsetof(host_page, write);
+        e.mov(x64_reg::rdx, x64_mem{k_mem_reg, x64_reg::rdx, entry_offset}, 8);
+        e.alu_imm(x64_alu::cmp, x64_reg::rdx, 0, 8);
+        slow.branches[2] = e.jcc(x64_cond::e, nullptr);
+        e.alu_imm(x64_alu::and_, x64_reg::rax, k_page_size - 1, 4);
+        mem = x64_mem{x64_reg::rdx, x64_reg::rax, 0};
+    }
+
+    // like the memcpy in execute_load_store_impl, a narrow load only replaces the low bytes of
+    // the destination
+    x64_rm value = loc(value_reg);
+    if (is_load) {
+        if (value.is_reg) {
+            e.mov(value.reg, mem, width);
+        } else {
+            e.mov(x64_reg::rcx, mem, width);
+            e.mov(value, x64_reg::rcx, width);
+        }
+        write(value_reg);
+    } else {
+        if (value.is_reg) {
+            e.mov(mem, value.reg, width);
+        } else {
+            e.mov(x64_reg::rcx, value, 4);
+            e.mov(mem, x64_reg::rcx, width);
+        }
+    }
+
+    slow.resume = e.cur();
+    slow_paths_.push_back(slow);
+}
+
+void block_translator::emit_slow_paths()
+{
+    if (out_of_budget_ != nullptr) {
+        // nothing has happened yet, so there's nothing to write back except the budget
+        x64_emitter::patch_rel32(out_of_budget_, e.cur());
+        e.alu_imm(x64_alu::add, k_budget_reg, block_instrs_, 8);
+        e.mov_imm64(x64_reg::rax, (k_out_of_budget << 32) | block_addr_);
+        e.jmp(exit_);
+    }
+
+    for (slow_path const & slow : slow_paths_) {
+        for (uint8_t * branch : slow.branches) {
+            if (branch != nullptr) {
+                x64_emitter::patch_rel32(branch, e.cur());
+            }
+        }
+
+        bool is_load = slow.di.op == opcode::load;
+        flush(slow.dirty, slow.flags_dirty);
+        e.mov(x64_reg::rdi, x64_mem{x64_reg::rsp}, 8);
+        e.mov_imm(x64_reg::rsi, std::to_underlying(is_load ? slow.di.rhs : slow.di.lhs));
+        e.mov_imm(x64_reg::rdx, std::to_underlying(is_load ? slow.di.lhs : slow.di.rhs));
+        e.mov_imm(x64_reg::rcx, slow.di.imm);
+        e.mov_imm64(x64_reg::rax,
+                    reinterpret_cast<uintptr_t>(is_load ? &jit_load : &jit_store));
+        e.call(x64_reg::rax);
+        reload();
+        e.jmp(slow.resume);
+    }
+}
+
+std::optional<x64_cond> block_translator::emit_flag_test(cmp_flag flag)
+{
+    uint32_t mask = 0;
+    x64_cond taken = x64_cond::ne;
+    switch (flag) {
+    case cmp_flag::eq:
+        mask = flag_bit(cpu_cmp_flags::eq);
+        break;
+    case cmp_flag::ne:
+        mask = flag_bit(cpu_cmp_flags::eq);
+        taken = x64_cond::e;
+        break;
+    case cmp_flag::gt:
+        mask = flag_bit(cpu_cmp_flags::gt);
+        break;
+    case cmp_flag::ge:
+        mask = flag_bit(cpu_cmp_flags::gt) | flag_bit(cpu_cmp_flags::eq);
+        break;
+    case cmp_flag::lt:
+        mask = flag_bit(cpu_cmp_flags::lt);
+        break;
+    case cmp_flag::le:
+        mask = flag_bit(cpu_cmp_flags::lt) | flag_bit(cpu_cmp_flags::eq);
+        break;
+    case cmp_flag::unc:
+        return std::nullopt;
+    }
+    e.test_imm(k_flags_reg, mask);
+    return taken;
+}
+
+void block_translator::emit_goto(word_t next_addr)
+{
+    uint64_t exit_id = exits_.size();
+    e.mov_imm64(x64_reg::rax, (exit_id << 32) | next_addr);
+    exits_.push_back(e.jmp(exit_));
+}
+
+void block_translator::emit_goto(reg target)
+{
+    // eax = target, which is also what the dispatcher wants if the lookup misses. A 32-bit mov
+    // clears the upper half, i.e. exit id 0, not chainable.
+    e.mov(x64_reg::rax, loc(target), 4);
+
+    // rcx = target's index in blocks_ * sizeof(uint8_t *), anything outside ROM or misaligned
+    // goes to the dispatcher to fail there
+    e.mov(x64_reg::rcx, x64_reg::rax, 4);
+    e.alu_imm(x64_alu::sub, x64_reg::rcx, iomap::k_rom_base, 4);
+    e.alu_imm(x64_alu::cmp, x64_reg::rcx, static_cast<int32_t>(layout_.rom_size), 4);
+    e.jcc(x64_cond::ae, exit_);
+    e.test_imm(x64_reg::rcx, k_word_size - 1);
+    e.jcc(x64_cond::ne, exit_);
+    static_assert(sizeof(uint8_t *) == 2 * k_word_size);
+    e.alu(x64_alu::add, x64_rm{x64_reg::rcx}, x64_reg::rcx, 8);
+
+    e.mov_imm64(x64_reg::rdx, reinterpret_cast<uintptr_t>(blocks_));
+    e.mov(x64_reg::rcx, x64_mem{x64_reg::rdx, x64_reg::rcx}, 8);
+    e.alu_imm(x64_alu::cmp, x64_reg::rcx, 0, 8);
+    e.jcc(x64_cond::e, exit_);
+    e.jmp(x64_reg::rcx);
+}
+
+void block_translator::emit(decoded_instr const & di, word_t addr)
+{
+    word_t next_addr = addr + k_word_size;
+    switch (di.op) {
+    case opcode::set:
+        e.mov_imm(loc(di.lhs), di.imm);
+        write(di.lhs);
+        break;
+    case opcode::store:
+    case opcode::load:
+        emit_load_store(di);
+        break;
+    case opcode::add:
+        emit_alu(x64_alu::add, di.lhs, di.rhs);
+        write(di.lhs);
+        break;
+    case opcode::sub:
+        emit_alu(x64_alu::sub, di.lhs, di.rhs);
+        write(di.lhs);
+        break;
+    case opcode::compare:
+        emit_compare(di.lhs, di.rhs);
+        break;
+    case opcode::jump:
+    case opcode::ijump: {
+        // the stores in flush don't disturb the host flags set by the test
+        flush(dirty_, flags_dirty_);
+        std::optional<x64_cond> taken_cond = emit_flag_test(di.flag);
+        uint8_t * taken = nullptr;
+        if (taken_cond) {
+            taken = e.jcc(*taken_cond, nullptr);
+            emit_goto(next_addr);
+            x64_emitter::patch_rel32(taken, e.cur());
+        }
+        if (di.op == opcode::jump) {
+            emit_goto(addr + di.offset());
+        } else {
+            emit_goto(di.lhs);
+        }
+        break;
+    }
+    case opcode::call:
+        e.mov_imm(loc(r15), next_addr);
+        write(r15);
+        emit_exit(addr + di.offset());
+        break;
+    case opcode::halt:
+        assert(false && "halt ends a block, it's never translated");
+        break;
+    }
+}
+
+bool jit::supported()
+{
+#if defined(__x86_64__) && defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+jit::jit(size_t rom_words)
+    : blocks_(rom_words, nullptr)
+    , exits_(1, nullptr)
+{
+    void * mem
+        = mmap(nullptr, k_code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        logger.abort("failed to map {} bytes for generated code", k_code_size);
+    }
+    code_ = static_cast<uint8_t *>(mem);
+    emit_trampolines();
+    make_writable(false);
+}
+
+jit::~jit()
+{
+    munmap(code_, k_code_size);
+}
+
+void jit::make_writable(bool writable)
+{
+    // never writable and executable at the same time
+    int prot = PROT_READ | (writable ? PROT_WRITE : PROT_EXEC);
+    if (mprotect(code_, k_code_size, prot) != 0) {
+        logger.abort("mprotect of generated code failed");
+    }
+}
+
+void jit::emit_trampolines()
+{
+    x64_emitter e{code_, k_code_size};
+
+    // uint64_t enter(system_state * state, cpu * cpu, void const * memory, uint8_t const * code,
+    //                uint64_t budget)
+    //
+    // Saves the callee-saved registers, which blocks use freely, and parks state at [rsp] where
+    // the slow paths can find it. Seven pushes on top of the return address leave the stack
+    // 16-byte aligned for those calls.
+    enter_ = reinterpret_cast<enter_fn>(e.cur());
+    for (x64_reg reg : {x64_reg::rbx, x64_reg::rbp, x64_reg::r12, x64_reg::r13, x64_reg::r14,
+                        x64_reg::r15, x64_reg::rdi}) {
+        e.push(reg);
+    }
+    e.mov(k_cpu_reg, x64_reg::rsi, 8);
+    e.mov(k_mem_reg, x64_reg::rdx, 8);
+    e.mov(k_budget_reg, x64_reg::r8, 8);
+    e.jmp(x64_reg::rcx);
+
+    // blocks jump here with the next guest address in eax and the exit id above it
+    exit_ = e.cur();
+    e.mov_imm64(x64_reg::rcx, reinterpret_cast<uintptr_t>(&budget_));
+    e.mov(x64_mem{x64_reg::rcx}, k_budget_reg, 8);
+    for (x64_reg reg : {x64_reg::rcx, x64_reg::r15, x64_reg::r14, x64_reg::r13, x64_reg::r12,
+                        x64_reg::rbp, x64_reg::rbx}) {
+        e.pop(reg);
+    }
+    e.ret();
+
+    assert(!e.overflowed());
+    trampolines_size_ = e.size();
+    code_used_ = trampolines_size_;
+}
+
+void jit::flush()
+{
+    std::fill(blocks_.begin(), blocks_.end(), nullptr);
+    exits_.assign(1, nullptr);
+    code_used_ = trampolines_size_;
+    ++num_flushes_;
+}
+
+void jit::chain(size_t exit_id, uint8_t const * code)
+{
+    make_writable(true);
+    x64_emitter::patch_rel32(exits_[exit_id], code);
+    make_writable(false);
+    ++num_chained_exits_;
+}
+
+uint8_t * jit::translate(system_state const * state, word_t addr)
+{
+    word_t start_index = (addr - iomap::k_rom_base) / k_word_size;
+    decoded_instr const * rom = state->decoded_rom.get();
+
+    // find the end of the block: either the first control transfer (included) or something we
+    // won't translate (excluded), which includes ROM that isn't decoded so that our blocks never
+    // run past the ones system_state budgets for
+    size_t end_index = start_index;
+    bool ends_in_branch = false;
+    while (end_index < state->decoded_words && end_index - start_index < k_max_block_instrs) {
+        opcode op = rom[end_index].op;
+        if (op == opcode::jump || op == opcode::ijump || op == opcode::call) {
+            ++end_index;
+            ends_in_branch = true;
+            break;
+        }
+        if (op == opcode::halt || std::to_underlying(op) >= k_num_opcodes) {
+            break;
+        }
+        ++end_index;
+    }
+    if (end_index == start_index) {
+        return nullptr;
+    }
+    std::span<decoded_instr const> instrs{rom + start_index, rom + end_index};
+
+    for (bool retried = false;; retried = true) {
+        make_writable(true);
+        uint8_t * code = code_ + code_used_;
+        x64_emitter e{code, k_code_size - code_used_};
+        block_translator translator{
+            &e, exit_, blocks_.data(), &exits_, state->layout, state->flat.get()};
+        translator.allocate(instrs);
+        translator.emit_budget_check(instrs.size(), addr);
+        translator.emit_entry();
+        word_t instr_addr = addr;
+        for (decoded_instr const & di : instrs) {
+            translator.emit(di, instr_addr);
+            instr_addr += k_word_size;
+        }
+        if (!ends_in_branch) {
+            translator.emit_exit(instr_addr);
+        }
+        translator.emit_slow_paths();
+
+        if (!e.overflowed()) {
+            code_used_ += e.size();
+            make_writable(false);
+            blocks_[start_index] = code;
+            ++num_translated_blocks_;
+            logger.debug("translated {} instructions at {:#x} into {} bytes",
+                         instrs.size(),
+                         addr,
+                         e.size());
+            return code;
+        }
+
+        // out of space, start over with an empty cache
+        assert(!retried && "a single block doesn't fit in the code buffer");
+        flush();
+    }
+}
+
+void jit::run(system_state * state)
+{
+    cpu & cpu = state->cpu;
+    word_t addr = cpu.instr_ptr;
+    budget_ = state->budget;
+    void const * memory = state->flat
+        ? static_cast<void const *>(state->flat->base())
+        : static_cast<void const *>(state->ram.host_pages());
+
+    // the chainable exit we came back through, 0 if none
+    size_t exit_id = 0;
+    while (true) {
+        word_t rom_offset = addr - iomap::k_rom_base;
+        assert(rom_offset < state->rom.size() && rom_offset % k_word_size == 0);
+        size_t index = rom_offset / k_word_size;
+
+        // system_state::run_blocks runs ROM that isn't decoded, and counts it against the budget
+        if (state->decoded_rom[index].op == opcode::halt || exit_id == k_out_of_budget
+            || index >= state->decoded_words) {
+            cpu.instr_ptr = addr;
+            break;
+        }
+
+        ++num_dispatches_;
+        uint8_t * code = blocks_[index];
+        if (code == nullptr) {
+            size_t flushes = num_flushes_;
+            code = translate(state, addr);
+            if (num_flushes_ != flushes) {
+                // the exit we came from doesn't exist any more
+                exit_id = 0;
+            }
+        }
+        if (code == nullptr) {
+            // nothing we can translate here, let the interpreter deal with it
+            cpu.instr_ptr = addr;
+            state->step_interp();
+            addr = cpu.instr_ptr;
+            exit_id = 0;
+            continue;
+        }
+
+        if (exit_id != 0) {
+            chain(exit_id, code);
+        }
+
+        uint64_t exit = enter_(state, &cpu, memory, code, budget_);
+        addr = static_cast<word_t>(exit);
+        exit_id = exit >> 32;
+    }
+    state->budget = budget_;
+}
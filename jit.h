@@ -0,0 +1,92 @@
+#pragma once
+
+#include "cpu_base.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct cpu;
+struct system_state;
+
+// Translates basic blocks of guest code into x86-64 and runs them, see jit.cpp. One of these
+// lives in each system_state that has run with engine::jit, and only ever runs that state's ROM.
+struct jit
+{
+    // Whether this host can run generated code at all. When it can't, system_state falls back to
+    // the threaded engine.
+    static bool supported();
+
+    // for a ROM of rom_words words
+    explicit jit(size_t rom_words);
+    ~jit();
+
+    jit(jit const &) = delete;
+    jit & operator=(jit const &) = delete;
+
+    // Run from state->cpu.instr_ptr until the guest halts or reaches a block that
+    // state->budget doesn't cover.
+    void run(system_state * state);
+
+    // Throw away every translation, e.g. because ROM changed.
+    void flush();
+
+    size_t num_translated_blocks() const
+    {
+        return num_translated_blocks_;
+    }
+
+    // how many times generated code came back to the dispatcher in run()
+    size_t num_dispatches() const
+    {
+        return num_dispatches_;
+    }
+
+    size_t num_chained_exits() const
+    {
+        return num_chained_exits_;
+    }
+
+    // how many times every translation was thrown away, because ROM changed or the code buffer
+    // filled up
+    size_t num_flushes() const
+    {
+        return num_flushes_;
+    }
+
+private:
+    // returns the guest address to continue at in the low 32 bits and the id of the exit taken
+    // (0 if it can't be chained) in the high 32 bits
+    // memory is what generated code finds guest RAM through, see jit.cpp
+    using enter_fn = uint64_t (*)(system_state * state, cpu * cpu, void const * memory,
+                                  uint8_t const * code, uint64_t budget);
+
+    void emit_trampolines();
+    uint8_t * translate(system_state const * state, word_t addr);
+    void chain(size_t exit_id, uint8_t const * code);
+    void make_writable(bool writable);
+
+    uint8_t * code_;
+    size_t code_used_ = 0;
+
+    // entry and exit glue shared by every block, at the very start of code_
+    enter_fn enter_ = nullptr;
+    uint8_t * exit_ = nullptr;
+    size_t trampolines_size_ = 0;
+
+    // translated code for the block starting at each ROM word, if any. Generated code reads this
+    // directly, so it never changes size.
+    std::vector<uint8_t *> blocks_;
+
+    // the rel32 of the jmp behind each chainable exit, by exit id. Id 0 is never used.
+    std::vector<uint8_t *> exits_;
+
+    // state->budget while we're running. Generated code keeps it in a register and writes it back
+    // here on the way out.
+    uint64_t budget_ = 0;
+
+    size_t num_translated_blocks_ = 0;
+    size_t num_dispatches_ = 0;
+    size_t num_chained_exits_ = 0;
+    size_t num_flushes_ = 0;
+};
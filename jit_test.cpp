@@ -0,0 +1,230 @@
+#include "assembler.h"
+#include "cpu_base.h"
+#include "iomap.h"
+#include "jit.h"
+#include "reg.h"
+#include "system_state.h"
+#include "test.h"
+#include "test_programs.h"
+#include "x64_emitter.h"
+
+#include <cassert>
+#include <cstring>
+#include <format>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+static void check_encoding(void (*emit)(x64_emitter & e), std::initializer_list<uint8_t> expected)
+{
+    uint8_t buf[32];
+    x64_emitter e{buf, sizeof(buf)};
+    emit(e);
+    assert(!e.overflowed());
+    assert(e.size() == expected.size());
+    assert(memcmp(buf, expected.begin(), expected.size()) == 0);
+}
+
+TEST("jit.x64_emitter")
+{
+    check_encoding([](x64_emitter & e) { e.mov(x64_reg::rax, x64_mem{x64_reg::rbx, {}, 8}, 4); },
+                   {0x8b, 0x43, 0x08});
+    check_encoding(
+        [](x64_emitter & e) { e.mov(x64_mem{x64_reg::r12, x64_reg::rax}, x64_reg::rcx, 1); },
+        {0x41, 0x88, 0x0c, 0x04});
+    check_encoding(
+        [](x64_emitter & e) { e.mov(x64_reg::rsi, x64_mem{x64_reg::r12, x64_reg::rax}, 1); },
+        {0x41, 0x8a, 0x34, 0x04});
+    check_encoding(
+        [](x64_emitter & e) { e.mov(x64_reg::rsi, x64_mem{x64_reg::r12, x64_reg::rax}, 2); },
+        {0x66, 0x41, 0x8b, 0x34, 0x04});
+    check_encoding([](x64_emitter & e) { e.mov(x64_mem{x64_reg::rbp}, x64_reg::rax, 4); },
+                   {0x89, 0x45, 0x00});
+    check_encoding([](x64_emitter & e) { e.mov(x64_mem{x64_reg::rbx}, x64_reg::r13, 1); },
+                   {0x44, 0x88, 0x2b});
+    check_encoding([](x64_emitter & e) { e.mov(x64_reg::rbx, x64_reg::rsi, 8); },
+                   {0x48, 0x89, 0xf3});
+    check_encoding([](x64_emitter & e) { e.movzx8(x64_reg::r13, x64_mem{x64_reg::rbx}); },
+                   {0x44, 0x0f, 0xb6, 0x2b});
+    check_encoding([](x64_emitter & e) { e.mov_imm(x64_reg::rax, 0x12345678); },
+                   {0xb8, 0x78, 0x56, 0x34, 0x12});
+    check_encoding(
+        [](x64_emitter & e) { e.alu(x64_alu::add, x64_rm{x64_reg::r9}, x64_reg::rsi, 4); },
+        {0x41, 0x01, 0xf1});
+    check_encoding(
+        [](x64_emitter & e) { e.alu_imm(x64_alu::cmp, x64_mem{x64_reg::rbx, {}, 0x40}, 4, 4); },
+        {0x83, 0x7b, 0x40, 0x04});
+    check_encoding([](x64_emitter & e) { e.shift_imm(x64_shift::shr, x64_reg::rdx, 10, 4); },
+                   {0xc1, 0xea, 0x0a});
+    check_encoding([](x64_emitter & e) { e.cmov(x64_cond::a, x64_reg::r13, x64_reg::rax); },
+                   {0x44, 0x0f, 0x47, 0xe8});
+    check_encoding([](x64_emitter & e) { e.push(x64_reg::r12); }, {0x41, 0x54});
+    check_encoding([](x64_emitter & e) { e.jmp(e.cur()); }, {0xe9, 0xfb, 0xff, 0xff, 0xff});
+}
+
+// Run rom with the JIT and the reference interpreter and check they end up in the same place.
+static void check_against_interp(std::vector<uint8_t> const & rom)
+{
+    system_state reference{};
+    reference.engine = engine::interp;
+    reference.set_rom(rom);
+    reference.run();
+
+    system_state state{};
+    state.engine = engine::jit;
+    state.set_rom(rom);
+    state.run();
+
+    assert(state.cpu.instr_ptr == reference.cpu.instr_ptr);
+    assert(state.cpu.cpu_cmp_flags == reference.cpu.cpu_cmp_flags);
+    for (reg rr : k_all_registers) {
+        assert(state.cpu.get(rr) == reference.cpu.get(rr));
+    }
+    assert(state.ram == reference.ram);
+    assert(state.console == reference.console);
+    assert(!jit::supported() || state.jit_cache->num_translated_blocks() > 0);
+}
+
+// More live guest registers than the JIT has host registers for, so some of them have to be
+// operated on in memory.
+TEST("jit.register_pressure")
+{
+    std::string prog;
+    for (reg rr : k_all_registers) {
+        prog += std::format("set {} {}\n", rr, 1000 + std::to_underlying(rr));
+    }
+    for (reg dst : k_all_registers) {
+        for (reg src : k_all_registers) {
+            prog += std::format("add {} {}\n", dst, src);
+        }
+        prog += std::format("sub {} r3\n", dst);
+        prog += std::format("compare {} r7\n", dst);
+    }
+    prog += "halt\n";
+    check_against_interp(assemble(prog));
+}
+
+TEST("jit.load_store")
+{
+    std::string prog = std::format(R"(
+set r0 {}
+set r1 {}
+set r2 4
+set r3 1
+set r4 100
+store r0 r1       # full word
+load.1 r4 r0      # narrow loads only replace the low bytes
+load.2 r5 r0
+add r0 r2
+add r0 r3
+store.1 r0 r3
+sub r0 r3
+load r6 r0
+set r7 {}
+load r8 r7        # ROM, slow path
+set r9 {}
+set r10 104
+store.1 r9 r10    # console, slow path
+set r10 105
+store.1 r9 r10
+halt
+)",
+                                   iomap::k_ram_base + 8,
+                                   0xabcde,
+                                   iomap::k_rom_base + 8,
+                                   iomap::k_console_write);
+    check_against_interp(assemble(prog));
+}
+
+TEST("jit.branches")
+{
+    // every flag, both ways, with the flags computed in an earlier block than the jump
+    for (cmp_flag flag : instr::k_all_cmp_flags) {
+        for (word_t rhs : {0, 1, 2}) {
+            std::string prog = std::format(R"(
+set r0 1
+set r1 {}
+compare r0 r1
+call target
+jump.{} taken
+set r2 1
+halt
+taken:
+set r3 1
+halt
+target:
+ijump.{} r15
+halt
+)",
+                                           rhs,
+                                           flag,
+                                           flag);
+            check_against_interp(assemble(prog));
+        }
+    }
+}
+
+// Enough code to fill the code buffer several times over, which has to be thrown away and
+// translated again part way through. Every word of the body starts a block that runs to the end
+// of it (or as far as a block goes), so there are lots of big blocks.
+TEST("jit.out_of_space")
+{
+    size_t const body_words = 3800;
+    word_t const body_addr = iomap::k_rom_base + 8 * k_word_size;
+    std::string prog = std::format(R"(
+set r1 {}
+set r2 1
+set r3 4
+set r6 {}
+set r8 {}
+loop:
+compare r6 r8
+jump.ge done
+ijump.unc r6
+)",
+                                   iomap::k_ram_base + 8,
+                                   body_addr,
+                                   body_addr + body_words * k_word_size);
+    for (size_t i = 0; i < body_words / 2; ++i) {
+        prog += "store r1 r0\nadd r0 r2\n";
+    }
+    prog += "add r6 r3\njump.unc loop\ndone:\nhalt\n";
+    std::vector<uint8_t> rom = assemble(prog);
+    check_against_interp(rom);
+
+    if (!jit::supported()) {
+        return;
+    }
+    system_state state{};
+    state.engine = engine::jit;
+    state.set_rom(rom);
+    state.run();
+    assert(state.jit_cache->num_flushes() > 0);
+    assert(state.cpu.get(r0) == body_words / 2 * (body_words / 2 + 1));
+}
+
+// Once every exit has been chained, loops and calls shouldn't come back to the dispatcher.
+TEST("jit.chaining")
+{
+    if (!jit::supported()) {
+        return;
+    }
+
+    word_t const iterations = 10000;
+    system_state state{};
+    state.engine = engine::jit;
+    state.set_rom(make_branchy_rom(iterations));
+    state.run();
+    assert(state.cpu.get(r0) == iterations);
+    assert(state.jit_cache->num_chained_exits() > 0);
+    assert(state.jit_cache->num_dispatches() < 2 * state.jit_cache->num_translated_blocks() + 2);
+
+    // fib returns through ijump, which looks up its target inline
+    word_t const n = 15;
+    state.set_rom(make_fib_rom());
+    state.cpu = cpu{};
+    state.cpu.get(r0) = n;
+    state.run();
+    assert(state.cpu.get(r13) == host_fib(n));
+    assert(state.jit_cache->num_dispatches() < 1000);
+}
@@ -0,0 +1,123 @@
+#include "linker.h"
+
+#include "instr.h"
+#include "iomap.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <format>
+#include <set>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+static logger logger{__FILE__};
+
+std::string linked_program::symbol_map() const
+{
+    std::vector<std::pair<word_t, std::string const *>> by_address;
+    for (auto const & [name, addr] : symbols) {
+        by_address.emplace_back(addr, &name);
+    }
+    std::ranges::sort(by_address, [](auto const & lhs, auto const & rhs) {
+        return std::tie(lhs.first, *lhs.second) < std::tie(rhs.first, *rhs.second);
+    });
+
+    std::string map;
+    for (auto const & [addr, name] : by_address) {
+        map += std::format("{:#010x} {}\n", addr, *name);
+    }
+    return map;
+}
+
+// Point the jump or call at site in rom, which is at guest address site_addr, at target_addr.
+static bool relocate(std::vector<uint8_t> * rom, size_t site, word_t site_addr, word_t target_addr)
+{
+    word_t raw;
+    memcpy(&raw, rom->data() + site, sizeof(raw));
+    instr ii{raw};
+    if (!ii.retarget(static_cast<signed_word_t>(target_addr - site_addr))) {
+        return false;
+    }
+    memcpy(rom->data() + site, &ii.storage, sizeof(ii.storage));
+    return true;
+}
+
+std::optional<linked_program> link(std::span<object_module const> modules, word_t rom_size)
+{
+    // where each module's sections start in rom, in k_all_section_kinds order
+    size_t const num_kinds = k_all_section_kinds.size();
+    std::vector<size_t> bases(modules.size() * num_kinds);
+    size_t rom_bytes = 0;
+    for (section_kind kind : k_all_section_kinds) {
+        for (size_t i = 0; i < modules.size(); ++i) {
+            bases[i * num_kinds + std::to_underlying(kind)] = rom_bytes;
+            rom_bytes += modules[i].section(kind).size();
+        }
+    }
+    // set_rom wants room for at least the invalid instruction past the end
+    if (rom_bytes >= rom_size) {
+        logger.err("linked program is {} bytes, which doesn't fit in {} bytes of ROM",
+                   rom_bytes,
+                   rom_size);
+        return std::nullopt;
+    }
+    auto address_of = [&](size_t module, section_kind kind, word_t offset) {
+        size_t base = bases[module * num_kinds + std::to_underlying(kind)];
+        return static_cast<word_t>(iomap::k_rom_base + base + offset);
+    };
+
+    linked_program program;
+    program.rom.reserve(rom_bytes);
+    for (section_kind kind : k_all_section_kinds) {
+        for (object_module const & module : modules) {
+            std::vector<uint8_t> const & bytes = module.section(kind);
+            program.rom.insert(program.rom.end(), bytes.begin(), bytes.end());
+        }
+    }
+
+    // The labels some module uses but doesn't define, which are the only ones modules share. Any
+    // other label was already resolved inside its own module, so two modules can both have a loop:
+    // without getting in each other's way.
+    std::set<std::string_view> imported;
+    for (object_module const & module : modules) {
+        for (object_module::symbol const & sym : module.symbols) {
+            if (!sym.section) {
+                imported.insert(sym.name);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < modules.size(); ++i) {
+        for (object_module::symbol const & sym : modules[i].symbols) {
+            if (!sym.section || !imported.contains(sym.name)) {
+                continue;
+            }
+            bool inserted =
+                program.symbols.emplace(sym.name, address_of(i, *sym.section, sym.offset)).second;
+            if (!inserted) {
+                logger.err("{} is defined by more than one module", sym.name);
+                return std::nullopt;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < modules.size(); ++i) {
+        for (object_module::relocation const & reloc : modules[i].relocations) {
+            std::string const & name = modules[i].symbols[reloc.symbol].name;
+            auto it = program.symbols.find(name);
+            if (it == program.symbols.end()) {
+                logger.err("{} isn't defined by any module", name);
+                return std::nullopt;
+            }
+            word_t site_addr = address_of(i, reloc.section, reloc.offset);
+            if (!relocate(&program.rom, site_addr - iomap::k_rom_base, site_addr, it->second)) {
+                logger.err("can't point the instruction at {:#x} at {}", site_addr, name);
+                return std::nullopt;
+            }
+        }
+    }
+    return program;
+}
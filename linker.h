@@ -0,0 +1,36 @@
+#pragma once
+
+#include "cpu_base.h"
+#include "iomap.h"
+#include "object.h"
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// A ROM made by link(), and where everything in it went.
+struct linked_program
+{
+    std::vector<uint8_t> rom;
+
+    // the guest address of every label one module defines and another uses
+    std::map<std::string, word_t> symbols;
+
+    // symbols as text, one "<address in hex> <name>" line each, in address order
+    std::string symbol_map() const;
+};
+
+// Put modules together into one ROM: every module's code, in the order they're given, and then
+// all of their data. So the first module's code is at iomap::k_rom_base, which is where the guest
+// starts running. Every jump and call to a label in another module is pointed at wherever that
+// label ended up. Labels no other module uses stay private to the module they're in, so any
+// number of modules can define the same one.
+//
+// Nothing (and an error logged) if a label one module uses is defined by more than one of the
+// others or by none, a jump or call can't reach its target, or the result doesn't fit in rom_size
+// bytes.
+std::optional<linked_program> link(std::span<object_module const> modules,
+                                   word_t rom_size = iomap::k_rom_size);
@@ -0,0 +1,151 @@
+#include "linker.h"
+
+#include "assembler.h"
+#include "instr.h"
+#include "iomap.h"
+#include "object.h"
+#include "reg.h"
+#include "system_state.h"
+#include "test.h"
+
+#include <cassert>
+#include <format>
+#include <optional>
+#include <vector>
+
+// the start of a program, using routines from k_library
+static char const * const k_main = R"(
+    set r0 5
+    call add_three
+    call twice_add_three
+    jump.unc finish
+add_one:
+    set r1 1
+    add r0 r1
+    ijump r15
+)";
+
+// A library with routines for any program that wants them, one of which needs a routine of the
+// program's in return.
+static char const * const k_library = R"(
+add_three:
+    set r1 3
+    add r0 r1
+    ijump r15
+twice_add_three:
+    set r12 0
+    add r12 r15
+    call add_three
+    call add_one
+    ijump r12
+finish:
+    halt
+.section data
+answer:
+    .word 42
+)";
+
+TEST("linker.link")
+{
+    std::vector<object_module> const modules{assemble_object(k_main), assemble_object(k_library)};
+    std::optional<linked_program> program = link(modules);
+    assert(program.has_value());
+    assert(program->rom.size()
+           == modules[0].code.size() + modules[1].code.size() + modules[1].data.size());
+
+    for (engine eng : k_all_engines) {
+        system_state state{};
+        state.engine = eng;
+        state.set_rom(program->rom);
+        assert(state.run() == run_status::halted);
+        assert(state.cpu.get(r0) == 5 + 3 + 3 + 1);
+    }
+
+    // code first, then data
+    word_t const lib_base = iomap::k_rom_base + modules[0].code.size();
+    assert(program->symbols.at("add_one") == iomap::k_rom_base + 4 * k_word_size);
+    assert(program->symbols.at("add_three") == lib_base);
+    assert(program->symbols.at("finish") == lib_base + 8 * k_word_size);
+
+    // only labels another module uses are shared
+    assert(!program->symbols.contains("answer"));
+    assert(program->symbols.size() == 4);
+    assert(program->symbol_map().starts_with(
+        std::format("{:#010x} add_one\n{:#010x} add_three\n", iomap::k_rom_base + 16, lib_base)));
+
+    // modules that went through an object file link just the same
+    std::vector<object_module> loaded;
+    for (object_module const & module : modules) {
+        loaded.push_back(*object_module::deserialize(module.serialize()));
+    }
+    assert(link(loaded)->rom == program->rom);
+}
+
+TEST("linker.local_labels")
+{
+    // both modules have their own loop and done, which nobody else can see
+    std::vector<object_module> const modules{assemble_object(R"(
+    set r0 0
+    set r1 3
+    set r2 1
+loop:
+    sub r1 r2
+    add r0 r2
+    compare r1 r2
+    jump.lt done
+    jump.unc loop
+done:
+    call count_down
+    halt
+)"),
+                                             assemble_object(R"(
+count_down:
+    set r3 4
+    set r2 1
+loop:
+    sub r3 r2
+    add r0 r2
+    compare r3 r2
+    jump.lt done
+    jump.unc loop
+done:
+    ijump r15
+)")};
+    std::optional<linked_program> program = link(modules);
+    assert(program.has_value());
+    assert(program->symbols.size() == 1);
+
+    for (engine eng : k_all_engines) {
+        system_state state{};
+        state.engine = eng;
+        state.set_rom(program->rom);
+        assert(state.run() == run_status::halted);
+        assert(state.cpu.get(r0) == 3 + 4);
+    }
+
+    // but a label someone else uses still has to be defined only once
+    assert(!link(std::vector{modules[0], modules[1], assemble_object("call loop\nhalt")}));
+}
+
+TEST("linker.errors")
+{
+    object_module const main = assemble_object(k_main);
+    object_module const library = assemble_object(k_library);
+
+    // nothing defines add_three
+    assert(!link(std::vector{main}));
+
+    // add_three is defined twice
+    assert(!link(std::vector{main, library, assemble_object("add_three:\nhalt")}));
+
+    // too big
+    assert(!link(std::vector{main, library}, static_cast<word_t>(main.code.size())));
+
+    // too far to reach
+    object_module far = assemble_object("jump.unc faraway\nhalt");
+    object_module padding;
+    padding.code.resize(2 * instr::k_jump_max_offset);
+    object_module faraway = assemble_object("faraway:\nhalt");
+    assert(!link(std::vector{far, padding, faraway}, word_t{16} << 20));
+    assert(link(std::vector{far, faraway}));
+}
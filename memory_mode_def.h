@@ -0,0 +1,4 @@
+#define ENUM_TYPE_NAME memory_mode
+#define ENUM_UNDERLYING_TYPE uint8_t
+X(paged)
+X(flat)
@@ -0,0 +1,68 @@
+#include "mmu.h"
+
+#include <algorithm>
+
+#define ENUM_DEF_FILE_NAME "page_kind_def.h"
+#include "enum_def.h"
+
+void mmu::map_memory(word_t base, paged_memory * memory, uint8_t perms)
+{
+    page_table_entry first;
+    first.kind = page_kind::memory;
+    first.perms = perms;
+    first.memory = memory;
+    map(base, memory->size(), first);
+}
+
+void mmu::map_device(word_t base, word_t size, struct device * device)
+{
+    page_table_entry first;
+    first.kind = page_kind::device;
+    first.device = device;
+    first.device_base = base;
+    map(base, size, first);
+}
+
+void mmu::map(word_t base, word_t size, page_table_entry const & first)
+{
+    assert(base % k_page_size == 0 && size % k_page_size == 0 && size > 0);
+    for (mapping const & other : mappings_) {
+        assert((base - other.base >= other.size && other.base - base >= size) && "mapped twice");
+    }
+    mappings_.push_back({base, size, first});
+
+    // nothing in the TLB could have been for these pages, but remapping shouldn't be anywhere
+    // near hot enough to be worth being clever about
+    flush_tlb();
+}
+
+page_table_entry mmu::lookup(word_t addr) const
+{
+    for (mapping const & m : mappings_) {
+        if (addr - m.base < m.size) {
+            page_table_entry pte = m.first;
+            if (pte.kind == page_kind::memory) {
+                pte.memory_page = (addr - m.base) >> paged_memory::k_page_bits;
+            }
+            return pte;
+        }
+    }
+    return {};
+}
+
+void mmu::flush_tlb()
+{
+    std::ranges::fill(tlb_, tlb_entry{});
+}
+
+void mmu::fill_tlb(word_t addr, page_table_entry const & pte)
+{
+    assert(pte.kind == page_kind::memory);
+    // the TLB hands out read pointers without checking them
+    pte.memory->make_readable(pte.memory_page);
+    tlb_entry & te = tlb_[(addr >> paged_memory::k_page_bits) % k_tlb_size];
+    te.page = addr >> paged_memory::k_page_bits;
+    te.perms = pte.perms;
+    te.host = &pte.memory->host_pages()[pte.memory_page];
+    ++num_tlb_fills_;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "cpu_base.h"
+#include "iomap.h"
+#include "paged_memory.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// what a guest page is backed by
+#define ENUM_DEF_FILE_NAME "page_kind_def.h"
+#include "enum_decl.h" // IWYU pragma: export
+
+struct device;
+
+struct page_table_entry
+{
+    page_kind kind = page_kind::fault;
+
+    // mmu::k_perm_* bits. Devices check for themselves.
+    uint8_t perms = 0;
+
+    // page_kind::memory: which memory, and which of its pages
+    paged_memory * memory = nullptr;
+    size_t memory_page = 0;
+
+    // page_kind::device: the device, and the guest address of its first page
+    struct device * device = nullptr;
+    word_t device_base = 0;
+};
+
+// The guest address space: what every k_page_size page of it is, and a small direct-mapped TLB in
+// front of that for memory pages, so that the common case of a load or store to RAM is a tag
+// compare, fetching the page's host pointer and one host access. Unmapped pages fault.
+//
+// Behind the TLB it's just the list of what's been mapped where. There's only ever a handful of
+// those, and keeping a table with an entry for every page would cost as much as the memory is
+// big, see paged_memory.h.
+//
+// The TLB points at paged_memory::host_pages() rather than copying the pointers out of it, so it
+// never goes stale when a page is copied on write.
+struct mmu
+{
+    static uint8_t constexpr k_perm_read = 1;
+    static uint8_t constexpr k_perm_write = 2;
+
+    static size_t constexpr k_tlb_size = 16;
+
+    // base must be page aligned, the whole of memory gets mapped
+    void map_memory(word_t base, paged_memory * memory, uint8_t perms);
+    void map_device(word_t base, word_t size, device * device);
+
+    page_table_entry lookup(word_t addr) const;
+
+    // Where to do an access to addr, if the TLB has its page with the right permission, null
+    // otherwise. Accesses must not straddle pages.
+    uint8_t const * tlb_read(word_t addr) const
+    {
+        tlb_entry const & te = tlb_entry_for(addr);
+        if (te.page != addr >> paged_memory::k_page_bits || !(te.perms & k_perm_read)) {
+            return nullptr;
+        }
+        return te.host->read + (addr & (k_page_size - 1));
+    }
+
+    uint8_t * tlb_write(word_t addr) const
+    {
+        tlb_entry const & te = tlb_entry_for(addr);
+        if (te.page != addr >> paged_memory::k_page_bits || !(te.perms & k_perm_write)) {
+            return nullptr;
+        }
+        // null if the page is still shared, which the slow path deals with
+        uint8_t * write = te.host->write;
+        return write ? write + (addr & (k_page_size - 1)) : nullptr;
+    }
+
+    // put addr's page, which must be memory, in the TLB
+    void fill_tlb(word_t addr, page_table_entry const & pte);
+
+    // needed when the paged_memorys we map are replaced, rather than just written to
+    void flush_tlb();
+
+    size_t num_tlb_fills() const
+    {
+        return num_tlb_fills_;
+    }
+
+private:
+    struct tlb_entry
+    {
+        // guest page number, never matches anything when invalid
+        word_t page = ~word_t{0};
+        uint8_t perms = 0;
+        paged_memory::host_page const * host = nullptr;
+    };
+
+    tlb_entry const & tlb_entry_for(word_t addr) const
+    {
+        return tlb_[(addr >> paged_memory::k_page_bits) % k_tlb_size];
+    }
+
+    // point the pages in [base, base + size) at first and whatever comes after it
+    void map(word_t base, word_t size, page_table_entry const & first);
+
+    struct mapping
+    {
+        word_t base;
+        word_t size;
+        page_table_entry first;
+    };
+
+    std::vector<mapping> mappings_;
+    tlb_entry tlb_[k_tlb_size];
+    size_t num_tlb_fills_ = 0;
+};
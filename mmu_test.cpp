@@ -0,0 +1,73 @@
+#include "mmu.h"
+
+#include "device.h"
+#include "iomap.h"
+#include "paged_memory.h"
+#include "test.h"
+
+#include <cassert>
+#include <cstdint>
+
+struct null_device : device
+{
+    void access(bool, word_t, word_t *, word_t) override { }
+};
+
+TEST("mmu.lookup")
+{
+    paged_memory ram{2 * k_page_size};
+    null_device dev;
+    mmu mmu;
+    mmu.map_device(k_page_size, k_page_size, &dev);
+    mmu.map_memory(3 * k_page_size, &ram, mmu::k_perm_read | mmu::k_perm_write);
+
+    assert(mmu.lookup(0).kind == page_kind::fault);
+    assert(mmu.lookup(k_page_size + 8).kind == page_kind::device);
+    assert(mmu.lookup(k_page_size + 8).device == &dev);
+    assert(mmu.lookup(k_page_size + 8).device_base == k_page_size);
+    assert(mmu.lookup(2 * k_page_size).kind == page_kind::fault);
+    assert(mmu.lookup(4 * k_page_size + 4).kind == page_kind::memory);
+    assert(mmu.lookup(4 * k_page_size + 4).memory == &ram);
+    assert(mmu.lookup(4 * k_page_size + 4).memory_page == 1);
+
+    // past the end of the table
+    assert(mmu.lookup(5 * k_page_size).kind == page_kind::fault);
+    assert(mmu.lookup(~word_t{0}).kind == page_kind::fault);
+}
+
+TEST("mmu.tlb")
+{
+    paged_memory rom{k_page_size};
+    paged_memory ram{k_page_size};
+    mmu mmu;
+    mmu.map_memory(0, &rom, mmu::k_perm_read);
+    mmu.map_memory(k_page_size, &ram, mmu::k_perm_read | mmu::k_perm_write);
+
+    word_t const addr = k_page_size + 12;
+    assert(mmu.tlb_read(addr) == nullptr);
+    mmu.fill_tlb(addr, mmu.lookup(addr));
+    assert(mmu.tlb_read(addr) == ram.read_ptr(12));
+
+    // RAM nobody has written to yet isn't writable in place, until it is
+    assert(mmu.tlb_write(addr) == nullptr);
+    *ram.write_ptr(12) = 7;
+    assert(mmu.tlb_write(addr) == ram.write_ptr(12));
+    assert(*mmu.tlb_read(addr) == 7);
+
+    // and stops being writable in place when it's shared
+    paged_memory child = ram.fork();
+    assert(mmu.tlb_write(addr) == nullptr);
+    assert(*mmu.tlb_read(addr) == 7);
+
+    // ROM never is
+    *rom.write_ptr(0) = 1;
+    mmu.fill_tlb(0, mmu.lookup(0));
+    assert(mmu.tlb_read(0) == rom.read_ptr(0));
+    assert(mmu.tlb_write(0) == nullptr);
+    assert(mmu.num_tlb_fills() == 2);
+
+    // the same TLB slot as ROM, but not the same page
+    word_t const alias = mmu::k_tlb_size * k_page_size;
+    assert(mmu.lookup(alias).kind == page_kind::fault);
+    assert(mmu.tlb_read(alias) == nullptr);
+}
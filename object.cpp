@@ -0,0 +1,260 @@
+#include "object.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#define ENUM_DEF_FILE_NAME "section_kind_def.h"
+#include "enum_def.h"
+
+static logger logger{__FILE__};
+
+std::initializer_list<section_kind> const k_all_section_kinds{
+#define X(x) section_kind::x,
+#include "section_kind_def.h"
+#undef X
+};
+
+// The file is these records one after the other, then the names of the symbols back to back, then
+// the bytes of each section in the same order as their section_records. Everything is in host
+// byte order, and a multiple of 4 bytes long so the records stay aligned.
+namespace {
+    uint32_t constexpr k_magic = 0x6a626f74; // "tobj"
+    uint32_t constexpr k_version = 1;
+
+    // a symbol_record's section when it's not defined here
+    uint32_t constexpr k_undefined = ~uint32_t{0};
+
+    struct file_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t num_sections;
+        uint32_t num_symbols;
+        uint32_t num_relocations;
+        uint32_t names_size;
+    };
+
+    struct section_record
+    {
+        uint32_t kind;
+        uint32_t size;
+    };
+
+    struct symbol_record
+    {
+        uint32_t name_offset;
+        uint32_t name_size;
+        uint32_t section;
+        uint32_t offset;
+    };
+
+    struct relocation_record
+    {
+        uint32_t section;
+        uint32_t offset;
+        uint32_t symbol;
+    };
+
+    size_t padded(size_t size)
+    {
+        return (size + 3) & ~size_t{3};
+    }
+
+    template <typename T>
+    void append(std::vector<uint8_t> * out, T const & value)
+    {
+        static_assert(std::is_trivially_copyable_v<T> && sizeof(T) % 4 == 0);
+        auto const * bytes = reinterpret_cast<uint8_t const *>(&value);
+        out->insert(out->end(), bytes, bytes + sizeof(T));
+    }
+
+    void append_padded(std::vector<uint8_t> * out, void const * bytes, size_t size)
+    {
+        auto const * begin = static_cast<uint8_t const *>(bytes);
+        out->insert(out->end(), begin, begin + size);
+        out->resize(out->size() + padded(size) - size);
+    }
+
+    // reads a file made by serialize() from front to back, checking it's as long as it says
+    struct reader
+    {
+        std::span<uint8_t const> bytes;
+        size_t offset = 0;
+        bool ok = true;
+
+        uint8_t const * take(size_t size)
+        {
+            if (!ok || bytes.size() - offset < size) {
+                ok = false;
+                return nullptr;
+            }
+            uint8_t const * at = bytes.data() + offset;
+            offset += padded(size);
+            offset = std::min(offset, bytes.size());
+            return at;
+        }
+
+        template <typename T>
+        T read()
+        {
+            T value{};
+            if (uint8_t const * at = take(sizeof(T))) {
+                memcpy(&value, at, sizeof(T));
+            }
+            return value;
+        }
+    };
+}
+
+std::vector<uint8_t> & object_module::section(section_kind kind)
+{
+    return const_cast<std::vector<uint8_t> &>(std::as_const(*this).section(kind));
+}
+
+std::vector<uint8_t> const & object_module::section(section_kind kind) const
+{
+    switch (kind) {
+    case section_kind::code:
+        return code;
+    case section_kind::data:
+        return data;
+    }
+    assert(false);
+    return code;
+}
+
+object_module::symbol const * object_module::find_symbol(std::string_view name) const
+{
+    for (symbol const & sym : symbols) {
+        if (sym.name == name) {
+            return &sym;
+        }
+    }
+    return nullptr;
+}
+
+std::vector<uint8_t> object_module::serialize() const
+{
+    std::string names;
+    for (symbol const & sym : symbols) {
+        names += sym.name;
+    }
+
+    std::vector<uint8_t> out;
+    append(&out,
+           file_header{k_magic,
+                       k_version,
+                       static_cast<uint32_t>(k_all_section_kinds.size()),
+                       static_cast<uint32_t>(symbols.size()),
+                       static_cast<uint32_t>(relocations.size()),
+                       static_cast<uint32_t>(names.size())});
+    for (section_kind kind : k_all_section_kinds) {
+        append(&out,
+               section_record{std::to_underlying(kind),
+                              static_cast<uint32_t>(section(kind).size())});
+    }
+    uint32_t name_offset = 0;
+    for (symbol const & sym : symbols) {
+        uint32_t section = sym.section ? std::to_underlying(*sym.section) : k_undefined;
+        auto name_size = static_cast<uint32_t>(sym.name.size());
+        append(&out, symbol_record{name_offset, name_size, section, sym.offset});
+        name_offset += name_size;
+    }
+    for (relocation const & reloc : relocations) {
+        append(&out, relocation_record{std::to_underlying(reloc.section), reloc.offset, reloc.symbol});
+    }
+    append_padded(&out, names.data(), names.size());
+    for (section_kind kind : k_all_section_kinds) {
+        append_padded(&out, section(kind).data(), section(kind).size());
+    }
+    return out;
+}
+
+std::optional<object_module> object_module::deserialize(std::span<uint8_t const> bytes)
+{
+    reader in{bytes};
+    auto const header = in.read<file_header>();
+    if (!in.ok || header.magic != k_magic || header.version != k_version) {
+        logger.err("not an object file, or not one we know how to read");
+        return std::nullopt;
+    }
+
+    // Check the counts against what's left before allocating anything for them, so that a
+    // corrupt header can't make us allocate much more than the file's size.
+    size_t const remaining = bytes.size() - in.offset;
+    if (header.num_sections > remaining / sizeof(section_record)
+        || header.num_symbols > remaining / sizeof(symbol_record)
+        || header.num_relocations > remaining / sizeof(relocation_record)) {
+        logger.err("object file is truncated");
+        return std::nullopt;
+    }
+
+    std::vector<section_record> sections(header.num_sections);
+    for (section_record & section : sections) {
+        section = in.read<section_record>();
+        if (section.kind >= k_all_section_kinds.size() || section.size % k_word_size != 0) {
+            in.ok = false;
+        }
+    }
+
+    object_module module;
+    std::vector<symbol_record> symbol_records(header.num_symbols);
+    for (symbol_record & record : symbol_records) {
+        record = in.read<symbol_record>();
+    }
+    module.relocations.reserve(header.num_relocations);
+    for (uint32_t i = 0; i < header.num_relocations; ++i) {
+        auto const record = in.read<relocation_record>();
+        if (record.section >= k_all_section_kinds.size() || record.symbol >= header.num_symbols) {
+            in.ok = false;
+        }
+        module.relocations.push_back(
+            {static_cast<section_kind>(record.section), record.offset, record.symbol});
+    }
+
+    auto const * names = reinterpret_cast<char const *>(in.take(header.names_size));
+    module.symbols.reserve(header.num_symbols);
+    for (symbol_record const & record : symbol_records) {
+        if (names == nullptr || record.name_offset > header.names_size
+            || record.name_size > header.names_size - record.name_offset
+            || (record.section != k_undefined && record.section >= k_all_section_kinds.size())) {
+            in.ok = false;
+            break;
+        }
+        std::optional<section_kind> section;
+        if (record.section != k_undefined) {
+            section = static_cast<section_kind>(record.section);
+        }
+        module.symbols.push_back(
+            {std::string{names + record.name_offset, record.name_size}, section, record.offset});
+    }
+
+    for (section_record const & record : sections) {
+        if (uint8_t const * at = in.take(record.size)) {
+            module.section(static_cast<section_kind>(record.kind)).assign(at, at + record.size);
+        }
+    }
+
+    // everything has to point inside the section it's in
+    for (symbol const & sym : module.symbols) {
+        if (sym.section && sym.offset > module.section(*sym.section).size()) {
+            in.ok = false;
+        }
+    }
+    for (relocation const & reloc : module.relocations) {
+        if (reloc.offset % k_word_size != 0 || reloc.offset >= module.section(reloc.section).size()) {
+            in.ok = false;
+        }
+    }
+
+    if (!in.ok) {
+        logger.err("object file is corrupt or truncated");
+        return std::nullopt;
+    }
+    return module;
+}
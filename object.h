@@ -0,0 +1,80 @@
+#pragma once
+
+#include "cpu_base.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// which part of a module something lives in, see object_module
+#define ENUM_DEF_FILE_NAME "section_kind_def.h"
+#include "enum_decl.h" // IWYU pragma: export
+
+extern std::initializer_list<section_kind> const k_all_section_kinds;
+
+static size_t constexpr k_num_section_kinds = 0
+#define X(x) +1
+#include "section_kind_def.h"
+#undef X
+    ;
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+
+// What assemble_object() makes out of one source file: its bytes, split into sections, with the
+// labels it defines and the ones it uses but leaves to someone else (the linker) to define.
+//
+// Jumps and calls between labels in the same section are relative, so they're already resolved
+// and stay right wherever the section ends up. Only references to labels this module doesn't
+// define need a relocation.
+//
+// serialize() and deserialize() turn it into a compact binary file and back, so a module can be
+// assembled once and then loaded with nothing more than a few copies.
+struct object_module
+{
+    struct symbol
+    {
+        std::string name;
+
+        // nothing if it's defined by another module
+        std::optional<section_kind> section;
+
+        // bytes from the start of section
+        word_t offset = 0;
+
+        bool operator==(symbol const &) const = default;
+    };
+
+    // The jump or call at offset in section goes to symbols[symbol], which the linker fills in by
+    // rewriting its relative offset.
+    struct relocation
+    {
+        section_kind section;
+        word_t offset;
+        uint32_t symbol;
+
+        bool operator==(relocation const &) const = default;
+    };
+
+    std::vector<uint8_t> code;
+    std::vector<uint8_t> data;
+    std::vector<symbol> symbols;
+    std::vector<relocation> relocations;
+
+    std::vector<uint8_t> & section(section_kind kind);
+    std::vector<uint8_t> const & section(section_kind kind) const;
+
+    // the symbol called name, if there is one
+    symbol const * find_symbol(std::string_view name) const;
+
+    std::vector<uint8_t> serialize() const;
+
+    // Nothing (and an error logged) if bytes isn't something serialize() made.
+    static std::optional<object_module> deserialize(std::span<uint8_t const> bytes);
+
+    bool operator==(object_module const &) const = default;
+};
@@ -0,0 +1,94 @@
+#include "object.h"
+
+#include "assembler.h"
+#include "instr.h"
+#include "reg.h"
+#include "test.h"
+
+#include <cassert>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <vector>
+
+static word_t word_at(std::vector<uint8_t> const & bytes, word_t offset)
+{
+    word_t raw;
+    memcpy(&raw, bytes.data() + offset, sizeof(raw));
+    return raw;
+}
+
+TEST("object.assemble")
+{
+    object_module module = assemble_object(R"(
+start:
+call helper
+jump.eq start
+call local
+halt
+.section data
+table:
+.word 7
+.word 4294967295
+.section code
+local:
+jump.unc helper
+)");
+
+    assert(module.code.size() == 5 * k_word_size);
+    assert(word_at(module.code, k_word_size) == instr::jump(instr::eq, -4).storage);
+    assert(word_at(module.code, 2 * k_word_size) == instr::call(8).storage);
+    assert((module.data == std::vector<uint8_t>{7, 0, 0, 0, 0xff, 0xff, 0xff, 0xff}));
+
+    // every label, and then the one it's left for someone else to define
+    assert(module.symbols.size() == 4);
+    assert((*module.find_symbol("start") == object_module::symbol{"start", section_kind::code, 0}));
+    assert((*module.find_symbol("table") == object_module::symbol{"table", section_kind::data, 0}));
+    assert((*module.find_symbol("local")
+            == object_module::symbol{"local", section_kind::code, 4 * k_word_size}));
+    object_module::symbol const * helper = module.find_symbol("helper");
+    assert(helper != nullptr && !helper->section);
+    assert(module.find_symbol("nope") == nullptr);
+
+    // both uses of it need relocating, and are left pointing at themselves until then
+    auto const helper_index = static_cast<uint32_t>(helper - module.symbols.data());
+    assert((module.relocations
+            == std::vector<object_module::relocation>{
+                {section_kind::code, 0, helper_index},
+                {section_kind::code, 4 * k_word_size, helper_index},
+            }));
+    assert(word_at(module.code, 0) == instr::call(0).storage);
+
+    // and with nothing to link, it's the same as assembling a ROM
+    char const * const whole = "set r1 3\nloop:\nsub r0 r1\njump.ne loop\nhalt";
+    assert(assemble_object(whole).code == assemble(whole));
+}
+
+TEST("object.serialize")
+{
+    object_module module = assemble_object(R"(
+main:
+call lib_a
+call lib_b
+halt
+.section data
+odd_name_length:
+.word 12
+)");
+    std::vector<uint8_t> bytes = module.serialize();
+    assert(bytes.size() % 4 == 0);
+    std::optional<object_module> loaded = object_module::deserialize(bytes);
+    assert(loaded.has_value());
+    assert(*loaded == module);
+
+    object_module empty;
+    assert(object_module::deserialize(empty.serialize()) == empty);
+
+    // anything cut short, or that isn't an object file at all, is an error
+    for (size_t size = 0; size < bytes.size(); size += 4) {
+        assert(!object_module::deserialize(std::span{bytes}.first(size)));
+    }
+    std::vector<uint8_t> garbage = bytes;
+    garbage[0] ^= 1;
+    assert(!object_module::deserialize(garbage));
+}
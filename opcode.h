@@ -10,3 +10,12 @@
 
 static size_t constexpr k_opcode_bits = sizeof(opcode) * 8;
 static word_t constexpr k_opcode_mask = (word_t{1} << k_opcode_bits) - 1;
+
+// number of opcodes in opcode_def.h, anything at or past this isn't a valid instruction
+static size_t constexpr k_num_opcodes = 0
+#define X(x) +1
+#include "opcode_def.h"
+#undef X
+    ;
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
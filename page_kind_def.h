@@ -0,0 +1,5 @@
+#define ENUM_TYPE_NAME page_kind
+#define ENUM_UNDERLYING_TYPE uint8_t
+X(fault)
+X(memory)
+X(device)
@@ -0,0 +1,252 @@
+#include "paged_memory.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <utility>
+
+static logger logger{__FILE__};
+
+alignas(64) uint8_t const paged_memory::k_zero_page[k_page_size]{};
+
+// Tables this big or bigger come straight from mmap, so their pages only get zeroed (by the OS) as
+// they're touched. Smaller ones aren't worth the system calls.
+static size_t constexpr k_mmap_table_bytes = 64 * 1024;
+
+static size_t table_bytes(size_t num_pages)
+{
+    return num_pages * (sizeof(paged_memory::host_page) + sizeof(void *));
+}
+
+static void * alloc_tables(size_t bytes)
+{
+    void * tables;
+    if (bytes < k_mmap_table_bytes) {
+        tables = calloc(1, bytes);
+    } else {
+        tables = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tables == MAP_FAILED) {
+            tables = nullptr;
+        }
+    }
+    if (tables == nullptr) {
+        logger.abort("couldn't allocate {} bytes of page tables", bytes);
+    }
+    return tables;
+}
+
+static void free_tables(void * tables, size_t bytes)
+{
+    if (bytes < k_mmap_table_bytes) {
+        free(tables);
+    } else if (tables != nullptr) {
+        munmap(tables, bytes);
+    }
+}
+
+paged_memory::paged_memory(size_t size)
+    : size_{size}
+    , tables_{alloc_tables(table_bytes(num_pages()))}
+    , host_pages_{static_cast<host_page *>(tables_)}
+    , pages_{reinterpret_cast<page **>(host_pages_ + num_pages())}
+{
+    assert(size % k_page_size == 0 && size > 0);
+}
+
+paged_memory::paged_memory(uint8_t * host, size_t size)
+    : paged_memory{size}
+{
+    external_ = true;
+    for (size_t i = 0; i < num_pages(); ++i) {
+        host_pages_[i] = {host + i * k_page_size, host + i * k_page_size};
+    }
+}
+
+paged_memory::~paged_memory()
+{
+    release();
+}
+
+paged_memory::paged_memory(paged_memory && other) noexcept
+    : size_{std::exchange(other.size_, 0)}
+    , external_{other.external_}
+    , tables_{std::exchange(other.tables_, nullptr)}
+    , host_pages_{std::exchange(other.host_pages_, nullptr)}
+    , pages_{std::exchange(other.pages_, nullptr)}
+    , written_{std::move(other.written_)}
+    , borrowed_{std::move(other.borrowed_)}
+    , num_borrowed_pages_{std::exchange(other.num_borrowed_pages_, 0)}
+    , num_copied_pages_{other.num_copied_pages_}
+{
+    other.written_.clear();
+}
+
+paged_memory & paged_memory::operator=(paged_memory && other) noexcept
+{
+    if (this != &other) {
+        release();
+        size_ = std::exchange(other.size_, 0);
+        external_ = other.external_;
+        tables_ = std::exchange(other.tables_, nullptr);
+        host_pages_ = std::exchange(other.host_pages_, nullptr);
+        pages_ = std::exchange(other.pages_, nullptr);
+        written_ = std::move(other.written_);
+        other.written_.clear();
+        borrowed_ = std::move(other.borrowed_);
+        num_borrowed_pages_ = std::exchange(other.num_borrowed_pages_, 0);
+        num_copied_pages_ = other.num_copied_pages_;
+    }
+    return *this;
+}
+
+void paged_memory::release()
+{
+    for (size_t index : written_) {
+        unref(pages_[index]);
+    }
+    written_.clear();
+    borrowed_.reset();
+    num_borrowed_pages_ = 0;
+    if (tables_ != nullptr) {
+        free_tables(tables_, table_bytes(num_pages()));
+    }
+    tables_ = nullptr;
+    host_pages_ = nullptr;
+    pages_ = nullptr;
+    size_ = 0;
+}
+
+void paged_memory::unref(page * pg)
+{
+    if (pg->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete pg;
+    }
+}
+
+paged_memory paged_memory::fork()
+{
+    paged_memory child{size_};
+    if (external_) {
+        child.copy_from(*this);
+        return child;
+    }
+    child.borrowed_ = borrowed_;
+    child.num_borrowed_pages_ = num_borrowed_pages_;
+    for (size_t i = 0; i < num_borrowed_pages_; ++i) {
+        child.host_pages_[i].read = host_pages_[i].read;
+    }
+    child.written_ = written_;
+    for (size_t index : written_) {
+        page * pg = pages_[index];
+        pg->refs.fetch_add(1, std::memory_order_relaxed);
+        child.pages_[index] = pg;
+        child.host_pages_[index].read = pg->bytes;
+
+        // neither side may write in place any more
+        host_pages_[index].write = nullptr;
+    }
+    return child;
+}
+
+void paged_memory::make_writable(size_t index)
+{
+    page *& pg = pages_[index];
+    uint8_t const * borrowed = index < num_borrowed_pages_ ? host_pages_[index].read : nullptr;
+    if (pg == nullptr && borrowed != nullptr) {
+        pg = new page;
+        memcpy(pg->bytes, borrowed, k_page_size);
+        written_.push_back(index);
+        ++num_copied_pages_;
+    } else if (pg == nullptr) {
+        pg = new page{};
+        written_.push_back(index);
+    } else if (pg->refs.load(std::memory_order_acquire) > 1) {
+        page * copy = new page;
+        memcpy(copy->bytes, pg->bytes, k_page_size);
+        unref(pg);
+        pg = copy;
+        ++num_copied_pages_;
+    }
+    // Otherwise everyone we shared it with has let go since the last fork. They did so with a
+    // release, and the acquire above makes sure we see whatever they did before that.
+    host_pages_[index] = {pg->bytes, pg->bytes};
+}
+
+void paged_memory::borrow(std::shared_ptr<void const> owner, uint8_t const * bytes,
+                          size_t num_bytes)
+{
+    assert(!external_ && written_.empty() && num_bytes <= size_);
+    borrowed_ = std::move(owner);
+    num_borrowed_pages_ = (num_bytes + k_page_size - 1) / k_page_size;
+    for (size_t i = 0; i < num_borrowed_pages_; ++i) {
+        host_pages_[i] = {bytes + i * k_page_size, nullptr};
+    }
+}
+
+void paged_memory::copy_from(paged_memory const & other)
+{
+    assert(other.size_ == size_);
+    if (!other.external_) {
+        for (size_t i = 0; i < other.num_borrowed_pages_; ++i) {
+            if (other.pages_[i] == nullptr) {
+                write(i * k_page_size, other.host_pages_[i].read, k_page_size);
+            }
+        }
+        for (size_t index : other.written_) {
+            write(index * k_page_size, other.pages_[index]->bytes, k_page_size);
+        }
+        return;
+    }
+
+    // we don't know what's been written, but there's no need to allocate pages of zeros
+    for (size_t i = 0; i < num_pages(); ++i) {
+        uint8_t const * bytes = other.host_pages_[i].read;
+        if (memcmp(bytes, k_zero_page, k_page_size) != 0) {
+            write(i * k_page_size, bytes, k_page_size);
+        }
+    }
+}
+
+void paged_memory::read(size_t offset, void * dst, size_t num_bytes) const
+{
+    assert(offset <= size_ && num_bytes <= size_ - offset);
+    auto * out = static_cast<uint8_t *>(dst);
+    while (num_bytes > 0) {
+        size_t chunk = std::min<size_t>(num_bytes, k_page_size - (offset & (k_page_size - 1)));
+        memcpy(out, read_ptr(offset), chunk);
+        out += chunk;
+        offset += chunk;
+        num_bytes -= chunk;
+    }
+}
+
+void paged_memory::write(size_t offset, void const * src, size_t num_bytes)
+{
+    assert(offset <= size_ && num_bytes <= size_ - offset);
+    auto const * in = static_cast<uint8_t const *>(src);
+    while (num_bytes > 0) {
+        size_t chunk = std::min<size_t>(num_bytes, k_page_size - (offset & (k_page_size - 1)));
+        memcpy(write_ptr(offset), in, chunk);
+        in += chunk;
+        offset += chunk;
+        num_bytes -= chunk;
+    }
+}
+
+bool paged_memory::operator==(paged_memory const & other) const
+{
+    if (size_ != other.size_) {
+        return false;
+    }
+    for (size_t offset = 0; offset < size_; offset += k_page_size) {
+        uint8_t const * lhs = read_ptr(offset);
+        uint8_t const * rhs = other.read_ptr(offset);
+        if (lhs != rhs && memcmp(lhs, rhs, k_page_size) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "cpu_base.h"
+#include "iomap.h"
+
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Guest RAM or ROM, in k_page_size pages. fork() makes a copy that shares every page with the
+// original, and from then on a page only gets copied when one side writes to it while the other
+// still has it. Pages nobody has written yet aren't allocated at all and read as zeros.
+//
+// Even the page table is only paid for as it's used: big ones come straight from the OS, which
+// hands out zeroed pages on first touch. So creating one costs about the same whatever its size,
+// and fork() and the destructor only do work for the pages that have been written.
+//
+// Different paged_memorys that share pages can be used from different threads, but any one of them
+// can't be used from two threads at once (and fork() counts as a write).
+struct paged_memory
+{
+    static word_t constexpr k_page_bits = std::countr_zero(k_page_size);
+
+    // One per page. This is what generated code goes through, see jit.cpp.
+    struct host_page
+    {
+        // null until the page is first looked at (see make_readable), then a page of zeros until
+        // somebody writes it
+        uint8_t const * read;
+
+        // null unless we have the page all to ourselves
+        uint8_t * write;
+    };
+
+    // size must be a multiple of k_page_size
+    explicit paged_memory(size_t size);
+
+    // Wraps size bytes at host that belong to someone else (see flat_memory), and which have to
+    // outlive us. Nothing is ever shared: forks of it get their own copy of everything.
+    paged_memory(uint8_t * host, size_t size);
+
+    ~paged_memory();
+
+    paged_memory(paged_memory && other) noexcept;
+    paged_memory & operator=(paged_memory && other) noexcept;
+
+    // A copy that shares every page with this one. Cheap: nothing but the page table is copied.
+    paged_memory fork();
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    size_t num_pages() const
+    {
+        return size_ >> k_page_bits;
+    }
+
+    // Where to read or write the byte at offset. The pointer is good up to the end of its page,
+    // until the next call to anything non-const.
+    uint8_t const * read_ptr(size_t offset) const
+    {
+        assert(offset < size_);
+        uint8_t const * page = host_pages_[offset >> k_page_bits].read;
+        return (page ? page : k_zero_page) + (offset & (k_page_size - 1));
+    }
+
+    uint8_t * write_ptr(size_t offset)
+    {
+        assert(offset < size_);
+        host_page const & hp = host_pages_[offset >> k_page_bits];
+        if (hp.write == nullptr) [[unlikely]] {
+            make_writable(offset >> k_page_bits);
+        }
+        return hp.write + (offset & (k_page_size - 1));
+    }
+
+    // Point page index's read pointer at something, if it's still null. For anything that reads
+    // host_pages() directly rather than going through read_ptr, see mmu.h.
+    void make_readable(size_t index)
+    {
+        assert(index < num_pages());
+        if (host_pages_[index].read == nullptr) {
+            host_pages_[index].read = k_zero_page;
+        }
+    }
+
+    // Read our first num_bytes (rounded up to whole pages, which all have to be readable) straight
+    // out of bytes, which owner keeps alive, until somebody writes them. Forks share them too. Only
+    // for memory nobody has written yet, and not for external memory.
+    void borrow(std::shared_ptr<void const> owner, uint8_t const * bytes, size_t num_bytes);
+
+    // Make our contents the same as other's, which must be the same size. Only pages other has
+    // written get copied, so everything else had better be zeros already.
+    void copy_from(paged_memory const & other);
+
+    // copy [offset, offset + num_bytes) out of or into guest memory, across pages if need be
+    void read(size_t offset, void * dst, size_t num_bytes) const;
+    void write(size_t offset, void const * src, size_t num_bytes);
+
+    // same contents, whether or not the pages are shared
+    bool operator==(paged_memory const & other) const;
+
+    host_page const * host_pages() const
+    {
+        return host_pages_;
+    }
+
+    // pages we had to copy because they were still shared (or borrowed) when we wrote them
+    size_t num_copied_pages() const
+    {
+        return num_copied_pages_;
+    }
+
+    // pages we've allocated, shared or not
+    size_t num_allocated_pages() const
+    {
+        return written_.size();
+    }
+
+    // what every page nobody has written reads as
+    alignas(64) static uint8_t const k_zero_page[k_page_size];
+
+private:
+    struct page
+    {
+        // how many paged_memorys have this page
+        std::atomic<uint32_t> refs = 1;
+        alignas(64) uint8_t bytes[k_page_size];
+    };
+
+    static void unref(page * pg);
+
+    // give page index a private copy and point host_pages_ at it
+    void make_writable(size_t index);
+
+    // give back everything we have, leaving us empty
+    void release();
+
+    size_t size_ = 0;
+    bool external_ = false;
+
+    // One allocation for both tables, num_pages() entries each, starting out all zeros.
+    void * tables_ = nullptr;
+    host_page * host_pages_ = nullptr;
+
+    // null for pages nobody has written yet, and for all of them if we're external
+    page ** pages_ = nullptr;
+
+    // the indices of the non-null entries in pages_, in the order they were allocated
+    std::vector<size_t> written_;
+
+    // see borrow(). The first num_borrowed_pages_ pages read from it unless they're in pages_.
+    std::shared_ptr<void const> borrowed_;
+    size_t num_borrowed_pages_ = 0;
+
+    size_t num_copied_pages_ = 0;
+};
@@ -0,0 +1,152 @@
+#include "paged_memory.h"
+
+#include "iomap.h"
+#include "test.h"
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+static uint8_t byte_at(paged_memory const & mem, size_t offset)
+{
+    return *mem.read_ptr(offset);
+}
+
+TEST("paged_memory.zero_fill")
+{
+    paged_memory mem{4 * k_page_size};
+    assert(mem.num_pages() == 4);
+    assert(mem.num_allocated_pages() == 0);
+    for (size_t i = 0; i < mem.num_pages(); ++i) {
+        assert(mem.host_pages()[i].read == nullptr);
+        assert(mem.host_pages()[i].write == nullptr);
+        assert(byte_at(mem, i * k_page_size + 17) == 0);
+    }
+    mem.make_readable(3);
+    assert(mem.host_pages()[3].read != nullptr);
+    assert(mem.host_pages()[3].write == nullptr);
+    assert(byte_at(mem, 3 * k_page_size + 17) == 0);
+    assert(mem.num_allocated_pages() == 0);
+
+    // straddles the first two pages
+    uint32_t const val = 0x11223344;
+    mem.write(k_page_size - 2, &val, sizeof(val));
+    assert(mem.num_allocated_pages() == 2);
+    assert(mem.num_copied_pages() == 0);
+    uint32_t back = 0;
+    mem.read(k_page_size - 2, &back, sizeof(back));
+    assert(back == val);
+    assert(byte_at(mem, 0) == 0);
+    assert(mem.host_pages()[0].write != nullptr);
+    assert(mem.host_pages()[2].write == nullptr);
+
+    // copies leave pages nobody wrote alone too
+    paged_memory copy{4 * k_page_size};
+    copy.copy_from(mem);
+    assert(copy == mem);
+    assert(copy.num_allocated_pages() == 2);
+}
+
+TEST("paged_memory.fork")
+{
+    paged_memory parent{4 * k_page_size};
+    *parent.write_ptr(0) = 1;
+    *parent.write_ptr(k_page_size) = 2;
+
+    std::optional<paged_memory> child{parent.fork()};
+    assert(*child == parent);
+    assert(child->host_pages()[0].read == parent.host_pages()[0].read);
+    for (size_t i = 0; i < parent.num_pages(); ++i) {
+        assert(parent.host_pages()[i].write == nullptr);
+        assert(child->host_pages()[i].write == nullptr);
+    }
+
+    // only the page the child writes gets copied
+    *child->write_ptr(k_page_size + 1) = 3;
+    assert(child->num_copied_pages() == 1);
+    assert(byte_at(*child, k_page_size) == 2);
+    assert(byte_at(*child, k_page_size + 1) == 3);
+    assert(byte_at(parent, k_page_size + 1) == 0);
+    assert(child->host_pages()[0].read == parent.host_pages()[0].read);
+    assert(!(*child == parent));
+
+    // pages nobody had yet are just allocated, there's nothing to copy
+    *child->write_ptr(3 * k_page_size) = 4;
+    assert(child->num_copied_pages() == 1);
+    assert(byte_at(parent, 3 * k_page_size) == 0);
+
+    // the parent has to copy too while the child is around, but not once it's gone
+    *parent.write_ptr(0) = 5;
+    assert(parent.num_copied_pages() == 1);
+    assert(byte_at(*child, 0) == 1);
+    child.reset();
+    *parent.write_ptr(k_page_size) = 6;
+    assert(parent.num_copied_pages() == 1);
+    assert(byte_at(parent, 0) == 5);
+    assert(byte_at(parent, k_page_size) == 6);
+}
+
+TEST("paged_memory.borrow")
+{
+    // a page and a half of something, then zeros
+    auto owner = std::make_shared<std::vector<uint8_t>>(2 * k_page_size);
+    for (size_t i = 0; i < k_page_size + k_page_size / 2; ++i) {
+        (*owner)[i] = static_cast<uint8_t>(i + 1);
+    }
+
+    paged_memory mem{4 * k_page_size};
+    mem.borrow(owner, owner->data(), k_page_size + k_page_size / 2);
+    assert(mem.host_pages()[1].read == owner->data() + k_page_size);
+    assert(mem.host_pages()[1].write == nullptr);
+    assert(byte_at(mem, k_page_size) == static_cast<uint8_t>(k_page_size + 1));
+    assert(mem.num_allocated_pages() == 0);
+
+    // forks borrow the same bytes, and keep them alive
+    std::optional<paged_memory> child{mem.fork()};
+    assert(child->host_pages()[0].read == owner->data());
+    std::weak_ptr<std::vector<uint8_t>> weak = owner;
+    owner.reset();
+    mem = paged_memory{k_page_size};
+    assert(!weak.expired());
+
+    // writing copies the page rather than changing what we borrowed
+    *child->write_ptr(1) = 0;
+    assert(child->num_copied_pages() == 1);
+    assert(byte_at(*child, 0) == 1 && byte_at(*child, 2) == 3);
+    assert((*weak.lock())[1] == 2);
+
+    paged_memory copy{4 * k_page_size};
+    copy.copy_from(*child);
+    assert(copy == *child);
+
+    child.reset();
+    assert(weak.expired());
+}
+
+TEST("paged_memory.large")
+{
+    // a GiB, nearly none of which ever gets touched
+    size_t const size = size_t{1} << 30;
+    paged_memory mem{size};
+    assert(mem.num_pages() == size / k_page_size);
+    assert(byte_at(mem, size / 2) == 0);
+
+    *mem.write_ptr(size - 1) = 7;
+    *mem.write_ptr(12345) = 8;
+    assert(mem.num_allocated_pages() == 2);
+
+    paged_memory child = mem.fork();
+    assert(child.num_allocated_pages() == 2);
+    assert(byte_at(child, size - 1) == 7);
+    assert(byte_at(child, 12345) == 8);
+    assert(child == mem);
+
+    // moving hands over the pages, and leaves nothing behind to free twice
+    paged_memory moved{std::move(child)};
+    *moved.write_ptr(size - 2) = 9;
+    assert(moved.num_copied_pages() == 1);
+    assert(byte_at(mem, size - 2) == 0);
+}
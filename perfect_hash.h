@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// A perfect hash over a fixed set of strings, found at compile time: every key gets a slot of its
+// own, so finding a string is one hash, one load and one compare to check it really is that key.
+// For tables of names like mnemonics and enums that we'd otherwise search one by one.
+//
+//     static constexpr auto k_hash = make_perfect_hash<3>({"add", "sub", "halt"});
+//     std::optional<size_t> index = k_hash.find(token);
+template <size_t num_keys>
+struct perfect_hash
+{
+    // a power of two, and big enough that a seed that separates every key turns up quickly
+    static size_t constexpr k_num_slots = std::bit_ceil(num_keys * 4);
+
+    // the index of str in the keys the table was made from, if it's one of them
+    constexpr std::optional<size_t> find(std::string_view str) const
+    {
+        uint8_t slot = slots[hash(str, seed) & (k_num_slots - 1)];
+        if (slot == 0 || keys[slot - 1] != str) {
+            return std::nullopt;
+        }
+        return slot - 1;
+    }
+
+    static constexpr uint32_t hash(std::string_view str, uint32_t seed)
+    {
+        // FNV-1a, starting from the seed and the length
+        uint32_t h = (2166136261u ^ seed) * 16777619u;
+        h = (h ^ static_cast<uint32_t>(str.size())) * 16777619u;
+        for (char c : str) {
+            h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    std::array<std::string_view, num_keys> keys{};
+    uint32_t seed = 0;
+
+    // one more than the index of the key in each slot, 0 for none
+    std::array<uint8_t, k_num_slots> slots{};
+};
+
+// Try seeds until one puts every key in a slot of its own. Keys have to be different from each
+// other, or this never finishes (and fails to compile instead).
+template <size_t num_keys>
+consteval perfect_hash<num_keys> make_perfect_hash(std::array<std::string_view, num_keys> keys)
+{
+    static_assert(num_keys < 255, "slots only have room for this many");
+    using table = perfect_hash<num_keys>;
+    for (uint32_t seed = 0; seed < 100000; ++seed) {
+        table t{keys, seed, {}};
+        bool ok = true;
+        for (size_t i = 0; i < num_keys && ok; ++i) {
+            uint8_t & slot = t.slots[table::hash(keys[i], seed) & (table::k_num_slots - 1)];
+            ok = slot == 0;
+            slot = static_cast<uint8_t>(i + 1);
+        }
+        if (ok) {
+            return t;
+        }
+    }
+    assert(false && "no perfect hash, are there duplicate keys?");
+    return {};
+}
+
+// the same for an array of things with a name
+template <typename entry_t, size_t num_entries>
+consteval auto make_perfect_hash(entry_t const (&entries)[num_entries],
+                                 std::string_view entry_t::*name)
+{
+    std::array<std::string_view, num_entries> keys{};
+    for (size_t i = 0; i < num_entries; ++i) {
+        keys[i] = entries[i].*name;
+    }
+    return make_perfect_hash(keys);
+}
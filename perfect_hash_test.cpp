@@ -0,0 +1,40 @@
+#include "perfect_hash.h"
+
+#include "instr.h"
+#include "opcode.h"
+#include "reg.h"
+#include "test.h"
+
+#include <cassert>
+#include <string>
+
+static auto constexpr k_test_hash = make_perfect_hash<4>({"add", "sub", "halt", "jump.unc"});
+static_assert(k_test_hash.find("halt") == 2);
+static_assert(!k_test_hash.find("hal"));
+
+TEST("perfect_hash.keys")
+{
+    for (size_t i = 0; i < k_test_hash.keys.size(); ++i) {
+        assert(k_test_hash.find(k_test_hash.keys[i]) == i);
+
+        // nothing that's nearly a key
+        std::string key{k_test_hash.keys[i]};
+        assert(!k_test_hash.find(key + "x"));
+        assert(!k_test_hash.find(key.substr(1)));
+    }
+    assert(!k_test_hash.find(""));
+}
+
+TEST("perfect_hash.enums")
+{
+    for (reg r : k_all_registers) {
+        assert(from_str<reg>(to_str(r)) == r);
+    }
+    for (cmp_flag flag : instr::k_all_cmp_flags) {
+        assert(from_str<cmp_flag>(to_str(flag)) == flag);
+    }
+    assert(from_str<opcode>("call") == opcode::call);
+    assert(!from_str<reg>("r16"));
+    assert(!from_str<reg>("r"));
+    assert(!from_str<opcode>("calls"));
+}
@@ -3,3 +3,20 @@
 #define PASTE_IMPL(x, y) x##y
 
 #define PASTE(x, y) PASTE_IMPL(x, y)
+
+// Guaranteed tail call, used by the direct-threaded interpreter so handlers can jump straight to
+// the next handler without growing the stack. Other compilers get a plain return and have to rely
+// on sibling call optimization.
+#if defined(__clang__)
+#define MUSTTAIL [[clang::musttail]]
+#else
+#define MUSTTAIL
+#endif
+
+// Compile a function once per x86 vector ISA and pick the best one the host supports when the
+// program starts. Meant for functions full of simple loops for the compiler to vectorize.
+#if defined(__x86_64__) && defined(__linux__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
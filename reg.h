@@ -2,6 +2,7 @@
 
 #include "cpu_base.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <format>
 #include <optional>
@@ -30,6 +31,7 @@ struct std::formatter<reg>
     template <class FormatContext>
     auto format(reg const & rr, FormatContext & ctx) const
     {
-        return std::format_to(ctx.out(), "{}", to_str(rr));
+        // just the name, without going through another format string
+        return std::ranges::copy(to_str(rr), ctx.out()).out;
     }
 };
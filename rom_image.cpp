@@ -0,0 +1,81 @@
+#include "rom_image.h"
+
+#include "iomap.h"
+#include "log.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+static logger logger{__FILE__};
+
+std::shared_ptr<rom_image const> rom_image::open(std::string const & path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        logger.err("couldn't open ROM image {}: errno {}", path, errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+
+    // Which file, and which version of it: anything that rewrites it should change the size or
+    // the modification time, and then it gets a new image.
+    using file_key = std::tuple<dev_t, ino_t, off_t, time_t, long>;
+    static std::mutex g_mutex;
+    static std::map<file_key, std::weak_ptr<rom_image const>> g_images;
+
+    file_key const key{st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    std::lock_guard lock{g_mutex};
+    if (auto it = g_images.find(key); it != g_images.end()) {
+        if (std::shared_ptr<rom_image const> image = it->second.lock()) {
+            close(fd);
+            return image;
+        }
+    }
+    std::erase_if(g_images, [](auto const & entry) { return entry.second.expired(); });
+
+    auto const size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        logger.err("ROM image {} is empty", path);
+        close(fd);
+        return nullptr;
+    }
+
+    // Guest pages can be bigger than host ones, and reading a host page that's entirely past the
+    // end of the file is a SIGBUS, so the file goes over the start of a zeroed mapping that's a
+    // whole number of guest pages long. The last host page of the file is zero filled past the end
+    // by the kernel.
+    size_t const mapped_size = (size + k_page_size - 1) / k_page_size * k_page_size;
+    void * base = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void * file = base == MAP_FAILED
+        ? MAP_FAILED
+        : mmap(base, size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0);
+    int const map_errno = errno;
+    // the mapping keeps the file alive
+    close(fd);
+    if (file == MAP_FAILED) {
+        logger.err("couldn't map ROM image {}: errno {}", path, map_errno);
+        if (base != MAP_FAILED) {
+            munmap(base, mapped_size);
+        }
+        return nullptr;
+    }
+
+    std::shared_ptr<rom_image const> image{
+        new rom_image{static_cast<uint8_t const *>(base), size, mapped_size}};
+    g_images[key] = image;
+    return image;
+}
+
+rom_image::~rom_image()
+{
+    munmap(const_cast<uint8_t *>(bytes_), mapped_size_);
+}
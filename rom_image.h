@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// A prebuilt ROM binary mmapped read-only, for system_state::load_rom. The kernel's page cache is
+// the only copy: every VM that loads the image reads straight out of the mapping until it writes
+// a page, and opening the same file again while an image of it is still around gets that image
+// back rather than another mapping. So loading is the same handful of system calls however big
+// the file is, and only the pages the guest actually touches are ever read from disk.
+//
+// The file mustn't change while it's open: the mapping is shared, so the guest would see the new
+// bytes (or SIGBUS, if it shrinks) and anything already decoded from the old ones would be stale.
+struct rom_image
+{
+    // Null (and an error logged) if path can't be opened or mapped, or is empty.
+    static std::shared_ptr<rom_image const> open(std::string const & path);
+
+    ~rom_image();
+
+    rom_image(rom_image const &) = delete;
+    rom_image & operator=(rom_image const &) = delete;
+
+    // The file's contents, followed by zeros up to the next k_page_size boundary, so every guest
+    // page the image touches can be read in full.
+    uint8_t const * bytes() const
+    {
+        return bytes_;
+    }
+
+    // how big the file is
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    rom_image(uint8_t const * bytes, size_t size, size_t mapped_size)
+        : bytes_{bytes}
+        , size_{size}
+        , mapped_size_{mapped_size}
+    { }
+
+    uint8_t const * bytes_;
+    size_t size_;
+    size_t mapped_size_;
+};
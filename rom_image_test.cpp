@@ -0,0 +1,133 @@
+#include "rom_image.h"
+
+#include "iomap.h"
+#include "opcode.h"
+#include "reg.h"
+#include "system_state.h"
+#include "test.h"
+#include "test_programs.h"
+#include "vm_scheduler.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <span>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// a temporary file holding bytes, deleted again when we're done with it
+struct temp_file
+{
+    explicit temp_file(std::vector<uint8_t> const & bytes)
+    {
+        char name[] = "/tmp/rom_image_test.XXXXXX";
+        int fd = mkstemp(name);
+        assert(fd >= 0);
+        ssize_t n = write(fd, bytes.data(), bytes.size());
+        assert(n == static_cast<ssize_t>(bytes.size()));
+        close(fd);
+        path = name;
+    }
+
+    ~temp_file()
+    {
+        unlink(path.c_str());
+    }
+
+    std::string path;
+};
+
+TEST("rom_image.open")
+{
+    std::vector<uint8_t> const rom = make_fib_rom();
+    temp_file file{rom};
+
+    std::shared_ptr<rom_image const> image = rom_image::open(file.path);
+    assert(image != nullptr);
+    assert(image->size() == rom.size());
+    assert(memcmp(image->bytes(), rom.data(), rom.size()) == 0);
+
+    // zeros up to the end of the page
+    for (size_t i = rom.size(); i < k_page_size; ++i) {
+        assert(image->bytes()[i] == 0);
+    }
+
+    // the same file gets the same mapping
+    assert(rom_image::open(file.path) == image);
+
+    assert(rom_image::open(file.path + ".missing") == nullptr);
+    temp_file empty{{}};
+    assert(rom_image::open(empty.path) == nullptr);
+}
+
+TEST("rom_image.load_rom")
+{
+    word_t const n = 12;
+    std::vector<uint8_t> const rom = make_fib_rom();
+    temp_file file{rom};
+    std::shared_ptr<rom_image const> image = rom_image::open(file.path);
+
+    for (memory_mode mode : {memory_mode::paged, memory_mode::flat}) {
+        for (engine eng : k_all_engines) {
+            system_state state{};
+            state.engine = eng;
+            state.memory_mode = mode;
+            state.load_rom(image);
+            state.cpu.get(r0) = n;
+            assert(state.run() == run_status::halted);
+            assert(state.cpu.get(r13) == host_fib(n));
+        }
+    }
+
+    // ROM reads come straight out of the image, and the decoded ROM is shared too
+    system_state a{};
+    system_state b{};
+    a.memory_mode = memory_mode::paged;
+    a.load_rom(image);
+    b.load_rom(image);
+    assert(a.rom.host_pages()[0].read == image->bytes());
+    assert(a.rom.num_allocated_pages() == 0);
+    assert(a.decoded_rom == b.decoded_rom);
+    assert(a.decoded_rom[0].op != opcode::halt);
+
+    // and so do forks
+    system_state child = a.fork();
+    assert(child.rom.host_pages()[0].read == image->bytes());
+    child.cpu.get(r0) = n;
+    assert(child.run() == run_status::halted);
+    assert(child.cpu.get(r13) == host_fib(n));
+
+    // changing ROM copies the page rather than touching the file
+    word_t const halt = 0;
+    a.set_rom(std::span<word_t const>{&halt, 1});
+    assert(a.rom.num_copied_pages() == 1);
+    assert(a.rom.host_pages()[0].read != image->bytes());
+    assert(a.decoded_rom != b.decoded_rom);
+    assert(b.rom == child.rom);
+    assert(memcmp(image->bytes(), rom.data(), rom.size()) == 0);
+}
+
+TEST("rom_image.vm_scheduler")
+{
+    temp_file file{make_fib_rom()};
+    std::shared_ptr<rom_image const> image = rom_image::open(file.path);
+
+    vm_scheduler scheduler{2, 500};
+    std::vector<vm_job> jobs;
+    for (word_t i = 0; i < 8; ++i) {
+        vm_job job;
+        job.image = image;
+        job.registers[std::to_underlying(r0)] = i;
+        jobs.push_back(job);
+    }
+    std::vector<std::future<vm_result>> results = scheduler.submit(std::move(jobs));
+    for (word_t i = 0; i < results.size(); ++i) {
+        vm_result result = results[i].get();
+        assert(result.status == run_status::halted);
+        assert(result.cpu.get(r13) == host_fib(i));
+    }
+}
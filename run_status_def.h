@@ -0,0 +1,6 @@
+#define ENUM_TYPE_NAME run_status
+#define ENUM_UNDERLYING_TYPE uint8_t
+X(halted)
+X(budget_exhausted)
+X(trapped)
+X(faulted)
@@ -0,0 +1,4 @@
+#define ENUM_TYPE_NAME section_kind
+#define ENUM_UNDERLYING_TYPE uint8_t
+X(code)
+X(data)
@@ -0,0 +1,84 @@
+#include "symbol_table.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+uint64_t symbol_table::hash(std::string_view name)
+{
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : name) {
+        h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+    }
+    return h;
+}
+
+symbol_table::slot const * symbol_table::probe(std::string_view name, uint64_t hash) const
+{
+    size_t const mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        slot const & s = slots_[i];
+        if (s.name == nullptr
+            || (s.hash == hash && std::string_view{s.name, s.name_size} == name)) {
+            return &s;
+        }
+    }
+}
+
+uint32_t const * symbol_table::find(std::string_view name) const
+{
+    if (slots_.empty()) {
+        return nullptr;
+    }
+    slot const * s = probe(name, hash(name));
+    return s->name ? &s->value : nullptr;
+}
+
+std::pair<uint32_t, bool> symbol_table::try_emplace(std::string_view name, uint32_t value)
+{
+    assert(!name.empty());
+    if ((size_ + 1) * 2 > slots_.size()) {
+        grow();
+    }
+    uint64_t const h = hash(name);
+    auto * s = const_cast<slot *>(probe(name, h));
+    if (s->name) {
+        return {s->value, false};
+    }
+    *s = {intern(name), static_cast<uint32_t>(name.size()), value, h};
+    ++size_;
+    return {value, true};
+}
+
+char const * symbol_table::intern(std::string_view name)
+{
+    if (block_left_ < name.size()) {
+        // anything too big for a block gets one to itself
+        size_t size = std::max(k_block_size, name.size());
+        blocks_.push_back(std::make_unique_for_overwrite<char[]>(size));
+        block_next_ = blocks_.back().get();
+        block_left_ = size;
+    }
+    char * at = block_next_;
+    memcpy(at, name.data(), name.size());
+    block_next_ += name.size();
+    block_left_ -= name.size();
+    return at;
+}
+
+void symbol_table::grow()
+{
+    std::vector<slot> old = std::move(slots_);
+    slots_.assign(std::max<size_t>(16, old.size() * 2), slot{});
+    size_t const mask = slots_.size() - 1;
+    for (slot const & s : old) {
+        if (s.name) {
+            size_t i = s.hash & mask;
+            while (slots_[i].name) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = s;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Names to numbers, for the assembler's labels. Open addressing with linear probing in one flat
+// array of slots, so a lookup is a hash and then usually a single compare, and the names are
+// copied into big blocks that are only freed with the table, so adding a name almost never
+// allocates. Doesn't keep pointers into whatever the names were passed in from.
+struct symbol_table
+{
+    // name's value, or null if it isn't here
+    uint32_t const * find(std::string_view name) const;
+
+    // Add name with value unless it's already here. Returns its value either way, and whether it
+    // was added.
+    std::pair<uint32_t, bool> try_emplace(std::string_view name, uint32_t value);
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    struct slot
+    {
+        // null if the slot is empty
+        char const * name = nullptr;
+        uint32_t name_size = 0;
+        uint32_t value = 0;
+        uint64_t hash = 0;
+    };
+
+    static uint64_t hash(std::string_view name);
+
+    // the slot name is in, or the empty one it would go in
+    slot const * probe(std::string_view name, uint64_t hash) const;
+
+    // copy name somewhere that lives as long as we do
+    char const * intern(std::string_view name);
+
+    void grow();
+
+    // always a power of two, and at most half full
+    std::vector<slot> slots_;
+    size_t size_ = 0;
+
+    // where the names live
+    static size_t constexpr k_block_size = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char * block_next_ = nullptr;
+    size_t block_left_ = 0;
+};
@@ -0,0 +1,42 @@
+#include "symbol_table.h"
+
+#include "test.h"
+
+#include <cassert>
+#include <cstdint>
+#include <format>
+#include <string>
+#include <vector>
+
+TEST("symbol_table.basic")
+{
+    symbol_table table;
+    assert(table.find("a") == nullptr);
+
+    // enough to grow a few times, and more names than fit in one block
+    std::vector<std::string> names;
+    for (uint32_t i = 0; i < 20000; ++i) {
+        names.push_back(std::format("label_{}", i));
+    }
+    // one too big for a block of its own
+    names.push_back(std::string(100000, 'x'));
+
+    for (uint32_t i = 0; i < names.size(); ++i) {
+        auto [value, inserted] = table.try_emplace(names[i], i);
+        assert(inserted && value == i);
+    }
+    assert(table.size() == names.size());
+
+    // it has its own copies of the names
+    for (uint32_t i = 0; i < names.size(); ++i) {
+        std::string copy = names[i];
+        names[i].assign(names[i].size(), '?');
+        assert(*table.find(copy) == i);
+
+        auto [value, inserted] = table.try_emplace(copy, 0);
+        assert(!inserted && value == i);
+    }
+    assert(table.size() == names.size());
+    assert(table.find("label_") == nullptr);
+    assert(table.find("label_200000") == nullptr);
+}
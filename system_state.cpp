@@ -1,14 +1,69 @@
 #include "system_state.h"
 
+#include "decoded_instr.h"
+#include "device.h"
+#include "flat_memory.h"
+#include "fusion.h"
+#include "guest_fault.h"
 #include "instr.h"
 #include "iomap.h"
 #include "log.h"
 #include "opcode.h"
+#include "rom_image.h"
+#include "threaded.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sys/mman.h>
+#include <type_traits>
+#include <utility>
+
+#define ENUM_DEF_FILE_NAME "engine_def.h"
+#include "enum_def.h"
+#define ENUM_DEF_FILE_NAME "run_status_def.h"
+#include "enum_def.h"
+#define ENUM_DEF_FILE_NAME "memory_mode_def.h"
+#include "enum_def.h"
 
 static logger logger{__FILE__};
 
+std::initializer_list<engine> const k_all_engines{
+#define X(x) engine::x,
+#include "engine_def.h"
+#undef X
+};
+
+// the value of an enum from environment variable var, if it's set to one
+template <typename T>
+static T enum_from_env(char const * var, T fallback)
+{
+    if (char const * env = getenv(var)) {
+        if (std::optional<T> value = from_str<T>(env)) {
+            return *value;
+        }
+        logger.err("unknown value '{}' in {}, using the default", env, var);
+    }
+    return fallback;
+}
+
+static engine default_engine()
+{
+    static engine const g_default_engine = enum_from_env("CPU_ENGINE", engine::threaded);
+    return g_default_engine;
+}
+
+static memory_mode default_memory_mode()
+{
+    static memory_mode const g_default_memory_mode =
+        enum_from_env("CPU_MEMORY", memory_mode::paged);
+    return g_default_memory_mode;
+}
+
 void cpu::add(reg dest, reg op1)
 {
     get(dest) = get(dest) + get(op1);
@@ -39,29 +94,6 @@ void cpu::ijump(cmp_flag flag, reg loc)
     }
 }
 
-bool cpu::is_taken(cmp_flag flag) const
-{
-    switch (flag) {
-    case instr::eq:
-        return get_cmp_flag(cpu_cmp_flags::eq);
-    case instr::ne:
-        return !get_cmp_flag(cpu_cmp_flags::eq);
-    case instr::gt:
-        return get_cmp_flag(cpu_cmp_flags::gt);
-    case instr::ge:
-        return get_cmp_flag(cpu_cmp_flags::gt) || get_cmp_flag(cpu_cmp_flags::eq);
-    case instr::lt:
-        return get_cmp_flag(cpu_cmp_flags::lt);
-    case instr::le:
-        return get_cmp_flag(cpu_cmp_flags::lt) || get_cmp_flag(cpu_cmp_flags::eq);
-    case instr::unc:
-        return true;
-    default:
-        assert(false);
-        return false;
-    }
-}
-
 void cpu::call(signed_word_t offset)
 {
     get(r15) = instr_ptr + k_word_size;
@@ -69,17 +101,111 @@ void cpu::call(signed_word_t offset)
     instr_ptr -= k_word_size;
 }
 
-system_state::system_state(std::span<word_t const> program)
-    : rom{std::make_unique<uint8_t[]>(iomap::k_rom_size)}
-    , ram{std::make_unique<uint8_t[]>(iomap::k_ram_size)}
+system_state::system_state(std::span<word_t const> program, memory_layout layout)
+    : layout{layout}
+    , rom{layout.rom_size}
+    , ram{layout.ram_size}
+    , engine{default_engine()}
+    , memory_mode{default_memory_mode()}
 {
-    memset(rom.get(), 0, iomap::k_rom_size);
-    memset(ram.get(), 0, iomap::k_ram_size);
+    assert(layout.valid());
+    map_memory();
+    allocate_decoded_rom();
     if (program.size() > 0) {
         set_rom(program);
     }
 }
 
+// Decoded ROMs this big or bigger come straight from mmap, so their pages only get zeroed (by the
+// OS) as they're touched. Smaller ones aren't worth the system calls.
+static size_t constexpr k_mmap_decoded_bytes = 128 * 1024;
+
+// count zeroed Ts that don't cost anything until they're touched, at least for big counts
+template <typename T>
+static std::shared_ptr<T[]> make_zeroed(size_t count)
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+    size_t const bytes = count * sizeof(T);
+    if (bytes < k_mmap_decoded_bytes) {
+        void * addr = calloc(1, bytes);
+        if (addr == nullptr) {
+            logger.abort("couldn't allocate {} bytes of decoded ROM", bytes);
+        }
+        return {static_cast<T *>(addr), [](T * p) { free(p); }};
+    }
+    void * addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        logger.abort("couldn't allocate {} bytes of decoded ROM", bytes);
+    }
+    return {static_cast<T *>(addr), [bytes](T * p) { munmap(p, bytes); }};
+}
+
+void system_state::allocate_decoded_rom()
+{
+    // all zeros, which is what decode() makes of a zero word apart from the handler
+    decoded_rom = make_zeroed<decoded_instr>(rom_words() + 1);
+    block_lengths = make_zeroed<uint32_t>(rom_words() + 1);
+    decoded_words = 0;
+    fusions = {};
+
+    // not a valid opcode, so falling off the end of ROM hits an assert
+    decoded_rom[rom_words()] = decode(instr{~word_t{0}});
+    decoded_rom[rom_words()].handler = threaded_handler(decoded_rom[rom_words()]);
+    mark_blank(0);
+}
+
+void system_state::mark_blank(size_t index)
+{
+    if (index < rom_words()) {
+        decoded_rom[index] = decode(instr{0});
+        decoded_rom[index].handler = blank_handler();
+        block_lengths[index] = 0;
+    }
+}
+
+system_state::system_state(system_state & parent, fork_tag)
+    : console{parent.console}
+    , devices{parent.devices}
+    , layout{parent.layout}
+    , rom{parent.rom.fork()}
+    , ram{parent.ram.fork()}
+    , decoded_rom{parent.decoded_rom}
+    , block_lengths{parent.block_lengths}
+    , decoded_words{parent.decoded_words}
+    , budget{parent.budget}
+    , cpu{parent.cpu}
+    , fusions{parent.fusions}
+    , engine{parent.engine}
+    , memory_mode{parent.memory_mode}
+{
+    map_memory();
+}
+
+void system_state::map_memory()
+{
+    static_assert(iomap::k_console_base + iomap::k_console_size <= iomap::k_rom_base
+                      && iomap::k_rom_base < iomap::k_ram_base,
+                  "flat memory leaves everything below ROM to the page table");
+    mmu.map_device(iomap::k_console_base, iomap::k_console_size, &console_io);
+    for (device_bus::attached const & a : devices.devices()) {
+        mmu.map_device(a.base, a.size, a.dev.get());
+    }
+    mmu.map_memory(iomap::k_rom_base, &rom, mmu::k_perm_read);
+    mmu.map_memory(layout.ram_base(), &ram, mmu::k_perm_read | mmu::k_perm_write);
+}
+
+void system_state::attach_device(word_t base, word_t size, std::shared_ptr<device> dev)
+{
+    device * raw = dev.get();
+    devices.attach(base, size, std::move(dev));
+    mmu.map_device(base, size, raw);
+}
+
+system_state system_state::fork()
+{
+    return system_state{*this, fork_tag{}};
+}
+
 void system_state::set_rom(std::span<word_t const> program)
 {
     set_rom(static_cast<void const *>(program.data()), program.size() * sizeof(word_t));
@@ -97,85 +223,354 @@ void system_state::set_rom(std::vector<instr> program)
 
 void system_state::set_rom(void const * prog, size_t num_bytes)
 {
-    assert(num_bytes < iomap::k_rom_size);
-    memcpy(rom.get(), prog, num_bytes);
+    assert(num_bytes < rom.size());
+    rom.write(0, prog, num_bytes);
+    predecode(0, num_bytes);
+    if (jit_cache) {
+        jit_cache->flush();
+    }
 }
 
-void system_state::run()
+void system_state::load_rom(std::shared_ptr<rom_image const> image)
 {
-    while (true) {
-        assert(cpu.instr_ptr - iomap::k_rom_base < iomap::k_rom_size);
-        instr instr{raw_load(cpu.instr_ptr)};
-        logger.debug("[ip={:#x}] executing {}", cpu.instr_ptr, instr);
-        switch (instr.get_opcode()) {
-        case opcode::set: {
-            reg dest;
-            word_t value;
-            instr.decode_set(&dest, &value);
-            execute_set(dest, value);
-            break;
+    assert(image && image->size() < rom.size());
+    if (flat) {
+        rom.write(0, image->bytes(), image->size());
+        for (size_t offset = image->size(); offset < rom.size();) {
+            size_t chunk = std::min<size_t>(rom.size() - offset, k_page_size - offset % k_page_size);
+            rom.write(offset, paged_memory::k_zero_page, chunk);
+            offset += chunk;
         }
-        case opcode::store: {
-            reg addr, src;
-            word_t width;
-            instr.decode_store(&addr, &src, &width);
-            execute_store(addr, src, width);
-            break;
+    } else {
+        paged_memory fresh{rom.size()};
+        fresh.borrow(image, image->bytes(), image->size());
+        rom = std::move(fresh);
+    }
+    decode_image(image);
+
+    // the TLB may point at the old ROM pages
+    mmu.flush_tlb();
+    if (jit_cache) {
+        jit_cache->flush();
+    }
+}
+
+void system_state::decode_image(std::shared_ptr<rom_image const> const & image)
+{
+    // Decoding is as slow as the image is big, so everyone who loads the same image shares one
+    // decoded copy, like forks do. The entries go when their image does. The weak_ptr tells us
+    // whether an entry is for the image at that address or for a dead one that used to be there.
+    struct decoded_image
+    {
+        std::weak_ptr<rom_image const> image;
+        std::shared_ptr<decoded_instr[]> decoded;
+        std::shared_ptr<uint32_t[]> block_lengths;
+        size_t decoded_words;
+        fusion_stats fusions;
+    };
+    static std::mutex g_mutex;
+    static std::map<std::pair<rom_image const *, size_t>, decoded_image> g_decoded_images;
+
+    std::pair<rom_image const *, size_t> const key{image.get(), rom.size()};
+    {
+        std::lock_guard lock{g_mutex};
+        if (auto it = g_decoded_images.find(key);
+            it != g_decoded_images.end() && it->second.image.lock() == image) {
+            decoded_rom = it->second.decoded;
+            block_lengths = it->second.block_lengths;
+            decoded_words = it->second.decoded_words;
+            fusions = it->second.fusions;
+            return;
         }
-        case opcode::load: {
-            reg dest, addr;
-            word_t width;
-            instr.decode_load(&dest, &addr, &width);
-            execute_load(addr, dest, width);
-            break;
+    }
+
+    // Decoding is slow, so not under the lock. Two threads can race to decode the same image, in
+    // which case the last one in wins and the other just doesn't share.
+    allocate_decoded_rom();
+    predecode(0, image->size());
+
+    std::lock_guard lock{g_mutex};
+    std::erase_if(g_decoded_images, [](auto const & entry) { return entry.second.image.expired(); });
+    g_decoded_images.insert_or_assign(
+        key, decoded_image{image, decoded_rom, block_lengths, decoded_words, fusions});
+}
+
+void system_state::predecode(size_t offset, size_t num_bytes)
+{
+    size_t last = (offset + num_bytes + k_word_size - 1) / k_word_size;
+    assert(last <= rom_words());
+    unshare_decoded_rom();
+
+    // everything we decode has to be contiguous with what we've decoded before
+    size_t first = std::min(offset / k_word_size, decoded_words);
+
+    // the instruction just before the range may have been fused with the first one in it
+    size_t first_handler = first > 0 ? first - 1 : 0;
+    for (size_t i = first_handler; i < last; ++i) {
+        if (std::optional<fusion> f = find_fusion(decoded_rom[i], decoded_rom[i + 1])) {
+            --fusions.sites[std::to_underlying(*f)];
         }
-        case opcode::add: {
-            reg dest, op1;
-            instr.decode_add(&dest, &op1);
-            cpu.add(dest, op1);
-            break;
+    }
+
+    for (size_t i = first; i < last; ++i) {
+        word_t raw;
+        rom.read(i * k_word_size, &raw, sizeof(raw));
+        decoded_rom[i] = decode(instr{raw});
+    }
+    if (last > decoded_words) {
+        decoded_words = last;
+        mark_blank(last);
+    }
+
+    for (size_t i = first_handler; i < last; ++i) {
+        decoded_rom[i].handler = threaded_handler(decoded_rom[i], &decoded_rom[i + 1]);
+        if (std::optional<fusion> f = find_fusion(decoded_rom[i], decoded_rom[i + 1])) {
+            ++fusions.sites[std::to_underlying(*f)];
         }
-        case opcode::sub: {
-            reg dest, op1;
-            instr.decode_sub(&dest, &op1);
-            cpu.sub(dest, op1);
+    }
+
+    // a block's length depends on everything after it up to the next control transfer, so
+    // everything before the range may have changed too
+    for (size_t i = last; i-- > 0;) {
+        switch (decoded_rom[i].op) {
+        case opcode::jump:
+        case opcode::ijump:
+        case opcode::call:
+            block_lengths[i] = 1;
+            break;
+        case opcode::set:
+        case opcode::store:
+        case opcode::load:
+        case opcode::add:
+        case opcode::sub:
+        case opcode::compare:
+            block_lengths[i] = block_lengths[i + 1] + 1;
             break;
-        }
         case opcode::halt:
-            return;
-        case opcode::compare: {
-            reg op1, op2;
-            instr.decode_compare(&op1, &op2);
-            execute_compare(op1, op2);
+        default:
+            block_lengths[i] = 0;
             break;
         }
-        case opcode::jump: {
-            cmp_flag flag;
-            signed_word_t offset;
-            instr.decode_jump(&flag, &offset);
-            cpu.jump(flag, offset);
-            break;
+    }
+}
+
+void system_state::unshare_decoded_rom()
+{
+    // only what we've decoded, the blank word after it, and the sentinel at the end
+    size_t const used = std::min(decoded_words + 1, rom_words());
+    if (decoded_rom.use_count() > 1) {
+        auto decoded = make_zeroed<decoded_instr>(rom_words() + 1);
+        std::copy_n(decoded_rom.get(), used, decoded.get());
+        decoded[rom_words()] = decoded_rom[rom_words()];
+        decoded_rom = std::move(decoded);
+    }
+    if (block_lengths.use_count() > 1) {
+        auto lengths = make_zeroed<uint32_t>(rom_words() + 1);
+        std::copy_n(block_lengths.get(), used, lengths.get());
+        block_lengths = std::move(lengths);
+    }
+}
+
+run_status system_state::run()
+{
+    return run_bounded(k_unlimited, nullptr, std::nullopt);
+}
+
+run_status system_state::run_for(uint64_t max_instrs)
+{
+    return run_bounded(max_instrs, nullptr, std::nullopt);
+}
+
+run_status system_state::run_until(run_predicate const & predicate, uint64_t max_instrs)
+{
+    return run_bounded(max_instrs, &predicate, std::nullopt);
+}
+
+run_status system_state::run_until(word_t watch_addr, uint64_t max_instrs)
+{
+    return run_bounded(max_instrs, nullptr, watch_addr);
+}
+
+run_status system_state::run_bounded(uint64_t max_instrs,
+                                     run_predicate const * predicate,
+                                     std::optional<word_t> watch_addr)
+{
+    apply_memory_mode();
+
+    // a member rather than a local, so that it's all still there after the siglongjmp
+    fault_target.flat_base = flat ? flat->base() : nullptr;
+    if (sigsetjmp(fault_target.jmp, 0) != 0) {
+        pop_guest_fault_target(&fault_target);
+        clear_watch_trap();
+        fault_addr = fault_target.addr;
+        return run_status::faulted;
+    }
+    push_guest_fault_target(&fault_target);
+    run_status status = run_blocks(max_instrs, predicate, watch_addr);
+    pop_guest_fault_target(&fault_target);
+    return status;
+}
+
+void system_state::apply_memory_mode()
+{
+    bool want_flat = memory_mode == memory_mode::flat && flat_memory::supported();
+    if (want_flat == (flat != nullptr)) {
+        return;
+    }
+
+    std::unique_ptr<flat_memory> new_flat = want_flat ? std::make_unique<flat_memory>() : nullptr;
+    auto move_to_new = [&](paged_memory const & from, word_t guest_base, bool writable) {
+        paged_memory to = new_flat
+            ? paged_memory{new_flat->map(guest_base, from.size(), writable), from.size()}
+            : paged_memory{from.size()};
+        to.copy_from(from);
+        return to;
+    };
+    rom = move_to_new(rom, iomap::k_rom_base, false);
+    ram = move_to_new(ram, layout.ram_base(), true);
+    flat = std::move(new_flat);
+
+    // the TLB points into the old ones, and the JIT does things differently with flat memory
+    mmu.flush_tlb();
+    if (jit_cache) {
+        jit_cache->flush();
+    }
+}
+
+run_status system_state::run_blocks(uint64_t max_instrs,
+                                    run_predicate const * predicate,
+                                    std::optional<word_t> watch_addr)
+{
+    uint64_t remaining = max_instrs;
+
+    // we stopped here last time, so run it rather than stopping again straight away
+    bool step_over_watch = watch_addr && cpu.instr_ptr == *watch_addr;
+
+    while (true) {
+        word_t rom_offset = cpu.instr_ptr - iomap::k_rom_base;
+        assert(rom_offset < rom.size() && rom_offset % k_word_size == 0);
+        size_t index = rom_offset / k_word_size;
+
+        if (decoded_rom[index].op == opcode::halt) {
+            return run_status::halted;
         }
-        case opcode::ijump: {
-            cmp_flag flag;
-            reg loc;
-            instr.decode_ijump(&flag, &loc);
-            cpu.ijump(flag, loc);
-            break;
+        if (!step_over_watch) {
+            if (watch_addr && cpu.instr_ptr == *watch_addr) {
+                return run_status::trapped;
+            }
+            if (predicate && (*predicate)(*this)) {
+                return run_status::trapped;
+            }
         }
-        case opcode::call: {
-            signed_word_t offset;
-            instr.decode_call(&offset);
-            cpu.call(offset);
-            break;
+        if (remaining == 0) {
+            return run_status::budget_exhausted;
         }
-        default:
-            assert(false && "unknown opcode");
+
+        // Not enough budget left for the rest of the block, so finish off one instruction at a
+        // time. That happens at most once per call, unless there's a watch address to step over
+        // or we're running ROM that nobody wrote, which doesn't have any blocks.
+        uint64_t block_length = block_lengths[index];
+        if (step_over_watch || remaining < block_length || index >= decoded_words) {
+            step_interp();
+            --remaining;
+            step_over_watch = false;
+            continue;
         }
-        cpu.instr_ptr += k_word_size;
+
+        // with a predicate to check, only give the engine enough for one block
+        budget = predicate ? block_length : remaining;
+        uint64_t const given = budget;
+        run_engine(watch_addr);
+        remaining -= given - budget;
+    }
+}
+
+void system_state::run_engine(std::optional<word_t> watch_addr)
+{
+    switch (engine) {
+    case engine::interp:
+        run_interp(watch_addr);
+        break;
+    case engine::threaded:
+        run_threaded(watch_addr);
+        break;
+    case engine::jit:
+        // the JIT doesn't know how to stop in the middle of a block
+        if (watch_addr) {
+            run_threaded(watch_addr);
+        } else {
+            run_jit();
+        }
+        break;
     }
 }
 
+void system_state::run_interp(std::optional<word_t> watch_addr)
+{
+    // no blocks here, just count every instruction
+    while (budget > 0 && cpu.instr_ptr != watch_addr) {
+        if (!step_interp()) {
+            break;
+        }
+        --budget;
+    }
+}
+
+void system_state::run_jit()
+{
+    if (!jit::supported()) {
+        run_threaded(std::nullopt);
+        return;
+    }
+    if (!jit_cache) {
+        jit_cache = std::make_unique<jit>(rom_words());
+    }
+    jit_cache->run(this);
+}
+
+bool system_state::step_interp()
+{
+    word_t rom_offset = cpu.instr_ptr - iomap::k_rom_base;
+    assert(rom_offset < rom.size() && rom_offset % k_word_size == 0);
+    decoded_instr const & di = decoded_rom[rom_offset / k_word_size];
+    logger.debug("[ip={:#x}] executing {}", cpu.instr_ptr, di);
+    switch (di.op) {
+    case opcode::set:
+        execute_set(di.lhs, di.imm);
+        break;
+    case opcode::store:
+        execute_store(di.lhs, di.rhs, di.imm);
+        break;
+    case opcode::load:
+        execute_load(di.rhs, di.lhs, di.imm);
+        break;
+    case opcode::add:
+        cpu.add(di.lhs, di.rhs);
+        break;
+    case opcode::sub:
+        cpu.sub(di.lhs, di.rhs);
+        break;
+    case opcode::halt:
+        return false;
+    case opcode::compare:
+        execute_compare(di.lhs, di.rhs);
+        break;
+    case opcode::jump:
+        cpu.jump(di.flag, di.offset());
+        break;
+    case opcode::ijump:
+        cpu.ijump(di.flag, di.lhs);
+        break;
+    case opcode::call:
+        cpu.call(di.offset());
+        break;
+    default:
+        assert(false && "unknown opcode");
+    }
+    cpu.instr_ptr += k_word_size;
+    return true;
+}
+
 void system_state::execute_set(reg dest, word_t value)
 {
     cpu.get(dest) = value;
@@ -210,45 +605,102 @@ void system_state::execute_load_store(bool is_load, reg addr_reg, reg value_reg,
     execute_load_store_impl(is_load, addr, value, width);
 }
 
-void system_state::execute_load_store_impl(bool is_load, word_t addr, word_t * value, word_t width)
+template <word_t width, bool is_load>
+void system_state::access_memory(word_t addr, word_t * value)
 {
+    // aligned, so it never straddles a page
     assert(addr % width == 0);
 
-    // console hardware special case
-    if (addr >= iomap::k_console_base
-        && addr <= iomap::k_console_base + iomap::k_console_size - width) {
-        assert(width == 1 && is_load == false && addr == iomap::k_console_write);
-        console.push_back(static_cast<uint8_t>(*value));
+    // TODO: endian correctness
+    if (flat != nullptr && addr >= flat->direct_from()) {
+        // anything that isn't there faults in hardware
+        uint8_t * host = flat->base() + addr;
+        if constexpr (is_load) {
+            memcpy(value, host, width);
+        } else {
+            memcpy(host, value, width);
+        }
         return;
     }
 
-    uint8_t * mem_addr;
-    if (addr >= iomap::k_ram_base && addr <= iomap::k_ram_base + iomap::k_ram_size - width) {
-        mem_addr = ram.get() + (addr - iomap::k_ram_base);
-    } else if (addr >= iomap::k_rom_base && addr <= iomap::k_rom_base + iomap::k_rom_size - width) {
-        assert(is_load); // no writes to ROM
-        mem_addr = rom.get() + (addr - iomap::k_rom_base);
+    if constexpr (is_load) {
+        if (uint8_t const * host = mmu.tlb_read(addr)) [[likely]] {
+            memcpy(value, host, width);
+            return;
+        }
     } else {
-        assert(false);
+        if (uint8_t * host = mmu.tlb_write(addr)) [[likely]] {
+            memcpy(host, value, width);
+            return;
+        }
     }
+    execute_load_store_slow(is_load, addr, value, width);
+}
 
-    // TODO: endian correctness
+void system_state::execute_load_store_impl(bool is_load, word_t addr, word_t * value, word_t width)
+{
+    switch (width) {
+    case 1:
+        return is_load ? access_memory<1, true>(addr, value) : access_memory<1, false>(addr, value);
+    case 2:
+        return is_load ? access_memory<2, true>(addr, value) : access_memory<2, false>(addr, value);
+    case 4:
+        return is_load ? access_memory<4, true>(addr, value) : access_memory<4, false>(addr, value);
+    default:
+        assert(false && "bad width");
+    }
+}
+
+template <word_t width>
+void system_state::execute_store(reg addr_reg, reg value_reg)
+{
+    access_memory<width, false>(cpu.get(addr_reg), &cpu.get(value_reg));
+}
+
+template <word_t width>
+void system_state::execute_load(reg addr_reg, reg value_reg)
+{
+    access_memory<width, true>(cpu.get(addr_reg), &cpu.get(value_reg));
+}
+
+template void system_state::execute_store<1>(reg addr_reg, reg value_reg);
+template void system_state::execute_store<2>(reg addr_reg, reg value_reg);
+template void system_state::execute_store<4>(reg addr_reg, reg value_reg);
+template void system_state::execute_load<1>(reg addr_reg, reg value_reg);
+template void system_state::execute_load<2>(reg addr_reg, reg value_reg);
+template void system_state::execute_load<4>(reg addr_reg, reg value_reg);
+
+static_assert(std::size(instr::k_load_store_widths) == 3, "instantiate the new width above");
+
+void system_state::execute_load_store_slow(bool is_load, word_t addr, word_t * value, word_t width)
+{
+    page_table_entry const pte = mmu.lookup(addr);
+    switch (pte.kind) {
+    case page_kind::fault:
+        raise_guest_fault(addr);
+    case page_kind::device:
+        pte.device->access(is_load, addr - pte.device_base, value, width);
+        return;
+    case page_kind::memory:
+        break;
+    }
+
+    // e.g. a store to ROM
+    if (!(pte.perms & (is_load ? mmu::k_perm_read : mmu::k_perm_write))) {
+        raise_guest_fault(addr);
+    }
+
+    size_t offset = pte.memory_page * k_page_size + (addr & (k_page_size - 1));
     if (is_load) {
-        memcpy(value, mem_addr, width);
+        memcpy(value, pte.memory->read_ptr(offset), width);
     } else {
-        memcpy(mem_addr, value, width);
+        // copies the page if it's shared with a fork
+        memcpy(pte.memory->write_ptr(offset), value, width);
     }
+    mmu.fill_tlb(addr, pte);
 }
 
 void system_state::execute_compare(reg op1, reg op2)
 {
-    // clear invalid flag, flags are now valid
-    cpu.cpu_cmp_flags = 0;
-    if (cpu.get(op1) == cpu.get(op2)) {
-        cpu.set_cmp_flag(cpu_cmp_flags::eq);
-    } else if (cpu.get(op1) < cpu.get(op2)) {
-        cpu.set_cmp_flag(cpu_cmp_flags::lt);
-    } else {
-        cpu.set_cmp_flag(cpu_cmp_flags::gt);
-    }
+    cpu.compare(cpu.get(op1), cpu.get(op2));
 }
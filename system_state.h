@@ -1,16 +1,45 @@
+#pragma once
+
+#include "console.h"
 #include "cpu_base.h"
+#include "decoded_instr.h"
+#include "device.h"
+#include "flat_memory.h"
+#include "fusion.h"
+#include "guest_fault.h"
 #include "instr.h"
 #include "iomap.h"
+#include "jit.h"
+#include "mmu.h"
+#include "paged_memory.h"
 #include "reg.h"
+#include "rom_image.h"
 
 #include <cassert>
+#include <functional>
+#include <initializer_list>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <span>
 #include <stddef.h>
 #include <stdint.h>
 #include <vector>
 
+#define ENUM_DEF_FILE_NAME "engine_def.h"
+#include "enum_decl.h" // IWYU pragma: export
+
+// why system_state::run_for/run_until returned
+#define ENUM_DEF_FILE_NAME "run_status_def.h"
+#include "enum_decl.h" // IWYU pragma: export
+
+// how guest memory is laid out on the host, see system_state::memory_mode
+#define ENUM_DEF_FILE_NAME "memory_mode_def.h"
+#include "enum_decl.h" // IWYU pragma: export
+
+extern std::initializer_list<engine> const k_all_engines;
+
 enum class cpu_cmp_flags : uint8_t
 {
     invalid = 0,
@@ -33,6 +62,13 @@ struct cpu
         return registers[index];
     }
 
+    word_t get(reg reg) const
+    {
+        word_t index = std::to_underlying(reg);
+        assert(index < std::size(registers));
+        return registers[index];
+    }
+
     void add(reg dest, reg op1);
     void sub(reg dest, reg op1);
 
@@ -46,13 +82,45 @@ struct cpu
         return cpu_cmp_flags & (1 << static_cast<uint8_t>(flag));
     }
 
+    // set the flags from comparing two register values
+    void compare(word_t lhs, word_t rhs)
+    {
+        if (lhs == rhs) {
+            set_cmp_flag(cpu_cmp_flags::eq);
+        } else if (lhs < rhs) {
+            set_cmp_flag(cpu_cmp_flags::lt);
+        } else {
+            set_cmp_flag(cpu_cmp_flags::gt);
+        }
+    }
+
     void jump(cmp_flag flag, signed_word_t offset);
     void ijump(cmp_flag flag, reg loc);
 
-private:
-    bool is_taken(cmp_flag flag) const;
+    // inline so that it folds away when flag is a constant, see threaded.cpp
+    bool is_taken(cmp_flag flag) const
+    {
+        switch (flag) {
+        case instr::eq:
+            return get_cmp_flag(cpu_cmp_flags::eq);
+        case instr::ne:
+            return !get_cmp_flag(cpu_cmp_flags::eq);
+        case instr::gt:
+            return get_cmp_flag(cpu_cmp_flags::gt);
+        case instr::ge:
+            return get_cmp_flag(cpu_cmp_flags::gt) || get_cmp_flag(cpu_cmp_flags::eq);
+        case instr::lt:
+            return get_cmp_flag(cpu_cmp_flags::lt);
+        case instr::le:
+            return get_cmp_flag(cpu_cmp_flags::lt) || get_cmp_flag(cpu_cmp_flags::eq);
+        case instr::unc:
+            return true;
+        default:
+            assert(false);
+            return false;
+        }
+    }
 
-public:
     void call(signed_word_t offset);
 
     uint8_t cpu_cmp_flags;
@@ -62,22 +130,133 @@ public:
 
 struct system_state
 {
-    system_state(std::span<word_t const> program = {});
+    // Memory is allocated as the guest touches it, so a big layout doesn't cost any more to
+    // create than the default one.
+    system_state(std::span<word_t const> program = {}, memory_layout layout = {});
+
+    // mmu points into rom and ram, so these stay put. See fork() for copies.
+    system_state(system_state const &) = delete;
+    system_state & operator=(system_state const &) = delete;
 
     void set_rom(std::span<word_t const> program);
     void set_rom(std::span<uint8_t const> program);
     void set_rom(std::vector<instr> program);
 
+    // Make ROM image's contents, and zeros after that, without copying it: ROM reads straight out
+    // of the image until something writes a page of it, and so do forks. Every system_state that
+    // loads the same image with the same ROM size shares one decoded copy of it too, so only the
+    // first one pays for decoding it. Flat memory can't point at the image, so it gets a copy.
+    void load_rom(std::shared_ptr<rom_image const> image);
+
+    // A new system_state that picks up exactly where this one is. ROM and RAM pages are shared
+    // with this one copy-on-write and so is the decoded ROM, so this is cheap enough to start
+    // thousands of children from one warmed up state: each only pays for the pages it writes.
+    // The child gets its own JIT, which starts out empty.
+    system_state fork();
+
+    // Put dev at [base, base + size) in the guest address space, see device_bus for where it
+    // can go. Forks made after this get the same device.
+    void attach_device(word_t base, word_t size, std::shared_ptr<device> dev);
+
 private:
+    struct fork_tag
+    { };
+    system_state(system_state & parent, fork_tag);
+
+    // lay out the guest address space as in iomap.h and layout
+    void map_memory();
+
+    // start decoded_rom and friends off as for a ROM nobody has written, without decoding any of it
+    void allocate_decoded_rom();
+
+    // make ROM word index the blank one just past decoded_words, if there is one
+    void mark_blank(size_t index);
+
     void set_rom(void const * prog, size_t num_bytes);
 
+    // refresh decoded_rom for the ROM bytes [offset, offset + num_bytes)
+    void predecode(size_t offset, size_t num_bytes);
+
+    // share decoded_rom and friends with everyone else who loaded image, or decode it
+    void decode_image(std::shared_ptr<rom_image const> const & image);
+
+    // copy decoded_rom (and block_lengths) if a fork is still using it, before changing it
+    void unshare_decoded_rom();
+
+public:
+    static uint64_t constexpr k_unlimited = std::numeric_limits<uint64_t>::max();
+
+    using run_predicate = std::function<bool(system_state const &)>;
+
+    // Run until the guest halts (or faults), using whichever engine is selected.
+    run_status run();
+
+    // Run at most max_instrs instructions (the halt itself doesn't count) and say why we stopped.
+    // Everything needed to continue is in cpu, so calling any of these again picks up exactly
+    // where the last call left off.
+    //
+    // Unless the guest faulted, see guest_fault.h: then fault_addr says where, but only
+    // engine::interp leaves cpu at the instruction that did it. The others leave it wherever they
+    // last wrote it back.
+    run_status run_for(uint64_t max_instrs);
+
+    // Like run_for, but also stop once predicate returns true. It's checked before the first
+    // instruction and then whenever a block (a straight line run ending in jump/ijump/call) is
+    // entered, not after every instruction.
+    run_status run_until(run_predicate const & predicate, uint64_t max_instrs = k_unlimited);
+
+    // Like run_for, but also stop right in front of the instruction at watch_addr. If we're
+    // already there it runs first, so calling this again finds the next visit.
+    run_status run_until(word_t watch_addr, uint64_t max_instrs = k_unlimited);
+
+private:
+    // catches guest faults for run_blocks
+    run_status run_bounded(uint64_t max_instrs,
+                           run_predicate const * predicate,
+                           std::optional<word_t> watch_addr);
+    run_status run_blocks(uint64_t max_instrs,
+                          run_predicate const * predicate,
+                          std::optional<word_t> watch_addr);
+
+    // move rom and ram to wherever memory_mode says they should be
+    void apply_memory_mode();
+
+    // Run the selected engine until it halts, runs into watch_addr, or reaches the start of a
+    // block it doesn't have the budget for. Each engine only checks the budget when entering a
+    // block and then charges for the whole block at once.
+    void run_engine(std::optional<word_t> watch_addr);
+
+    // The switch-based interpreter. Slowest, but it's the reference for every other engine.
+    void run_interp(std::optional<word_t> watch_addr);
+
+    // Direct-threaded interpreter, see threaded.cpp.
+    void run_threaded(std::optional<word_t> watch_addr);
+
+    // Point the instruction at watch_addr at a handler that stops the threaded engine, and put it
+    // back. Also in threaded.cpp.
+    void set_watch_trap(word_t watch_addr);
+    void clear_watch_trap();
+
+    // Translate to host code as we go, see jit.cpp. Falls back to run_threaded() on hosts the JIT
+    // doesn't support.
+    void run_jit();
+
 public:
-    void run();
+    // Execute the single instruction at cpu.instr_ptr with the reference interpreter. Returns
+    // false if it was a halt.
+    bool step_interp();
 
     void execute_set(reg dest, word_t value);
     void execute_store(reg addr_reg, reg value_reg, word_t width);
     void execute_load(reg addr_reg, reg value_reg, word_t width);
 
+    // The same with the width fixed at compile time, so there's nothing left to dispatch on. Only
+    // instantiated for instr::k_load_store_widths.
+    template <word_t width>
+    void execute_store(reg addr_reg, reg value_reg);
+    template <word_t width>
+    void execute_load(reg addr_reg, reg value_reg);
+
     void raw_store(word_t addr, word_t value);
     word_t raw_load(word_t addr);
 
@@ -85,11 +264,88 @@ private:
     void execute_load_store(bool is_load, reg addr_reg, reg value_reg, word_t width);
     void execute_load_store_impl(bool is_load, word_t addr, word_t * value, word_t width);
 
+    // what execute_load_store_impl does once it knows the width
+    template <word_t width, bool is_load>
+    void access_memory(word_t addr, word_t * value);
+
+    // anything the TLB doesn't have: walk the page table, and fill the TLB if it's memory
+    void execute_load_store_slow(bool is_load, word_t addr, word_t * value, word_t width);
+
 public:
     void execute_compare(reg op1, reg op2);
 
+    // Everything the guest has written to the console, unless console_io has been given another
+    // sink (e.g. an fd_sink, to stream it instead of keeping it all). Forks start out writing here
+    // whatever their parent's sink is.
     std::vector<uint8_t> console;
-    std::unique_ptr<uint8_t[]> rom;
-    std::unique_ptr<uint8_t[]> ram;
+    console_device console_io{console};
+
+    // every other device, see attach_device
+    device_bus devices;
+
+    memory_layout const layout;
+    paged_memory rom;
+    paged_memory ram;
+
+    // where every guest address goes: rom, ram, or a device
+    mmu mmu;
+
+    size_t rom_words() const
+    {
+        return rom.size() / k_word_size;
+    }
+
+    // one entry per ROM word, kept in sync with rom by set_rom. ROM is never written by the guest,
+    // so run() can fetch from here instead of decoding rom on every instruction.
+    // The extra entry at the end catches execution running off the end of ROM.
+    // Shared with forks until either side changes it.
+    std::shared_ptr<decoded_instr[]> decoded_rom;
+
+    // For each ROM word, how many instructions run from there up to and including the end of its
+    // block, i.e. the next jump/ijump/call. A halt or anything invalid also ends a block but isn't
+    // counted, and so does the end of decoded_words. Same size as decoded_rom, and shared along
+    // with it.
+    std::shared_ptr<uint32_t[]> block_lengths;
+
+    // How much of decoded_rom is actually decoded. Nobody has written the ROM after that, so it's
+    // all zeros, which decode to zeros apart from the handler: the word just past the end has
+    // one that stops the threaded engine, and the rest have none. run() leaves all of that to the
+    // interpreter, so creating a state doesn't cost anything per ROM word.
+    size_t decoded_words = 0;
+
+    // How many more instructions the running engine may execute, see run_engine.
+    uint64_t budget = k_unlimited;
+
     cpu cpu;
+
+    // What the superinstructions in decoded_rom are and how often the threaded engine ran them.
+    fusion_stats fusions;
+
+    // Defaults to $CPU_ENGINE if set, otherwise the threaded engine.
+    engine engine;
+
+    // Defaults to $CPU_MEMORY if set, otherwise paged. Takes effect the next time we run, and
+    // falls back to paged on hosts without flat memory.
+    memory_mode memory_mode;
+
+    // set while rom and ram live in flat memory
+    std::unique_ptr<flat_memory> flat;
+
+    // the guest address of the last access that faulted
+    word_t fault_addr = 0;
+
+    // created the first time we run with engine::jit
+    std::unique_ptr<jit> jit_cache;
+
+private:
+    // what set_watch_trap replaced
+    struct trap_state
+    {
+        decoded_instr * watched = nullptr;
+        instr_handler saved[2]{};
+    };
+    trap_state watch_trap;
+
+    // where faults go while we run, see run_bounded
+    guest_fault_target fault_target;
 };
@@ -0,0 +1,159 @@
+#include "bench.h"
+#include "flat_memory.h"
+#include "fusion.h"
+#include "log.h"
+#include "reg.h"
+#include "rom_image.h"
+#include "system_state.h"
+#include "test_programs.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <unistd.h>
+#include <vector>
+
+static logger logger{__FILE__};
+
+static void bench_engines(std::vector<uint8_t> const & rom,
+                          word_t arg,
+                          reg result_reg,
+                          word_t expected,
+                          memory_mode mode = memory_mode::paged)
+{
+    std::chrono::nanoseconds reference{};
+    for (engine eng : k_all_engines) {
+        std::chrono::nanoseconds per_run = time_per_call([&] {
+            system_state state{};
+            state.engine = eng;
+            state.memory_mode = mode;
+            state.set_rom(rom);
+            state.cpu.get(r0) = arg;
+            state.run();
+            if (state.cpu.get(result_reg) != expected) {
+                logger.abort("{} computed the wrong result", to_str(eng));
+            }
+        });
+        if (eng == engine::interp) {
+            reference = per_run;
+        }
+        logger.info("  {:>10}: {:>12} ns/run, {:.2f}x interp",
+                    to_str(eng),
+                    per_run.count(),
+                    static_cast<double>(reference.count()) / per_run.count());
+    }
+
+    system_state state{};
+    state.engine = engine::threaded;
+    state.set_rom(rom);
+    state.cpu.get(r0) = arg;
+    state.run();
+    logger.info("  fusion: {}", state.fusions);
+}
+
+BENCH("system_state.branchy")
+{
+    word_t const iterations = 1 << 18;
+    bench_engines(make_branchy_rom(iterations), 0, r0, iterations);
+}
+
+BENCH("system_state.fib")
+{
+    word_t const n = 20;
+    bench_engines(make_fib_rom(), n, r13, host_fib(n));
+}
+
+BENCH("system_state.fib.flat")
+{
+    if (!flat_memory::supported()) {
+        return;
+    }
+    word_t const n = 20;
+    bench_engines(make_fib_rom(), n, r13, host_fib(n), memory_mode::flat);
+}
+
+BENCH("system_state.fork")
+{
+    // lots of short runs: starting each one from scratch vs forking a state that's all set up
+    word_t const n = 8;
+    std::vector<uint8_t> rom = make_fib_rom();
+    std::chrono::nanoseconds fresh = time_per_call([&] {
+        system_state state{};
+        state.set_rom(rom);
+        state.cpu.get(r0) = n;
+        state.run();
+        if (state.cpu.get(r13) != host_fib(n)) {
+            logger.abort("computed the wrong result");
+        }
+    });
+
+    system_state parent{};
+    parent.set_rom(rom);
+    parent.cpu.get(r0) = n;
+    std::chrono::nanoseconds forked = time_per_call([&] {
+        system_state child = parent.fork();
+        child.run();
+        if (child.cpu.get(r13) != host_fib(n)) {
+            logger.abort("computed the wrong result");
+        }
+    });
+    logger.info("  fresh: {:>8} ns/run, forked: {:>8} ns/run, {:.2f}x",
+                fresh.count(),
+                forked.count(),
+                static_cast<double>(fresh.count()) / forked.count());
+}
+
+BENCH("system_state.create")
+{
+    // memory only costs anything once it's touched, and ROM is only decoded once it's written, so
+    // these should all be about the same
+    for (word_t size : {k_page_size, word_t{1} << 20, word_t{256} << 20}) {
+        memory_layout layout;
+        layout.ram_size = size;
+        std::chrono::nanoseconds ram_state = time_per_call([&] { system_state state{{}, layout}; });
+        layout = {};
+        layout.rom_size = size;
+        std::chrono::nanoseconds rom_state = time_per_call([&] { system_state state{{}, layout}; });
+        logger.info("  {:>10} bytes of RAM: {:>8} ns/state, of ROM: {:>8} ns/state",
+                    size,
+                    ram_state.count(),
+                    rom_state.count());
+    }
+}
+
+BENCH("system_state.load_rom")
+{
+    // copying and decoding costs as much as the program is big, loading an image shouldn't
+    memory_layout layout;
+    layout.rom_size = word_t{16} << 20;
+    std::vector<uint8_t> const fib = make_fib_rom();
+    for (size_t rom_bytes : {size_t{64} << 10, size_t{1} << 20, size_t{8} << 20}) {
+        std::vector<uint8_t> rom;
+        while (rom.size() + fib.size() <= rom_bytes) {
+            rom.insert(rom.end(), fib.begin(), fib.end());
+        }
+
+        char path[] = "/tmp/system_state_bench.XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0 || write(fd, rom.data(), rom.size()) != static_cast<ssize_t>(rom.size())) {
+            logger.abort("couldn't write {}", path);
+        }
+        close(fd);
+        std::shared_ptr<rom_image const> image = rom_image::open(path);
+        unlink(path);
+
+        std::chrono::nanoseconds copied = time_per_call([&] {
+            system_state state{{}, layout};
+            state.set_rom(rom);
+        });
+        std::chrono::nanoseconds loaded = time_per_call([&] {
+            system_state state{{}, layout};
+            state.load_rom(image);
+        });
+        logger.info("  {:>10} bytes: set_rom {:>10} ns, load_rom {:>8} ns",
+                    rom.size(),
+                    copied.count(),
+                    loaded.count());
+    }
+}
@@ -1,11 +1,19 @@
 #include "assembler.h"
+#include "device.h"
+#include "fusion.h"
 #include "instr.h"
 #include "iomap.h"
 #include "system_state.h"
 #include "test.h"
+#include "test_programs.h"
 
 #include <cassert>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <random>
 #include <utility>
+#include <vector>
 
 TEST("system_state.execute.load_store")
 {
@@ -200,3 +208,594 @@ ijump r15
     state.run();
     assert(state.cpu.get(r1) == 12);
 }
+
+// Every engine has to agree with the reference interpreter on the full architectural state.
+TEST("system_state.engines.agree")
+{
+    char const * prog = R"(
+set r1 40
+set r2 1
+set r3 3
+set r0 0
+loop:
+add r0 r2
+compare r0 r3
+jump.lt skip
+call bump
+skip:
+compare r0 r1
+jump.ne loop
+halt
+bump:
+add r4 r2
+add r3 r3
+ijump r15
+)";
+    std::vector<uint8_t> rom = assemble(prog);
+
+    system_state reference{};
+    reference.engine = engine::interp;
+    reference.set_rom(rom);
+    reference.run();
+    assert(reference.cpu.get(r0) == 40);
+
+    for (engine eng : k_all_engines) {
+        system_state state{};
+        state.engine = eng;
+        state.set_rom(rom);
+        state.run();
+        assert(state.cpu.instr_ptr == reference.cpu.instr_ptr);
+        assert(state.cpu.cpu_cmp_flags == reference.cpu.cpu_cmp_flags);
+        for (reg rr : k_all_registers) {
+            assert(state.cpu.get(rr) == reference.cpu.get(rr));
+        }
+    }
+}
+
+TEST("system_state.threaded.fusion")
+{
+    char const * prog = R"(
+set r1 98304
+set r2 1
+set r6 5
+jump.unc mid
+loop:
+set r3 5
+mid:
+add r0 r3
+set r4 2
+sub r0 r4
+add r7 r2
+set r5 65
+store.1 r1 r5
+compare r7 r6
+jump.lt loop
+halt
+)";
+    std::vector<uint8_t> rom = assemble(prog);
+
+    system_state reference{};
+    reference.engine = engine::interp;
+    reference.set_rom(rom);
+    reference.run();
+
+    system_state state{};
+    state.engine = engine::threaded;
+    state.set_rom(rom);
+    for (size_t sites : state.fusions.sites) {
+        assert(sites == 1);
+    }
+    state.run();
+
+    // the first time through we jump straight to the second half of the set/add pair
+    auto executed = [&](fusion f) { return state.fusions.executed[std::to_underlying(f)]; };
+    assert(executed(fusion::set_add) == 4);
+    assert(executed(fusion::set_sub) == 5);
+    assert(executed(fusion::set_store) == 5);
+    assert(executed(fusion::compare_jump) == 5);
+    assert(state.fusions.dispatches_saved() == 19);
+
+    assert(state.cpu.instr_ptr == reference.cpu.instr_ptr);
+    assert(state.cpu.cpu_cmp_flags == reference.cpu.cpu_cmp_flags);
+    for (reg rr : k_all_registers) {
+        assert(state.cpu.get(rr) == reference.cpu.get(rr));
+    }
+    assert(*state.ram.read_ptr(0) == 65);
+
+    // overwriting either half of a pair has to unfuse it, everything past the new ROM is left as is
+    state.set_rom(std::vector<instr>(6, instr::halt()));
+    assert(state.fusions.sites[std::to_underlying(fusion::set_add)] == 0);
+    assert(state.fusions.sites[std::to_underlying(fusion::set_sub)] == 1);
+    assert(state.decoded_rom[4].handler == state.decoded_rom[0].handler);
+}
+
+TEST("system_state.threaded.specialized")
+{
+    // random straight line code, so that between them the programs hit most of the specialized
+    // handlers in threaded.cpp
+    std::vector<reg> const regs{k_all_registers};
+    std::vector<cmp_flag> const flags{instr::k_all_cmp_flags};
+    auto pick_reg = [&] {
+        return regs[std::uniform_int_distribution{size_t{0}, regs.size() - 1}(test_rng())];
+    };
+
+    for (int iteration = 0; iteration < 500; ++iteration) {
+        std::vector<instr> program;
+        for (int i = 0; i < 64; ++i) {
+            switch (std::uniform_int_distribution{0, 4}(test_rng())) {
+            case 0:
+                program.push_back(instr::set(
+                    pick_reg(),
+                    std::uniform_int_distribution{0U, instr::k_max_set_value}(test_rng())));
+                break;
+            case 1:
+                program.push_back(instr::add(pick_reg(), pick_reg()));
+                break;
+            case 2:
+                program.push_back(instr::sub(pick_reg(), pick_reg()));
+                break;
+            case 3:
+                program.push_back(instr::compare(pick_reg(), pick_reg()));
+                break;
+            case 4:
+                // skip the next instruction
+                program.push_back(instr::jump(
+                    flags[std::uniform_int_distribution{size_t{0}, flags.size() - 1}(test_rng())],
+                    2 * k_word_size));
+                break;
+            }
+        }
+        program.push_back(instr::halt());
+        program.push_back(instr::halt());
+
+        system_state reference{};
+        reference.engine = engine::interp;
+        reference.set_rom(program);
+        reference.run();
+
+        system_state state{};
+        state.engine = engine::threaded;
+        state.set_rom(program);
+        state.run();
+
+        assert(state.cpu.instr_ptr == reference.cpu.instr_ptr);
+        assert(state.cpu.cpu_cmp_flags == reference.cpu.cpu_cmp_flags);
+        for (reg rr : k_all_registers) {
+            assert(state.cpu.get(rr) == reference.cpu.get(rr));
+        }
+    }
+}
+
+static void assert_same_cpu(system_state const & lhs, system_state const & rhs)
+{
+    assert(lhs.cpu.instr_ptr == rhs.cpu.instr_ptr);
+    assert(lhs.cpu.cpu_cmp_flags == rhs.cpu.cpu_cmp_flags);
+    for (size_t i = 0; i < k_num_registers; ++i) {
+        assert(lhs.cpu.registers[i] == rhs.cpu.registers[i]);
+    }
+}
+
+TEST("system_state.threaded.widths")
+{
+    // each width gets its own load and store handler (and set/store pair), picked at decode time
+    for (word_t width : instr::k_load_store_widths) {
+        std::vector<instr> const program{
+            instr::set(r0, iomap::k_ram_base + 8),
+            instr::set(r1, 0xabcde),
+            instr::store(r0, r1, width),
+            instr::set(r2, 0x77777),
+            instr::load(r2, r0, width),
+            instr::store(r0, r1, width),
+            instr::halt(),
+        };
+
+        system_state reference{};
+        reference.engine = engine::interp;
+        reference.set_rom(program);
+        reference.run();
+
+        system_state state{};
+        state.engine = engine::threaded;
+        state.set_rom(program);
+        state.run();
+
+        assert_same_cpu(state, reference);
+        assert(state.ram == reference.ram);
+        // narrow loads leave the rest of the register alone
+        word_t const mask = width == k_word_size ? ~word_t{0} : (word_t{1} << (8 * width)) - 1;
+        assert(state.cpu.get(r2) == ((0x77777 & ~mask) | (0xabcde & mask)));
+        assert(state.fusions.executed[std::to_underlying(fusion::set_store)] == 1);
+    }
+
+    system_state state{};
+    state.set_rom({
+        instr::store1(r0, r1),
+        instr::store2(r0, r1),
+        instr::store4(r0, r1),
+        instr::store4(r2, r3),
+        instr::halt(),
+    });
+    assert(state.decoded_rom[0].handler != state.decoded_rom[1].handler);
+    assert(state.decoded_rom[1].handler != state.decoded_rom[2].handler);
+    assert(state.decoded_rom[2].handler == state.decoded_rom[3].handler);
+}
+
+TEST("system_state.run_for")
+{
+    word_t const n = 10;
+    std::vector<uint8_t> rom = make_fib_rom();
+
+    for (uint64_t budget : {0, 1, 2, 5, 17, 100, 1000, 2345}) {
+        // reference: exactly budget instructions, one at a time
+        system_state reference{};
+        reference.set_rom(rom);
+        reference.cpu.get(r0) = n;
+        for (uint64_t i = 0; i < budget; ++i) {
+            reference.step_interp();
+        }
+
+        for (engine eng : k_all_engines) {
+            system_state state{};
+            state.engine = eng;
+            state.set_rom(rom);
+            state.cpu.get(r0) = n;
+            assert(state.run_for(budget) == run_status::budget_exhausted);
+            assert_same_cpu(state, reference);
+
+            // and it picks up where it left off
+            run_status status;
+            do {
+                status = state.run_for(budget + 1);
+            } while (status == run_status::budget_exhausted);
+            assert(status == run_status::halted);
+            assert(state.cpu.get(r13) == host_fib(n));
+            assert(state.run_for(budget) == run_status::halted);
+        }
+    }
+}
+
+TEST("system_state.run_until.predicate")
+{
+    word_t const n = 10;
+    std::vector<uint8_t> rom = make_fib_rom();
+    auto deep = [](system_state const & state) {
+        return state.cpu.get(r14) >= iomap::k_ram_base + 5 * 2 * k_word_size;
+    };
+
+    std::optional<system_state> reference;
+    for (engine eng : k_all_engines) {
+        system_state state{};
+        state.engine = eng;
+        state.set_rom(rom);
+        state.cpu.get(r0) = n;
+        assert(state.run_until(deep) == run_status::trapped);
+        assert(deep(state));
+
+        // the predicate is checked at the same places whatever the engine
+        if (reference) {
+            assert_same_cpu(state, *reference);
+        } else {
+            reference.emplace();
+            reference->cpu = state.cpu;
+        }
+
+        // it's still true, so we don't get anywhere until we stop asking
+        assert(state.run_until(deep) == run_status::trapped);
+        assert(state.run_until(deep, 0) == run_status::trapped);
+        assert(state.run_for(0) == run_status::budget_exhausted);
+        state.run();
+        assert(state.cpu.get(r13) == host_fib(n));
+    }
+}
+
+TEST("system_state.run_until.watch")
+{
+    word_t const n = 10;
+    std::vector<uint8_t> rom = make_fib_rom();
+
+    // fib: is the fourth instruction. Watch its first instruction, one in the middle of the block
+    // and the jump.gt, which gets fused with the compare in front of it.
+    word_t const fib_addr = iomap::k_rom_base + 3 * k_word_size;
+    for (word_t watch : {fib_addr, fib_addr + k_word_size, fib_addr + 2 * k_word_size}) {
+        for (engine eng : k_all_engines) {
+            system_state state{};
+            state.engine = eng;
+            state.set_rom(rom);
+            state.cpu.get(r0) = n;
+
+            word_t visits = 0;
+            run_status status;
+            while ((status = state.run_until(watch)) == run_status::trapped) {
+                assert(state.cpu.instr_ptr == watch);
+                ++visits;
+            }
+            assert(status == run_status::halted);
+            assert(visits == 2 * host_fib(n) - 1);
+            assert(state.cpu.get(r13) == host_fib(n));
+
+            // the watch is gone once we return
+            state.cpu.instr_ptr = iomap::k_rom_base;
+            state.cpu.get(r0) = n;
+            state.run();
+            assert(state.cpu.get(r13) == host_fib(n));
+        }
+    }
+}
+
+TEST("system_state.fork")
+{
+    word_t const n = 10;
+    word_t const fib_addr = iomap::k_rom_base + 3 * k_word_size;
+
+    // flat memory copies rather than sharing
+    system_state parent{};
+    parent.memory_mode = memory_mode::paged;
+    parent.set_rom(make_fib_rom());
+    parent.cpu.get(r0) = n;
+    assert(parent.run_for(500) == run_status::budget_exhausted);
+    system_state snapshot = parent.fork();
+
+    for (engine eng : k_all_engines) {
+        system_state child = parent.fork();
+        child.engine = eng;
+        assert_same_cpu(child, parent);
+        assert(child.ram == parent.ram);
+        assert(child.decoded_rom == parent.decoded_rom);
+
+        // the watch mustn't show up in the decoded ROM the parent runs, see below
+        assert(child.run_until(fib_addr) == run_status::trapped);
+
+        // the stack is the only thing written, all in one page
+        child.run();
+        assert(child.cpu.get(r13) == host_fib(n));
+        assert(child.ram.num_copied_pages() == 1);
+        assert(child.rom.num_copied_pages() == 0);
+    }
+
+    // none of that touched the parent, which finishes just the same
+    assert(parent.ram == snapshot.ram);
+    assert(parent.ram.num_copied_pages() == 0);
+    assert_same_cpu(parent, snapshot);
+    parent.run();
+    assert(parent.cpu.get(r13) == host_fib(n));
+    assert(parent.ram.num_copied_pages() == 1);
+}
+
+TEST("system_state.fault")
+{
+    // a store to ROM, a load from way past RAM, and a load from below everything
+    word_t const rom_addr = iomap::k_rom_base + 8;
+    word_t const high_addr = instr::k_max_set_value & ~(k_word_size - 1);
+    for (word_t addr : {rom_addr, high_addr, word_t{0}}) {
+        std::vector<instr> prog{instr::set(r0, addr), instr::set(r1, 1)};
+        prog.push_back(addr == rom_addr ? instr::store4(r0, r1) : instr::load4(r1, r0));
+        prog.push_back(instr::halt());
+
+        for (memory_mode mode : {memory_mode::paged, memory_mode::flat}) {
+            for (engine eng : k_all_engines) {
+                system_state state{};
+                state.engine = eng;
+                state.memory_mode = mode;
+                state.set_rom(prog);
+                assert(state.run() == run_status::faulted);
+                assert(state.fault_addr == addr);
+                if (eng == engine::interp) {
+                    assert(state.cpu.instr_ptr == iomap::k_rom_base + 2 * k_word_size);
+                }
+            }
+        }
+    }
+}
+
+TEST("system_state.blank_rom")
+{
+    // ROM nobody wrote runs as set r0 0, both falling into it from the program and jumping into
+    // the middle of it
+    word_t const blank_addr = iomap::k_rom_base + 100 * k_word_size;
+    std::vector<instr> const prog{instr::set(r0, 5), instr::set(r1, 7)};
+    std::vector<instr> const jump_prog{instr::set(r0, 5), instr::jump(instr::unc, 50 * k_word_size)};
+    for (memory_mode mode : {memory_mode::paged, memory_mode::flat}) {
+        for (engine eng : k_all_engines) {
+            system_state state{};
+            state.engine = eng;
+            state.memory_mode = mode;
+            state.set_rom(prog);
+            assert(state.decoded_words == prog.size());
+            assert(state.run_for(4) == run_status::budget_exhausted);
+            assert(state.cpu.instr_ptr == iomap::k_rom_base + 4 * k_word_size);
+            assert(state.cpu.get(r0) == 0 && state.cpu.get(r1) == 7);
+
+            system_state jumper{};
+            jumper.engine = eng;
+            jumper.memory_mode = mode;
+            jumper.set_rom(jump_prog);
+            assert(jumper.run_until(blank_addr) == run_status::trapped);
+            assert(jumper.cpu.get(r0) == 0);
+        }
+    }
+}
+
+TEST("system_state.data_in_rom")
+{
+    // data after the code that looks like a store and a load with a width that doesn't exist,
+    // which is fine as long as nobody runs it
+    std::vector<instr> const prog{instr::set(r0, 7), instr::halt(), instr{0x30001}, instr{0x30002}};
+    for (memory_mode mode : {memory_mode::paged, memory_mode::flat}) {
+        for (engine eng : k_all_engines) {
+            system_state state{};
+            state.engine = eng;
+            state.memory_mode = mode;
+            state.set_rom(prog);
+            assert(state.run() == run_status::halted);
+            assert(state.cpu.get(r0) == 7);
+        }
+    }
+}
+
+TEST("system_state.flat_memory")
+{
+    if (!flat_memory::supported()) {
+        return;
+    }
+
+    word_t const n = 12;
+    system_state reference{};
+    reference.memory_mode = memory_mode::paged;
+    reference.set_rom(make_fib_rom());
+    reference.cpu.get(r0) = n;
+    reference.run();
+
+    for (engine eng : k_all_engines) {
+        system_state state{};
+        state.engine = eng;
+        state.memory_mode = memory_mode::flat;
+        state.set_rom(make_fib_rom());
+        state.cpu.get(r0) = n;
+
+        // switch over halfway, and a fork of a flat state is flat too
+        assert(state.run_for(1000) == run_status::budget_exhausted);
+        assert(state.flat != nullptr);
+        system_state child = state.fork();
+        assert(state.run() == run_status::halted);
+        assert_same_cpu(state, reference);
+        assert(state.ram == reference.ram);
+
+        assert(child.run() == run_status::halted);
+        assert(child.flat != nullptr && child.flat->base() != state.flat->base());
+        assert_same_cpu(child, reference);
+        assert(child.ram == reference.ram);
+
+        // and back again
+        state.memory_mode = memory_mode::paged;
+        state.cpu = cpu{};
+        state.cpu.get(r0) = n;
+        assert(state.run() == run_status::halted);
+        assert(state.flat == nullptr);
+        assert_same_cpu(state, reference);
+    }
+}
+
+namespace
+{
+    // remembers what was stored to each word, and counts every access
+    struct scratch_device : device
+    {
+        void access(bool is_load, word_t offset, word_t * value, word_t width) override
+        {
+            assert(width == k_word_size && offset / k_word_size < std::size(words));
+            if (is_load) {
+                *value = words[offset / k_word_size];
+            } else {
+                words[offset / k_word_size] = *value;
+            }
+            ++accesses;
+        }
+
+        word_t words[16]{};
+        size_t accesses = 0;
+    };
+}
+
+TEST("system_state.devices")
+{
+    word_t const base = iomap::k_io_base + k_page_size;
+    std::vector<instr> const prog{
+        instr::set(r0, base + 8),
+        instr::set(r1, 77),
+        instr::set(r3, iomap::k_ram_base),
+        instr::store4(r3, r1),
+        instr::store4(r0, r1),
+        instr::load4(r2, r0),
+        instr::load4(r4, r3),
+        instr::set(r5, iomap::k_console_write),
+        instr::store1(r5, r1),
+        instr::halt(),
+    };
+
+    for (memory_mode mode : {memory_mode::paged, memory_mode::flat}) {
+        for (engine eng : k_all_engines) {
+            auto dev = std::make_shared<scratch_device>();
+            system_state state{};
+            state.engine = eng;
+            state.memory_mode = mode;
+            state.attach_device(base, k_page_size, dev);
+            state.set_rom(prog);
+            assert(state.run() == run_status::halted);
+
+            // RAM never goes anywhere near the device
+            assert(dev->accesses == 2);
+            assert(dev->words[2] == 77);
+            assert(state.cpu.get(r2) == 77 && state.cpu.get(r4) == 77);
+            assert(state.console == std::vector<uint8_t>{77});
+
+            // forks share devices, but each writes its own console
+            system_state child = state.fork();
+            child.cpu.instr_ptr = iomap::k_rom_base;
+            assert(child.run() == run_status::halted);
+            assert(dev->accesses == 4);
+            assert((child.console == std::vector<uint8_t>{77, 77}));
+            assert(state.console.size() == 1);
+        }
+    }
+
+    // devices go in between the first page and the console, a page at a time
+    system_state state{};
+    auto const dev = std::make_shared<scratch_device>();
+    state.attach_device(iomap::k_io_base, k_page_size, dev);
+    state.set_rom({instr::set(r0, iomap::k_io_base), instr::load4(r1, r0), instr::halt()});
+    assert(state.run() == run_status::halted);
+    assert(dev->accesses == 1);
+}
+
+TEST("system_state.memory_layout")
+{
+    memory_layout layout;
+    layout.rom_size = 4 * k_page_size;
+    layout.ram_size = word_t{256} << 20;
+    assert(layout.valid());
+
+    // the far end of RAM, and just past it
+    word_t const last_word = layout.ram_base() + layout.ram_size - k_word_size;
+    std::vector<instr> const prog{
+        instr::store4(r0, r1),
+        instr::load4(r2, r0),
+        instr::load4(r3, r4),
+        instr::halt(),
+    };
+
+    for (memory_mode mode : {memory_mode::paged, memory_mode::flat}) {
+        for (engine eng : k_all_engines) {
+            system_state state{{}, layout};
+            state.engine = eng;
+            state.memory_mode = mode;
+            state.set_rom(prog);
+            state.cpu.get(r0) = last_word;
+            state.cpu.get(r1) = 1234;
+            state.cpu.get(r4) = iomap::k_rom_base + 3 * k_page_size;
+            assert(state.run() == run_status::halted);
+            assert(state.cpu.get(r2) == 1234);
+
+            // ROM nobody wrote reads as zeros
+            assert(state.cpu.get(r3) == 0);
+            if (mode == memory_mode::paged) {
+                assert(state.ram.num_allocated_pages() == 1);
+            }
+
+            state.cpu.instr_ptr = iomap::k_rom_base;
+            state.cpu.get(r0) = last_word + k_word_size;
+            assert(state.run() == run_status::faulted);
+            assert(state.fault_addr == last_word + k_word_size);
+        }
+    }
+
+    // nothing is decoded until there's something to decode
+    system_state a{{}, layout};
+    assert(a.decoded_words == 0);
+    a.set_rom(prog);
+    assert(a.decoded_words == prog.size());
+    assert(a.decoded_rom[0].op == opcode::store);
+
+    memory_layout too_big;
+    too_big.ram_size = ~word_t{0} & ~(k_page_size - 1);
+    assert(!too_big.valid());
+}
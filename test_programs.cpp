@@ -0,0 +1,111 @@
+#include "test_programs.h"
+
+#include "assembler.h"
+#include "iomap.h"
+
+#include <format>
+#include <string>
+
+std::vector<uint8_t> make_fib_rom()
+{
+    std::string prog = std::format(R"(
+
+    # initialize stack pointer to k_ram_base
+    set r14 {}
+
+    # test sets the function argument in r0
+
+    # call fib (sets r15 to return address)
+    call fib
+    halt
+
+# argument is in r0, return value is in r13, stack pointer r14, return address r15
+# callee r15
+fib:
+    set r1 1
+    compare r0 r1     # compare x with 1
+    jump.gt recurse   # x > 1, recursive case
+    set r13 1         # set return value to 1
+    ijump r15         # return
+
+recurse:
+    set r2 4
+
+    store r14 r15     # store r15 (return address) onto the stack
+    add r14 r2        # increment stack pointer
+
+    store r14 r0      # store r0 (function argument) onto the stack
+    add r14 r2        # increment stack pointer
+
+    set r2 1
+    sub r0 r2         # compute x = x - 1
+
+    call fib          # recurse, calling fib(x-1)
+
+    set r2 4
+    sub r14 r2        # decrement stack pointer
+    load r0 r14       # pop r0 (function argument) off the stack
+
+    store r14 r13     # store return value from fib(x-1) on the stack
+    add r14 r2        # increment stack pointer
+
+    set r2 2
+    sub r0 r2         # compute x = x - 2
+
+    call fib          # recurse, calling fib(x-2)
+
+    set r2 4
+    sub r14 r2        # decrement stack pointer
+    load r1 r14       # pop fib(x-1) into r1
+
+    add r13 r1        # set ret = fib(x-2) + fib(x-1)
+
+    sub r14 r2        # decrement stack pointer
+    load r15 r14      # pop return address off the stack
+    ijump r15         # return
+
+)",
+                                   iomap::k_ram_base);
+
+    return assemble(prog);
+}
+
+word_t host_fib(word_t x)
+{
+    if (x <= 1) {
+        return 1;
+    }
+    return host_fib(x - 1) + host_fib(x - 2);
+}
+
+std::vector<uint8_t> make_branchy_rom(word_t iterations)
+{
+    std::string prog = std::format(R"(
+    set r1 {}
+    set r2 1
+    set r3 3
+    set r0 0
+    set r5 0
+loop:
+    add r0 r2
+    add r5 r2
+    compare r5 r3
+    jump.ne no_wrap
+    set r5 0
+    add r6 r2
+no_wrap:
+    compare r5 r2
+    jump.eq one
+    add r7 r2
+    jump next
+one:
+    add r8 r2
+next:
+    compare r0 r1
+    jump.lt loop
+    halt
+)",
+                                   iterations);
+
+    return assemble(prog);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "cpu_base.h"
+
+#include <cstdint>
+#include <vector>
+
+// Guest programs shared between tests and benchmarks.
+
+// Recursive fibonacci. The argument goes in r0 and the result comes back in r13, RAM is used for
+// the stack.
+std::vector<uint8_t> make_fib_rom();
+
+// Host reference for make_fib_rom().
+word_t host_fib(word_t x);
+
+// A loop with data-dependent branches on every iteration: counts r0 up to iterations while
+// cycling r5 through 1, 2, 0 and bumping r8 when r5 is 1 and r7 otherwise. r6 counts how many
+// times r5 wrapped. Ends with r0 == iterations.
+std::vector<uint8_t> make_branchy_rom(word_t iterations);
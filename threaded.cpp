@@ -0,0 +1,437 @@
+#include "threaded.h"
+
+#include "cpu_base.h"
+#include "decoded_instr.h"
+#include "fusion.h"
+#include "instr.h"
+#include "iomap.h"
+#include "opcode.h"
+#include "preprocessor.h"
+#include "system_state.h"
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <utility>
+
+// Direct-threaded engine. Every decoded_instr carries a pointer to its handler, and every handler
+// ends by tail calling the handler of the next instruction, so each guest instruction gets its own
+// indirect branch (and its own slot in the host branch predictor) instead of all of them sharing
+// the one behind the switch in system_state::run_interp(). cpu.instr_ptr is only written back when
+// we leave the engine; in between the current instruction is just a pointer into decoded_rom.
+//
+// The instruction budget is only looked at by control transfers, which use DISPATCH_BLOCK to pay
+// for the whole of the block they're about to enter up front.
+
+#define DISPATCH(next) MUSTTAIL return (next)->handler(state, (next))
+
+#define DISPATCH_BLOCK(next)                                                                       \
+    if (!enter_block(state, (next))) {                                                             \
+        return;                                                                                    \
+    }                                                                                              \
+    DISPATCH(next)
+
+static word_t addr_of(system_state const * state, decoded_instr const * di)
+{
+    return iomap::k_rom_base + static_cast<word_t>(di - state->decoded_rom.get()) * k_word_size;
+}
+
+static decoded_instr const * instr_at(system_state const * state, word_t addr)
+{
+    word_t rom_offset = addr - iomap::k_rom_base;
+    assert(rom_offset < state->rom.size() && rom_offset % k_word_size == 0);
+    return state->decoded_rom.get() + rom_offset / k_word_size;
+}
+
+static uint32_t block_length(system_state const * state, decoded_instr const * di)
+{
+    return state->block_lengths[di - state->decoded_rom.get()];
+}
+
+// Charge for the block starting at next, or if the budget doesn't cover all of it, stop in front
+// of it and leave the rest to system_state::run_bounded. So does ROM that isn't decoded, which has
+// no handlers, see system_state::decoded_words.
+static bool enter_block(system_state * state, decoded_instr const * next)
+{
+    uint32_t length = block_length(state, next);
+    if (state->budget < length || next->handler == nullptr) {
+        state->cpu.instr_ptr = addr_of(state, next);
+        return false;
+    }
+    state->budget -= length;
+    return true;
+}
+
+static void handle_halt(system_state * state, decoded_instr const * di)
+{
+    state->cpu.instr_ptr = addr_of(state, di);
+}
+
+static decoded_instr const * jump_next(system_state const * state, decoded_instr const * di)
+{
+    if (state->cpu.is_taken(di->flag)) {
+        return instr_at(state, addr_of(state, di) + di->offset());
+    }
+    return di + 1;
+}
+
+static void handle_jump(system_state * state, decoded_instr const * di)
+{
+    decoded_instr const * next = jump_next(state, di);
+    DISPATCH_BLOCK(next);
+}
+
+static void handle_ijump(system_state * state, decoded_instr const * di)
+{
+    decoded_instr const * next = di + 1;
+    if (state->cpu.is_taken(di->flag)) {
+        next = instr_at(state, state->cpu.get(di->lhs));
+    }
+    DISPATCH_BLOCK(next);
+}
+
+static void handle_call(system_state * state, decoded_instr const * di)
+{
+    word_t addr = addr_of(state, di);
+    state->cpu.get(r15) = addr + k_word_size;
+    decoded_instr const * next = instr_at(state, addr + di->offset());
+    DISPATCH_BLOCK(next);
+}
+
+static void handle_invalid(system_state * state, decoded_instr const * di)
+{
+    state->cpu.instr_ptr = addr_of(state, di);
+    assert(false && "unknown opcode");
+}
+
+// Handlers specialized on their register, flag and width operands, so all that's left at run time is
+// the actual work on cpu.registers at fixed offsets. There's one per opcode and operand
+// combination, with the tables below generated from reg_def.h and cmp_flag_def.h.
+
+template <reg dest>
+struct set_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        state->cpu.registers[std::to_underlying(dest)] = di->imm;
+        DISPATCH(di + 1);
+    }
+};
+
+template <reg dest, reg op1>
+struct add_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        word_t * registers = state->cpu.registers;
+        registers[std::to_underlying(dest)] += registers[std::to_underlying(op1)];
+        DISPATCH(di + 1);
+    }
+};
+
+template <reg dest, reg op1>
+struct sub_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        word_t * registers = state->cpu.registers;
+        registers[std::to_underlying(dest)] -= registers[std::to_underlying(op1)];
+        DISPATCH(di + 1);
+    }
+};
+
+template <reg op1, reg op2>
+struct compare_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        word_t const * registers = state->cpu.registers;
+        state->cpu.compare(registers[std::to_underlying(op1)], registers[std::to_underlying(op2)]);
+        DISPATCH(di + 1);
+    }
+};
+
+template <word_t width>
+struct store_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        state->execute_store<width>(di->lhs, di->rhs);
+        DISPATCH(di + 1);
+    }
+};
+
+template <word_t width>
+struct load_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        state->execute_load<width>(di->rhs, di->lhs);
+        DISPATCH(di + 1);
+    }
+};
+
+template <cmp_flag flag>
+struct jump_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        decoded_instr const * next = di + 1;
+        if (state->cpu.is_taken(flag)) {
+            next = instr_at(state, addr_of(state, di) + di->offset());
+        }
+        DISPATCH_BLOCK(next);
+    }
+};
+
+template <cmp_flag flag, reg loc>
+struct ijump_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        decoded_instr const * next = di + 1;
+        if (state->cpu.is_taken(flag)) {
+            next = instr_at(state, state->cpu.registers[std::to_underlying(loc)]);
+        }
+        DISPATCH_BLOCK(next);
+    }
+};
+
+// a pointer into one of the second-level tables below
+using handler_row = instr_handler const *;
+
+template <template <reg> typename handler>
+static instr_handler constexpr k_reg_table[] = {
+#define X(x) &handler<x>::handle,
+#include "reg_def.h"
+#undef X
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+};
+
+template <template <reg, reg> typename handler, reg lhs>
+static instr_handler constexpr k_reg_pair_row[] = {
+#define X(x) &handler<lhs, x>::handle,
+#include "reg_def.h"
+#undef X
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+};
+
+template <template <reg, reg> typename handler>
+static handler_row constexpr k_reg_pair_table[] = {
+#define X(x) k_reg_pair_row<handler, x>,
+#include "reg_def.h"
+#undef X
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+};
+
+template <template <cmp_flag> typename handler>
+static instr_handler constexpr k_flag_table[] = {
+#define X(x) &handler<cmp_flag::x>::handle,
+#include "cmp_flag_def.h"
+#undef X
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+};
+
+template <cmp_flag flag>
+static instr_handler constexpr k_ijump_row[] = {
+#define X(x) &ijump_handler<flag, x>::handle,
+#include "reg_def.h"
+#undef X
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+};
+
+static handler_row constexpr k_ijump_table[] = {
+#define X(x) k_ijump_row<cmp_flag::x>,
+#include "cmp_flag_def.h"
+#undef X
+#undef ENUM_TYPE_NAME
+#undef ENUM_UNDERLYING_TYPE
+};
+
+// one handler per instr::k_load_store_widths, so in the same order as width_index()
+template <template <word_t> typename handler>
+static auto constexpr k_width_table = []<size_t... i>(std::index_sequence<i...>) {
+    return std::array<instr_handler, sizeof...(i)>{
+        &handler<instr::k_load_store_widths[i]>::handle...};
+}(std::make_index_sequence<std::size(instr::k_load_store_widths)>{});
+
+static_assert(std::size(k_reg_table<set_handler>) == k_num_registers);
+static_assert(std::size(k_flag_table<jump_handler>) == std::size(k_ijump_table));
+
+static bool valid_flag(cmp_flag flag)
+{
+    return std::to_underlying(flag) < std::size(k_ijump_table);
+}
+
+// Superinstructions, see fusion.h. di is the first of the pair and di + 1 the second.
+
+static void count_fusion(system_state * state, fusion f)
+{
+    ++state->fusions.executed[std::to_underlying(f)];
+}
+
+static void handle_compare_jump(system_state * state, decoded_instr const * di)
+{
+    count_fusion(state, fusion::compare_jump);
+    state->execute_compare(di->lhs, di->rhs);
+    decoded_instr const * next = jump_next(state, di + 1);
+    DISPATCH_BLOCK(next);
+}
+
+static void handle_set_add(system_state * state, decoded_instr const * di)
+{
+    count_fusion(state, fusion::set_add);
+    state->execute_set(di->lhs, di->imm);
+    state->cpu.add(di[1].lhs, di[1].rhs);
+    DISPATCH(di + 2);
+}
+
+static void handle_set_sub(system_state * state, decoded_instr const * di)
+{
+    count_fusion(state, fusion::set_sub);
+    state->execute_set(di->lhs, di->imm);
+    state->cpu.sub(di[1].lhs, di[1].rhs);
+    DISPATCH(di + 2);
+}
+
+template <word_t width>
+struct set_store_handler
+{
+    static void handle(system_state * state, decoded_instr const * di)
+    {
+        count_fusion(state, fusion::set_store);
+        state->execute_set(di->lhs, di->imm);
+        state->execute_store<width>(di[1].lhs, di[1].rhs);
+        DISPATCH(di + 2);
+    }
+};
+
+static instr_handler fused_handler(fusion f, decoded_instr const & second)
+{
+    switch (f) {
+    case fusion::compare_jump:
+        return &handle_compare_jump;
+    case fusion::set_add:
+        return &handle_set_add;
+    case fusion::set_sub:
+        return &handle_set_sub;
+    case fusion::set_store:
+        return k_width_table<set_store_handler>[instr::width_index(second.imm)];
+    }
+    assert(false && "unknown fusion");
+    return nullptr;
+}
+
+instr_handler threaded_handler(decoded_instr const & di, decoded_instr const * next)
+{
+    if (next != nullptr) {
+        if (std::optional<fusion> f = find_fusion(di, *next)) {
+            return fused_handler(*f, *next);
+        }
+    }
+
+    auto const lhs = std::to_underlying(di.lhs);
+    auto const rhs = std::to_underlying(di.rhs);
+    auto const flag = std::to_underlying(di.flag);
+    switch (di.op) {
+    case opcode::set:
+        return k_reg_table<set_handler>[lhs];
+    case opcode::store:
+        return k_width_table<store_handler>[instr::width_index(di.imm)];
+    case opcode::load:
+        return k_width_table<load_handler>[instr::width_index(di.imm)];
+    case opcode::add:
+        return k_reg_pair_table<add_handler>[lhs][rhs];
+    case opcode::sub:
+        return k_reg_pair_table<sub_handler>[lhs][rhs];
+    case opcode::halt:
+        return &handle_halt;
+    case opcode::compare:
+        return k_reg_pair_table<compare_handler>[lhs][rhs];
+    case opcode::jump:
+        // flags that don't exist get the generic handler, which asserts if they're ever executed
+        return valid_flag(di.flag) ? k_flag_table<jump_handler>[flag] : &handle_jump;
+    case opcode::ijump:
+        return valid_flag(di.flag) ? k_ijump_table[flag][lhs] : &handle_ijump;
+    case opcode::call:
+        return &handle_call;
+    default:
+        return &handle_invalid;
+    }
+}
+
+// Stands in for the handler of a watched instruction.
+static void handle_trap(system_state * state, decoded_instr const * di)
+{
+    // we paid for the rest of the block on the way in but aren't going to run it
+    state->budget += block_length(state, di);
+    state->cpu.instr_ptr = addr_of(state, di);
+}
+
+// Stands in for the handler of the first word past system_state::decoded_words. Blocks end in front
+// of it, so there's nothing to pay back.
+static void handle_blank(system_state * state, decoded_instr const * di)
+{
+    state->cpu.instr_ptr = addr_of(state, di);
+}
+
+instr_handler blank_handler()
+{
+    return &handle_blank;
+}
+
+void system_state::run_threaded(std::optional<word_t> watch_addr)
+{
+    if (watch_addr) {
+        set_watch_trap(*watch_addr);
+    }
+
+    decoded_instr const * di = instr_at(this, cpu.instr_ptr);
+    if (enter_block(this, di)) {
+        di->handler(this, di);
+    }
+
+    // a fault skips this, so run_bounded does it too
+    clear_watch_trap();
+}
+
+void system_state::set_watch_trap(word_t watch_addr)
+{
+    // Point the watched instruction at handle_trap, and make sure the one before it isn't fused
+    // with it, for as long as we're running.
+    word_t rom_offset = watch_addr - iomap::k_rom_base;
+    if (rom_offset >= rom.size() || rom_offset % k_word_size != 0) {
+        return;
+    }
+
+    // forks running at the same time mustn't see the trap
+    unshare_decoded_rom();
+    decoded_instr * watched = decoded_rom.get() + rom_offset / k_word_size;
+    watch_trap.watched = watched;
+    watch_trap.saved[1] = watched->handler;
+    watched->handler = &handle_trap;
+    if (watched != decoded_rom.get()) {
+        watch_trap.saved[0] = watched[-1].handler;
+        watched[-1].handler = threaded_handler(watched[-1]);
+    }
+}
+
+void system_state::clear_watch_trap()
+{
+    decoded_instr * watched = watch_trap.watched;
+    if (watched == nullptr) {
+        return;
+    }
+    watched->handler = watch_trap.saved[1];
+    if (watched != decoded_rom.get()) {
+        watched[-1].handler = watch_trap.saved[0];
+    }
+    watch_trap.watched = nullptr;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "decoded_instr.h"
+
+// Handler the direct-threaded engine should use for di, given the instruction that follows it in
+// ROM (if any), which may be fused into it. Anything that isn't a valid instruction gets a handler
+// that asserts when executed.
+instr_handler threaded_handler(decoded_instr const & di, decoded_instr const * next = nullptr);
+
+// Handler for the first ROM word past system_state::decoded_words, which stops the engine in front
+// of it.
+instr_handler blank_handler();
@@ -0,0 +1,172 @@
+#include "vm_scheduler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <span>
+#include <utility>
+
+struct vm_scheduler::task
+{
+    vm_job job;
+
+    // created on the first time slice, so that it happens on a worker thread
+    std::unique_ptr<system_state> state;
+    uint64_t remaining;
+    size_t num_slices = 0;
+    std::promise<vm_result> result;
+};
+
+vm_scheduler::vm_scheduler(size_t num_threads, uint64_t slice_instrs)
+    : slice_instrs_{slice_instrs}
+{
+    assert(slice_instrs > 0);
+    num_threads = std::max<size_t>(num_threads, 1);
+    for (size_t i = 0; i < num_threads; ++i) {
+        workers_.push_back(std::make_unique<worker>());
+    }
+    // only start them once workers_ won't change any more
+    for (size_t i = 0; i < num_threads; ++i) {
+        workers_[i]->thread = std::thread{[this, i] { work(i); }};
+    }
+}
+
+vm_scheduler::~vm_scheduler()
+{
+    {
+        std::lock_guard lock{idle_mutex_};
+        stopping_ = true;
+    }
+    idle_cv_.notify_all();
+    for (std::unique_ptr<worker> & worker : workers_) {
+        worker->thread.join();
+    }
+}
+
+std::future<vm_result> vm_scheduler::submit(vm_job job)
+{
+    assert(job.rom || job.image);
+    auto new_task = std::make_unique<task>();
+    new_task->remaining = job.max_instrs;
+    new_task->job = std::move(job);
+    std::future<vm_result> result = new_task->result.get_future();
+    size_t index = next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    push(index, std::move(new_task), false);
+    return result;
+}
+
+std::vector<std::future<vm_result>> vm_scheduler::submit(std::vector<vm_job> jobs)
+{
+    std::vector<std::future<vm_result>> results;
+    results.reserve(jobs.size());
+    for (vm_job & job : jobs) {
+        results.push_back(submit(std::move(job)));
+    }
+    return results;
+}
+
+void vm_scheduler::push(size_t worker_index, std::unique_ptr<task> task, bool front)
+{
+    worker & worker = *workers_[worker_index];
+    {
+        std::lock_guard lock{worker.mutex};
+        if (front) {
+            worker.tasks.push_front(std::move(task));
+        } else {
+            worker.tasks.push_back(std::move(task));
+        }
+    }
+
+    // Pairs with the increment of num_sleeping_ in work(): either the sleeper sees the new
+    // num_queued_ before it waits, or we see it sleeping and wake it up.
+    num_queued_.fetch_add(1);
+    if (num_sleeping_.load() > 0) {
+        {
+            std::lock_guard lock{idle_mutex_};
+        }
+        idle_cv_.notify_one();
+    }
+}
+
+std::unique_ptr<vm_scheduler::task> vm_scheduler::find_task(size_t self)
+{
+    {
+        worker & own = *workers_[self];
+        std::lock_guard lock{own.mutex};
+        if (!own.tasks.empty()) {
+            std::unique_ptr<task> found = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            num_queued_.fetch_sub(1);
+            return found;
+        }
+    }
+
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        worker & victim = *workers_[(self + i) % workers_.size()];
+        std::lock_guard lock{victim.mutex};
+        if (!victim.tasks.empty()) {
+            std::unique_ptr<task> found = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            num_queued_.fetch_sub(1);
+            num_steals_.fetch_add(1, std::memory_order_relaxed);
+            return found;
+        }
+    }
+    return nullptr;
+}
+
+bool vm_scheduler::run_slice(task & task)
+{
+    if (!task.state) {
+        task.state = std::make_unique<system_state>(std::span<word_t const>{}, task.job.layout);
+        if (task.job.engine) {
+            task.state->engine = *task.job.engine;
+        }
+        if (task.job.image) {
+            task.state->load_rom(task.job.image);
+        } else {
+            task.state->set_rom(*task.job.rom);
+        }
+        memcpy(task.state->cpu.registers, task.job.registers, sizeof(task.job.registers));
+    }
+
+    ++task.num_slices;
+    uint64_t slice = std::min(slice_instrs_, task.remaining);
+    run_status status = task.state->run_for(slice);
+    if (status == run_status::budget_exhausted) {
+        // run_for is exact, so we used all of it
+        task.remaining -= slice;
+        if (task.remaining > 0) {
+            return false;
+        }
+    }
+
+    task.result.set_value(vm_result{
+        .status = status,
+        .cpu = task.state->cpu,
+        .console = std::move(task.state->console),
+        .num_slices = task.num_slices,
+    });
+    return true;
+}
+
+void vm_scheduler::work(size_t self)
+{
+    while (true) {
+        if (std::unique_ptr<task> current = find_task(self)) {
+            if (!run_slice(*current)) {
+                // to the back of the line, behind everything else in our deque
+                push(self, std::move(current), true);
+            }
+            continue;
+        }
+
+        std::unique_lock lock{idle_mutex_};
+        num_sleeping_.fetch_add(1);
+        idle_cv_.wait(lock, [&] { return stopping_ || num_queued_.load() > 0; });
+        num_sleeping_.fetch_sub(1);
+        if (stopping_ && num_queued_.load() == 0) {
+            return;
+        }
+    }
+}
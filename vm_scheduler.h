@@ -0,0 +1,114 @@
+#pragma once
+
+#include "cpu_base.h"
+#include "iomap.h"
+#include "reg.h"
+#include "rom_image.h"
+#include "system_state.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// A guest program to run from reset with some registers preset.
+struct vm_job
+{
+    // shared, since batches usually run the same program over and over with different inputs
+    std::shared_ptr<std::vector<uint8_t> const> rom;
+
+    // or a ROM image to load instead, which every job using it shares without copying
+    std::shared_ptr<rom_image const> image;
+
+    word_t registers[k_num_registers]{};
+
+    // nothing means the system_state default
+    std::optional<enum engine> engine;
+
+    memory_layout layout;
+
+    // give up on the job after this many instructions
+    uint64_t max_instrs = system_state::k_unlimited;
+};
+
+struct vm_result
+{
+    // halted, faulted, or budget_exhausted if the job hit max_instrs first
+    run_status status;
+    cpu cpu;
+    std::vector<uint8_t> console;
+
+    // how many time slices it took
+    size_t num_slices = 0;
+};
+
+// Runs vm_jobs on a pool of threads. Each thread has its own deque of jobs and steals from the
+// others when that runs dry. Jobs run for at most a time slice of slice_instrs instructions at a
+// time (see system_state::run_for) before going to the back of the line, so a few long jobs
+// can't hold up everything else.
+struct vm_scheduler
+{
+    static uint64_t constexpr k_default_slice_instrs = 1 << 16;
+
+    explicit vm_scheduler(size_t num_threads = std::thread::hardware_concurrency(),
+                          uint64_t slice_instrs = k_default_slice_instrs);
+
+    // Waits for everything submitted so far to finish.
+    ~vm_scheduler();
+
+    vm_scheduler(vm_scheduler const &) = delete;
+    vm_scheduler & operator=(vm_scheduler const &) = delete;
+
+    std::future<vm_result> submit(vm_job job);
+    std::vector<std::future<vm_result>> submit(std::vector<vm_job> jobs);
+
+    size_t num_threads() const
+    {
+        return workers_.size();
+    }
+
+    // how many times a thread took a job from another thread's deque
+    size_t num_steals() const
+    {
+        return num_steals_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct task;
+
+    struct worker
+    {
+        // the owner pushes and pops at the back, thieves and preempted jobs use the front
+        std::mutex mutex;
+        std::deque<std::unique_ptr<task>> tasks;
+        std::thread thread;
+    };
+
+    void work(size_t self);
+    std::unique_ptr<task> find_task(size_t self);
+    void push(size_t worker_index, std::unique_ptr<task> task, bool front);
+
+    // run one slice, returns true if the task is done
+    bool run_slice(task & task);
+
+    uint64_t const slice_instrs_;
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::atomic<size_t> next_worker_ = 0;
+
+    // tasks sitting in some deque, as opposed to running or done
+    std::atomic<size_t> num_queued_ = 0;
+    std::atomic<size_t> num_sleeping_ = 0;
+    std::atomic<size_t> num_steals_ = 0;
+
+    // idle threads wait here for num_queued_ to go up or for stopping_
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    bool stopping_ = false;
+};
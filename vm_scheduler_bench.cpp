@@ -0,0 +1,50 @@
+#include "bench.h"
+#include "log.h"
+#include "reg.h"
+#include "test_programs.h"
+#include "vm_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static logger logger{__FILE__};
+
+BENCH("vm_scheduler.fib")
+{
+    size_t const num_jobs = 256;
+    word_t const n = 12;
+    auto rom = std::make_shared<std::vector<uint8_t> const>(make_fib_rom());
+
+    size_t max_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    std::chrono::nanoseconds single_thread{};
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        vm_scheduler scheduler{threads};
+        std::chrono::nanoseconds per_batch = time_per_call([&] {
+            std::vector<std::future<vm_result>> results;
+            for (size_t i = 0; i < num_jobs; ++i) {
+                vm_job job;
+                job.rom = rom;
+                job.registers[std::to_underlying(r0)] = n;
+                results.push_back(scheduler.submit(std::move(job)));
+            }
+            for (std::future<vm_result> & result : results) {
+                if (result.get().cpu.get(r13) != host_fib(n)) {
+                    logger.abort("wrong result");
+                }
+            }
+        });
+        if (threads == 1) {
+            single_thread = per_batch;
+        }
+        logger.info("  {:>3} threads: {:>8.0f} jobs/s, {:.2f}x one thread, {} steals",
+                    threads,
+                    num_jobs * 1e9 / per_batch.count(),
+                    static_cast<double>(single_thread.count()) / per_batch.count(),
+                    scheduler.num_steals());
+    }
+}
@@ -0,0 +1,75 @@
+#include "vm_scheduler.h"
+
+#include "assembler.h"
+#include "reg.h"
+#include "system_state.h"
+#include "test.h"
+#include "test_programs.h"
+
+#include <cassert>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+
+TEST("vm_scheduler.fib")
+{
+    auto rom = std::make_shared<std::vector<uint8_t> const>(make_fib_rom());
+    for (engine eng : k_all_engines) {
+        // small slices so that jobs get preempted and moved around
+        vm_scheduler scheduler{4, 500};
+        std::vector<vm_job> jobs;
+        for (word_t i = 0; i < 40; ++i) {
+            vm_job job;
+            job.rom = rom;
+            job.engine = eng;
+            job.registers[std::to_underlying(r0)] = i % 14;
+            jobs.push_back(job);
+        }
+
+        std::vector<std::future<vm_result>> results = scheduler.submit(std::move(jobs));
+        for (word_t i = 0; i < results.size(); ++i) {
+            vm_result result = results[i].get();
+            assert(result.status == run_status::halted);
+            assert(result.cpu.get(r13) == host_fib(i % 14));
+            assert(result.num_slices >= 1);
+        }
+    }
+}
+
+TEST("vm_scheduler.time_slicing")
+{
+    auto spin = std::make_shared<std::vector<uint8_t> const>(assemble(R"(
+loop:
+set r1 1
+add r0 r1
+jump.unc loop
+)"));
+    auto fib = std::make_shared<std::vector<uint8_t> const>(make_fib_rom());
+
+    // With one thread and the spinning job first, the short jobs only finish if the spinning one
+    // gets preempted. It then gets given up on.
+    vm_scheduler scheduler{1, 1000};
+    vm_job spin_job;
+    spin_job.rom = spin;
+    spin_job.max_instrs = 3000000;
+    std::future<vm_result> spinning = scheduler.submit(spin_job);
+    std::vector<std::future<vm_result>> short_jobs;
+    for (word_t i = 0; i < 8; ++i) {
+        vm_job job;
+        job.rom = fib;
+        job.registers[std::to_underlying(r0)] = i;
+        short_jobs.push_back(scheduler.submit(job));
+    }
+    for (word_t i = 0; i < short_jobs.size(); ++i) {
+        vm_result result = short_jobs[i].get();
+        assert(result.status == run_status::halted);
+        assert(result.cpu.get(r13) == host_fib(i));
+    }
+    assert(spinning.wait_for(std::chrono::seconds{0}) != std::future_status::ready);
+
+    vm_result result = spinning.get();
+    assert(result.status == run_status::budget_exhausted);
+    assert(result.cpu.get(r0) == 1000000);
+    assert(result.num_slices == 3000);
+}
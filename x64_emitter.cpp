@@ -0,0 +1,281 @@
+#include "x64_emitter.h"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+static int reg_num(x64_reg reg)
+{
+    return std::to_underlying(reg);
+}
+
+static bool fits_int8(int64_t value)
+{
+    return value >= std::numeric_limits<int8_t>::min()
+           && value <= std::numeric_limits<int8_t>::max();
+}
+
+void x64_emitter::byte(uint8_t b)
+{
+    if (cur_ == end_) {
+        overflowed_ = true;
+        return;
+    }
+    *cur_++ = b;
+}
+
+void x64_emitter::imm32(uint32_t imm)
+{
+    for (int i = 0; i < 4; ++i) {
+        byte(static_cast<uint8_t>(imm >> (8 * i)));
+    }
+}
+
+void x64_emitter::prefixes(int width, int reg_field, x64_rm const & rm)
+{
+    assert(width == 1 || width == 2 || width == 4 || width == 8);
+    if (width == 2) {
+        byte(0x66);
+    }
+
+    uint8_t rex = 0;
+    if (width == 8) {
+        rex |= 0x08;
+    }
+    if (reg_field & 8) {
+        rex |= 0x04;
+    }
+    if (rm.is_reg) {
+        if (reg_num(rm.reg) & 8) {
+            rex |= 0x01;
+        }
+    } else {
+        if (rm.mem.index && (reg_num(*rm.mem.index) & 8)) {
+            rex |= 0x02;
+        }
+        if (reg_num(rm.mem.base) & 8) {
+            rex |= 0x01;
+        }
+    }
+
+    // without a REX prefix, byte registers 4-7 are ah/ch/dh/bh rather than spl/bpl/sil/dil
+    bool needs_byte_rex = (reg_field >= 4 && reg_field < 8)
+                          || (rm.is_reg && reg_num(rm.reg) >= 4 && reg_num(rm.reg) < 8);
+    if (rex != 0 || (width == 1 && needs_byte_rex)) {
+        byte(0x40 | rex);
+    }
+}
+
+void x64_emitter::modrm(int reg_field, x64_rm const & rm)
+{
+    int const reg_bits = (reg_field & 7) << 3;
+    if (rm.is_reg) {
+        byte(0xc0 | reg_bits | (reg_num(rm.reg) & 7));
+        return;
+    }
+
+    int const base = reg_num(rm.mem.base) & 7;
+    int32_t const disp = rm.mem.disp;
+
+    // mod == 0 with a base of rbp/r13 means something else entirely, so those always get a
+    // displacement
+    int mod;
+    if (disp == 0 && base != 5) {
+        mod = 0;
+    } else if (fits_int8(disp)) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+
+    // rsp/r12 as a base can only be expressed with a SIB byte
+    if (rm.mem.index || base == 4) {
+        assert(!rm.mem.index || *rm.mem.index != x64_reg::rsp);
+        int index = rm.mem.index ? reg_num(*rm.mem.index) & 7 : 4;
+        byte((mod << 6) | reg_bits | 4);
+        byte((index << 3) | base);
+    } else {
+        byte((mod << 6) | reg_bits | base);
+    }
+
+    if (mod == 1) {
+        byte(static_cast<uint8_t>(disp));
+    } else if (mod == 2) {
+        imm32(static_cast<uint32_t>(disp));
+    }
+}
+
+void x64_emitter::op_rm(int width, uint8_t opcode, int reg_field, x64_rm const & rm)
+{
+    prefixes(width, reg_field, rm);
+    byte(opcode);
+    modrm(reg_field, rm);
+}
+
+void x64_emitter::op_rm(int width, uint8_t opcode0, uint8_t opcode1, int reg_field,
+                        x64_rm const & rm)
+{
+    prefixes(width, reg_field, rm);
+    byte(opcode0);
+    byte(opcode1);
+    modrm(reg_field, rm);
+}
+
+void x64_emitter::mov(x64_reg dst, x64_reg src, int width)
+{
+    mov(x64_rm{dst}, src, width);
+}
+
+void x64_emitter::mov(x64_rm dst, x64_reg src, int width)
+{
+    op_rm(width, width == 1 ? 0x88 : 0x89, reg_num(src), dst);
+}
+
+void x64_emitter::mov(x64_reg dst, x64_rm src, int width)
+{
+    op_rm(width, width == 1 ? 0x8a : 0x8b, reg_num(dst), src);
+}
+
+void x64_emitter::mov_imm(x64_rm dst, uint32_t imm)
+{
+    if (dst.is_reg) {
+        prefixes(4, 0, dst);
+        byte(0xb8 + (reg_num(dst.reg) & 7));
+    } else {
+        op_rm(4, 0xc7, 0, dst);
+    }
+    imm32(imm);
+}
+
+void x64_emitter::mov_imm64(x64_reg dst, uint64_t imm)
+{
+    byte(0x48 | ((reg_num(dst) & 8) ? 0x01 : 0x00));
+    byte(0xb8 + (reg_num(dst) & 7));
+    imm32(static_cast<uint32_t>(imm));
+    imm32(static_cast<uint32_t>(imm >> 32));
+}
+
+void x64_emitter::movzx8(x64_reg dst, x64_rm src)
+{
+    // the source is a byte register, so it needs the same REX treatment as a width 1 op
+    bool byte_src = src.is_reg && reg_num(src.reg) >= 4 && reg_num(src.reg) < 8;
+    prefixes(byte_src ? 1 : 4, reg_num(dst), src);
+    byte(0x0f);
+    byte(0xb6);
+    modrm(reg_num(dst), src);
+}
+
+void x64_emitter::alu(x64_alu op, x64_rm dst, x64_reg src, int width)
+{
+    assert(width == 4 || width == 8);
+    op_rm(width, std::to_underlying(op) * 8 + 1, reg_num(src), dst);
+}
+
+void x64_emitter::alu(x64_alu op, x64_reg dst, x64_rm src, int width)
+{
+    assert(width == 4 || width == 8);
+    op_rm(width, std::to_underlying(op) * 8 + 3, reg_num(dst), src);
+}
+
+void x64_emitter::alu_imm(x64_alu op, x64_rm dst, int32_t imm, int width)
+{
+    assert(width == 4 || width == 8);
+    if (fits_int8(imm)) {
+        op_rm(width, 0x83, std::to_underlying(op), dst);
+        byte(static_cast<uint8_t>(imm));
+    } else {
+        op_rm(width, 0x81, std::to_underlying(op), dst);
+        imm32(static_cast<uint32_t>(imm));
+    }
+}
+
+void x64_emitter::test_imm(x64_rm dst, uint32_t imm)
+{
+    op_rm(4, 0xf7, 0, dst);
+    imm32(imm);
+}
+
+void x64_emitter::shift_imm(x64_shift op, x64_rm dst, uint8_t imm, int width)
+{
+    assert(width == 4 || width == 8);
+    op_rm(width, 0xc1, std::to_underlying(op), dst);
+    byte(imm);
+}
+
+void x64_emitter::cmov(x64_cond cond, x64_reg dst, x64_rm src)
+{
+    op_rm(4, 0x0f, 0x40 + std::to_underlying(cond), reg_num(dst), src);
+}
+
+void x64_emitter::push(x64_reg reg)
+{
+    if (reg_num(reg) & 8) {
+        byte(0x41);
+    }
+    byte(0x50 + (reg_num(reg) & 7));
+}
+
+void x64_emitter::pop(x64_reg reg)
+{
+    if (reg_num(reg) & 8) {
+        byte(0x41);
+    }
+    byte(0x58 + (reg_num(reg) & 7));
+}
+
+void x64_emitter::call(x64_reg target)
+{
+    op_rm(4, 0xff, 2, target);
+}
+
+void x64_emitter::jmp(x64_reg target)
+{
+    op_rm(4, 0xff, 4, target);
+}
+
+void x64_emitter::ret()
+{
+    byte(0xc3);
+}
+
+uint8_t * x64_emitter::jmp(uint8_t const * target)
+{
+    byte(0xe9);
+    uint8_t * rel32 = cur_;
+    imm32(0);
+    if (overflowed_) {
+        return nullptr;
+    }
+    if (target != nullptr) {
+        patch_rel32(rel32, target);
+    }
+    return rel32;
+}
+
+uint8_t * x64_emitter::jcc(x64_cond cond, uint8_t const * target)
+{
+    byte(0x0f);
+    byte(0x80 + std::to_underlying(cond));
+    uint8_t * rel32 = cur_;
+    imm32(0);
+    if (overflowed_) {
+        return nullptr;
+    }
+    if (target != nullptr) {
+        patch_rel32(rel32, target);
+    }
+    return rel32;
+}
+
+void x64_emitter::patch_rel32(uint8_t * rel32, uint8_t const * target)
+{
+    if (rel32 == nullptr) {
+        return;
+    }
+    int64_t delta = target - (rel32 + 4);
+    assert(delta >= std::numeric_limits<int32_t>::min()
+           && delta <= std::numeric_limits<int32_t>::max());
+    int32_t value = static_cast<int32_t>(delta);
+    memcpy(rel32, &value, sizeof(value));
+}
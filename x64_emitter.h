@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// Just enough of an x86-64 encoder for the JIT. Only the instruction forms the JIT actually uses
+// are supported, operand widths are in bytes.
+
+enum class x64_reg : uint8_t
+{
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15,
+};
+
+// condition codes, in encoding order
+enum class x64_cond : uint8_t
+{
+    o,
+    no,
+    b,
+    ae,
+    e,
+    ne,
+    be,
+    a,
+    s,
+    ns,
+    p,
+    np,
+    l,
+    ge,
+    le,
+    g,
+};
+
+// the "/digit" of the classic two-operand ALU instructions
+enum class x64_alu : uint8_t
+{
+    add = 0,
+    or_ = 1,
+    and_ = 4,
+    sub = 5,
+    xor_ = 6,
+    cmp = 7,
+};
+
+// the "/digit" of the shift-by-immediate instructions
+enum class x64_shift : uint8_t
+{
+    shl = 4,
+    shr = 5,
+};
+
+// [base + index + disp]
+struct x64_mem
+{
+    x64_reg base;
+    std::optional<x64_reg> index;
+    int32_t disp = 0;
+};
+
+// A register or memory operand, i.e. whatever can go in the r/m half of a ModRM byte.
+struct x64_rm
+{
+    x64_rm(x64_reg reg)
+        : is_reg{true}
+        , reg{reg}
+        , mem{}
+    { }
+
+    x64_rm(x64_mem mem)
+        : is_reg{false}
+        , reg{}
+        , mem{mem}
+    { }
+
+    bool is_reg;
+    x64_reg reg;
+    x64_mem mem;
+};
+
+struct x64_emitter
+{
+    x64_emitter(uint8_t * buf, size_t capacity)
+        : begin_{buf}
+        , cur_{buf}
+        , end_{buf + capacity}
+    { }
+
+    uint8_t * cur() const
+    {
+        return cur_;
+    }
+
+    size_t size() const
+    {
+        return cur_ - begin_;
+    }
+
+    // Set once we've tried to emit past the end of the buffer. Nothing gets written past the end,
+    // but the code emitted so far is garbage.
+    bool overflowed() const
+    {
+        return overflowed_;
+    }
+
+    void mov(x64_reg dst, x64_reg src, int width);
+    void mov(x64_rm dst, x64_reg src, int width);
+    void mov(x64_reg dst, x64_rm src, int width);
+    void mov_imm(x64_rm dst, uint32_t imm);
+    void mov_imm64(x64_reg dst, uint64_t imm);
+    void movzx8(x64_reg dst, x64_rm src);
+
+    void alu(x64_alu op, x64_rm dst, x64_reg src, int width);
+    void alu(x64_alu op, x64_reg dst, x64_rm src, int width);
+    void alu_imm(x64_alu op, x64_rm dst, int32_t imm, int width);
+    void test_imm(x64_rm dst, uint32_t imm);
+    void shift_imm(x64_shift op, x64_rm dst, uint8_t imm, int width);
+    void cmov(x64_cond cond, x64_reg dst, x64_rm src);
+
+    void push(x64_reg reg);
+    void pop(x64_reg reg);
+    void call(x64_reg target);
+    void jmp(x64_reg target);
+    void ret();
+
+    // Branches with a 32-bit displacement. The returned pointer is the displacement field, which
+    // can be (re)pointed somewhere else with patch_rel32, or null if the branch didn't fit.
+    uint8_t * jmp(uint8_t const * target);
+    uint8_t * jcc(x64_cond cond, uint8_t const * target);
+
+    // does nothing for a null rel32, so callers don't have to check for overflow first
+    static void patch_rel32(uint8_t * rel32, uint8_t const * target);
+
+private:
+    void byte(uint8_t b);
+    void imm32(uint32_t imm);
+    void prefixes(int width, int reg_field, x64_rm const & rm);
+    void modrm(int reg_field, x64_rm const & rm);
+    void op_rm(int width, uint8_t opcode, int reg_field, x64_rm const & rm);
+    void op_rm(int width, uint8_t opcode0, uint8_t opcode1, int reg_field, x64_rm const & rm);
+
+    uint8_t * const begin_;
+    uint8_t * cur_;
+    uint8_t * const end_;
+    bool overflowed_ = false;
+};